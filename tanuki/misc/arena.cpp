@@ -0,0 +1,136 @@
+#include "arena.h"
+
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+
+namespace tanuki {
+namespace {
+const size_t initialCapacity = 4096;
+
+thread_local Arena *running = nullptr;
+
+// A released arena is kept for the next parse, so that a steady stream of
+// small parses doesn't hit malloc at all.
+thread_local std::unique_ptr<Arena> spare;
+}
+
+Arena::Arena() : m_cursor(nullptr), m_live(0) {}
+
+Arena::~Arena() {
+  for (const std::unique_ptr<Chunk> &chunk : m_chunks) {
+    if (chunk->live.load() > 0) {
+      free(chunk->begin);
+    }
+  }
+}
+
+Arena *Arena::current() { return running; }
+
+void Arena::open() {
+  if (spare) {
+    running = spare.release();
+  } else {
+    running = new Arena();
+  }
+
+  running->m_owner = std::this_thread::get_id();
+  running->m_live.store(1);
+}
+
+void Arena::close() {
+  Arena *arena = running;
+  running = nullptr;
+
+  if (arena != nullptr) {
+    arena->drop();
+  }
+}
+
+void *Arena::allocate(size_t size, size_t alignment) {
+  uintptr_t cursor = (uintptr_t)m_cursor;
+  uintptr_t aligned = (cursor + alignment - 1) & ~(uintptr_t)(alignment - 1);
+
+  if ((m_cursor == nullptr) ||
+      (aligned + size > (uintptr_t)m_chunks.back()->end)) {
+    size_t capacity =
+        (m_chunks.empty()
+             ? initialCapacity
+             : (size_t)(m_chunks.back()->end - m_chunks.back()->begin) * 2);
+
+    while (capacity < size + alignment) {
+      capacity *= 2;
+    }
+
+    char *begin = (char *)malloc(capacity);
+
+    if (begin == nullptr) {
+      throw std::bad_alloc();
+    }
+
+    // The chunk is held by the running parse, see drop()
+    m_chunks.emplace_back(new Chunk{begin, begin + capacity, {1}});
+
+    cursor = (uintptr_t)begin;
+    aligned = (cursor + alignment - 1) & ~(uintptr_t)(alignment - 1);
+  }
+
+  m_cursor = (char *)(aligned + size);
+  m_chunks.back()->live++;
+  m_live++;
+
+  return (void *)aligned;
+}
+
+void Arena::release(const void *block) {
+  // Chunks aren't added once the parse is closed, the newest ones hold most
+  // of the blocks
+  for (auto it = m_chunks.rbegin(); it != m_chunks.rend(); it++) {
+    Chunk &chunk = **it;
+
+    if ((block >= chunk.begin) && (block < chunk.end)) {
+      if (chunk.live.fetch_sub(1) == 1) {
+        free(chunk.begin);
+      }
+
+      break;
+    }
+  }
+
+  if (m_live.fetch_sub(1) == 1) {
+    recycle();
+  }
+}
+
+void Arena::drop() {
+  // The last chunk is kept for the next parse
+  for (size_t i = 0; (i + 1) < m_chunks.size(); i++) {
+    if (m_chunks[i]->live.fetch_sub(1) == 1) {
+      free(m_chunks[i]->begin);
+    }
+  }
+
+  if (m_live.fetch_sub(1) == 1) {
+    recycle();
+  }
+}
+
+void Arena::reset() {
+  // Every chunk but the last one was freed with its last block
+  if (!m_chunks.empty()) {
+    m_chunks.erase(m_chunks.begin(), m_chunks.end() - 1);
+    m_cursor = m_chunks.front()->begin;
+  }
+}
+
+void Arena::recycle() {
+  reset();
+
+  // Released on another thread, the arena isn't taken over by it
+  if (spare || (std::this_thread::get_id() != m_owner)) {
+    delete this;
+  } else {
+    spare.reset(this);
+  }
+}
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <thread>
+#include <vector>
+
+namespace tanuki {
+/**
+ * @brief The Arena class is a bump allocator for the results of one parse.
+ * Blocks are never freed one by one: a chunk is freed once the parse is
+ * closed and every block allocated from it was released, so a small result
+ * kept alive only holds its own chunk.
+ *
+ * Results may be released on any thread once the parse is over. The arena
+ * goes back to the thread which opened it for the next parse, or is freed
+ * when it is released elsewhere.
+ */
+class Arena {
+ public:
+  ~Arena();
+
+  /**
+   * @brief The arena of the running parse, nullptr if there is none.
+   */
+  static Arena *current();
+
+  static void open();
+  static void close();
+
+  void *allocate(size_t size, size_t alignment);
+  void release(const void *block);
+
+ private:
+  // Blocks allocated and not released yet, plus one while the parse runs
+  struct Chunk {
+    char *begin;
+    char *end;
+    std::atomic<size_t> live;
+  };
+
+  Arena();
+
+  void reset();
+  void recycle();
+  void drop();  // Releases the hold of the running parse
+
+  std::vector<std::unique_ptr<Chunk>> m_chunks;
+  char *m_cursor;
+  std::atomic<size_t> m_live;
+  std::thread::id m_owner;
+};
+}
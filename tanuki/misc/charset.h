@@ -0,0 +1,83 @@
+#pragma once
+
+#include <cstdint>
+
+namespace tanuki {
+/**
+ * @brief The CharSet class is a set of bytes, stored as a 256 bits mask.
+ */
+class CharSet {
+ public:
+  CharSet() : m_bits{0, 0, 0, 0} {}
+
+  void add(unsigned char c) { m_bits[c >> 6] |= ((uint64_t)1 << (c & 63)); }
+
+  void add(unsigned char from, unsigned char to) {
+    for (unsigned int c = from; c <= to; c++) {
+      add(c);
+    }
+  }
+
+  void fill() {
+    for (uint64_t &bits : m_bits) {
+      bits = ~(uint64_t)0;
+    }
+  }
+
+  void invert() {
+    for (uint64_t &bits : m_bits) {
+      bits = ~bits;
+    }
+  }
+
+  void merge(const CharSet &other) {
+    for (int i = 0; i < 4; i++) {
+      m_bits[i] |= other.m_bits[i];
+    }
+  }
+
+  bool has(unsigned char c) const {
+    return ((m_bits[c >> 6] >> (c & 63)) & 1);
+  }
+
+  int size() const {
+    int result = 0;
+
+    for (uint64_t bits : m_bits) {
+      result += __builtin_popcountll(bits);
+    }
+
+    return result;
+  }
+
+  /**
+   * @brief Number of bytes of the set lower than c.
+   */
+  int rank(unsigned char c) const {
+    int result = 0;
+
+    for (int i = 0; i < (c >> 6); i++) {
+      result += __builtin_popcountll(m_bits[i]);
+    }
+
+    uint64_t lower = (((uint64_t)1 << (c & 63)) - 1);
+
+    return (result + __builtin_popcountll(m_bits[c >> 6] & lower));
+  }
+
+  bool operator==(const CharSet &other) const {
+    for (int i = 0; i < 4; i++) {
+      if (m_bits[i] != other.m_bits[i]) {
+        return false;
+      }
+    }
+
+    return true;
+  }
+
+  bool operator!=(const CharSet &other) const { return !(*this == other); }
+
+ private:
+  uint64_t m_bits[4];
+};
+}
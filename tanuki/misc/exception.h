@@ -1,7 +1,24 @@
 #pragma once
 
 #include <exception>
+#include <string>
 
 class ParseError : public std::exception {};
 class NoExecuteDefinition : public std::exception {};
 class NullReferenceError : public std::exception {};
+class NotCopyableError : public std::exception {};
+class NotReleasableError : public std::exception {};
+class FileError : public std::exception {};
+class NotRegularError : public std::exception {};
+class DictionaryError : public std::exception {};
+
+// Names what couldn't be lowered
+class NotLoweredError : public std::exception {
+ public:
+  explicit NotLoweredError(const std::string &what) : m_what(what) {}
+
+  const char *what() const noexcept override { return m_what.c_str(); }
+
+ private:
+  std::string m_what;
+};
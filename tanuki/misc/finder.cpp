@@ -0,0 +1,82 @@
+#include "finder.h"
+
+#include <cstring>
+
+namespace tanuki {
+Finder::Finder() : m_kind(Every) {}
+
+Finder::Finder(const std::string &literal)
+    : m_kind((literal.size() == 1) ? Byte : Literal), m_literal(literal) {
+  int size = literal.size();
+
+  for (int &shift : m_shift) {
+    shift = size;
+  }
+
+  for (int i = 0; i < (size - 1); i++) {
+    m_shift[(unsigned char)literal[i]] = (size - 1 - i);
+  }
+}
+
+Finder::Finder(const CharSet &first) : m_kind(Set) {
+  CharSet outside(first);
+  outside.invert();
+
+  m_outside = CharScanner(outside);
+}
+
+int64_t Finder::find(const char *data, int64_t length, int64_t from) const {
+  if (from >= length) {
+    return length;
+  }
+
+  switch (m_kind) {
+    case Byte: {
+      const void *found = memchr(data + from, m_literal[0], length - from);
+
+      return ((found == nullptr) ? length : ((const char *)found - data));
+    }
+    case Literal: {
+      int size = m_literal.size();
+      const char *literal = m_literal.data();
+      unsigned char last = literal[size - 1];
+
+      // Shifts of a short literal are short, its first byte is looked for
+      // with memchr instead
+      if (size < 8) {
+        const char *end = (data + length - size + 1);
+
+        for (const char *p = (data + from); p < end; p++) {
+          p = (const char *)memchr(p, literal[0], end - p);
+
+          if (p == nullptr) {
+            break;
+          }
+
+          if (!memcmp(p + 1, literal + 1, size - 1)) {
+            return (p - data);
+          }
+        }
+
+        return length;
+      }
+
+      for (int64_t i = from; (i + size) <= length;) {
+        unsigned char c = data[i + size - 1];
+
+        if ((c == last) && !memcmp(data + i, literal, size - 1)) {
+          return i;
+        }
+
+        i += m_shift[c];
+      }
+
+      return length;
+    }
+    case Set:
+      return (from + m_outside.span(data + from, length - from));
+    default:
+      return from;
+  }
+}
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+#include "charset.h"
+#include "scanner.h"
+
+namespace tanuki {
+/**
+ * @brief The Finder class finds the next offset a token can match at, from
+ * what every match starts with: a literal (memchr on its first byte, Horspool
+ * for a long one) or else a set of bytes. A default Finder returns every
+ * offset.
+ */
+class Finder {
+ public:
+  Finder();
+  explicit Finder(const std::string &literal);
+  explicit Finder(const CharSet &first);
+
+  /**
+   * @brief First offset from from on which can start a match, length if
+   * there is none.
+   */
+  int64_t find(const char *data, int64_t length, int64_t from) const;
+
+ private:
+  enum Kind { Every, Byte, Literal, Set };
+
+  Kind m_kind;
+  std::string m_literal;
+  int m_shift[256];        // Horspool shift for the byte under the last one
+  CharScanner m_outside;   // Bytes which can't start a match
+};
+}
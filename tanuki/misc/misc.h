@@ -1,6 +1,9 @@
 #pragma once
 
+#include "charset.h"
 #include "exception.h"
+#include "finder.h"
 #include "helper.h"
 #include "ref.h"
+#include "scanner.h"
 #include "string.h"
@@ -8,18 +8,18 @@ ref_implement_all_operator(long);
 ref_implement_all_operator(long long);
 
 ref<int> operator"" _ref(unsigned long long int in) {
-  return ref<int>(new int(in));
+  return make_ref<int>(in);
 }
 
 ref<std::string> operator"" _ref(const char *in) {
-  return ref<std::string>(new std::string(in));
+  return make_ref<std::string>(in);
 }
 
 ref<double> operator"" _ref(long double in) {
-  return ref<double>(new double(in));
+  return make_ref<double>(in);
 }
 
 ref<char> operator"" _ref(char in) {
-  return ref<char>(new char(in));
+  return make_ref<char>(in);
 }
 }
@@ -1,15 +1,18 @@
 #pragma once
 
 #include <string>
+#include <new>
 #include <stack>
 #include <utility>
 
+#include "arena.h"
 #include "exception.h"
 #include "string.h"
 
 #include <iostream>
 #include <vector>
 #include <typeinfo>
+#include <type_traits>
 
 namespace tanuki {
 
@@ -21,7 +24,7 @@ namespace tanuki {
       throw NullReferenceError();                                           \
     }                                                                       \
                                                                             \
-    return ref<type>(new type(*(in1.m_intern->on)op * (in2.m_intern->on))); \
+    return make_ref<type>(*(in1.m_intern->on)op * (in2.m_intern->on));      \
   }
 
 #define ref_friend_all_operator(type)                               \
@@ -44,84 +47,84 @@ namespace tanuki {
       throw NullReferenceError();                                          \
     }                                                                      \
                                                                            \
-    return ref<type>(new type(*(in1.m_intern->on) + *(in2.m_intern->on))); \
+    return make_ref<type>(*(in1.m_intern->on) + *(in2.m_intern->on));      \
   }                                                                        \
   ref<type> operator-(const ref<type> &in1, const ref<type> &in2) {        \
     if (in1.isNull() or in2.isNull()) {                                    \
       throw NullReferenceError();                                          \
     }                                                                      \
                                                                            \
-    return ref<type>(new type(*(in1.m_intern->on) - *(in2.m_intern->on))); \
+    return make_ref<type>(*(in1.m_intern->on) - *(in2.m_intern->on));      \
   }                                                                        \
   ref<type> operator*(const ref<type> &in1, const ref<type> &in2) {        \
     if (in1.isNull() or in2.isNull()) {                                    \
       throw NullReferenceError();                                          \
     }                                                                      \
                                                                            \
-    return ref<type>(new type(*(in1.m_intern->on) * *(in2.m_intern->on))); \
+    return make_ref<type>(*(in1.m_intern->on) * *(in2.m_intern->on));      \
   }                                                                        \
   ref<type> operator/(const ref<type> &in1, const ref<type> &in2) {        \
     if (in1.isNull() or in2.isNull()) {                                    \
       throw NullReferenceError();                                          \
     }                                                                      \
                                                                            \
-    return ref<type>(new type(*(in1.m_intern->on) / *(in2.m_intern->on))); \
+    return make_ref<type>(*(in1.m_intern->on) / *(in2.m_intern->on));      \
   }                                                                        \
   ref<type> operator+(const ref<type> &in1, type in2) {                    \
     if (in1.isNull()) {                                                    \
       throw NullReferenceError();                                          \
     }                                                                      \
                                                                            \
-    return ref<type>(new type(*(in1.m_intern->on) + in2));                 \
+    return make_ref<type>(*(in1.m_intern->on) + in2);                      \
   }                                                                        \
   ref<type> operator-(const ref<type> &in1, type in2) {                    \
     if (in1.isNull()) {                                                    \
       throw NullReferenceError();                                          \
     }                                                                      \
                                                                            \
-    return ref<type>(new type(*(in1.m_intern->on) - in2));                 \
+    return make_ref<type>(*(in1.m_intern->on) - in2);                      \
   }                                                                        \
   ref<type> operator*(const ref<type> &in1, type in2) {                    \
     if (in1.isNull()) {                                                    \
       throw NullReferenceError();                                          \
     }                                                                      \
                                                                            \
-    return ref<type>(new type(*(in1.m_intern->on) * in2));                 \
+    return make_ref<type>(*(in1.m_intern->on) * in2);                      \
   }                                                                        \
   ref<type> operator/(const ref<type> &in1, type in2) {                    \
     if (in1.isNull()) {                                                    \
       throw NullReferenceError();                                          \
     }                                                                      \
                                                                            \
-    return ref<type>(new type(*(in1.m_intern->on) / in2));                 \
+    return make_ref<type>(*(in1.m_intern->on) / in2);                      \
   }                                                                        \
   ref<type> operator+(type in1, const ref<type> &in2) {                    \
     if (in2.isNull()) {                                                    \
       throw NullReferenceError();                                          \
     }                                                                      \
                                                                            \
-    return ref<type>(new type(in1 + *(in2.m_intern->on)));                 \
+    return make_ref<type>(in1 + *(in2.m_intern->on));                      \
   }                                                                        \
   ref<type> operator-(type in1, const ref<type> &in2) {                    \
     if (in2.isNull()) {                                                    \
       throw NullReferenceError();                                          \
     }                                                                      \
                                                                            \
-    return ref<type>(new type(in1 - *(in2.m_intern->on)));                 \
+    return make_ref<type>(in1 - *(in2.m_intern->on));                      \
   }                                                                        \
   ref<type> operator*(type in1, const ref<type> &in2) {                    \
     if (in2.isNull()) {                                                    \
       throw NullReferenceError();                                          \
     }                                                                      \
                                                                            \
-    return ref<type>(new type(in1 * *(in2.m_intern->on)));                 \
+    return make_ref<type>(in1 * *(in2.m_intern->on));                      \
   }                                                                        \
   ref<type> operator/(type in1, const ref<type> &in2) {                    \
     if (in2.isNull()) {                                                    \
       throw NullReferenceError();                                          \
     }                                                                      \
                                                                            \
-    return ref<type>(new type(in1 / *(in2.m_intern->on)));                 \
+    return make_ref<type>(in1 / *(in2.m_intern->on));                      \
   }
 
 template <typename>
@@ -150,6 +153,10 @@ class ref {
   struct Intern {
     TOn *on;
     unsigned int count;
+    bool inplace;  // on is stored in the same block, see make_ref
+    Arena *arena;  // nullptr when allocated on the heap
+    void *owner;   // Ref to a derived type holding on, see the conversion
+    void (*drop)(void *);
   };
 
   enum State : char { normal = 0, master = 1, slave = 2 };
@@ -168,6 +175,25 @@ class ref {
     this->m_intern->count = 1;
   }
 
+  /**
+   * @brief Share the value of a ref to a derived type, which the new counter
+   * keeps alive: nothing is copied, even for values made in place.
+   */
+  template <typename TOther,
+            typename = typename std::enable_if<
+                !std::is_same<TOther, TOn>::value &&
+                std::is_convertible<TOther *, TOn *>::value>::type>
+  ref(const ref<TOther> &other) : m_intern(nullptr), m_state(normal) {
+    if (!other.isNull()) {
+      this->m_intern = new Intern();
+
+      this->m_intern->on = dereference(other);
+      this->m_intern->count = 1;
+      this->m_intern->owner = new ref<TOther>(other);
+      this->m_intern->drop = [](void *owner) { delete (ref<TOther> *)owner; };
+    }
+  }
+
   ref(const ref<TOn> &other) : m_intern(other.m_intern) {
     this->m_state = (other.m_state == master ? slave : normal);
 
@@ -176,11 +202,18 @@ class ref {
     }
   }
 
-  ref(ref<TOn> &&other) : m_intern(other.m_intern) {
-    this->m_state = (other.m_state == master ? slave : normal);
+  // noexcept, so that containers growing move their refs instead of copying
+  ref(ref<TOn> &&other) noexcept
+      : m_intern(other.m_intern), m_state(normal) {
+    // Masters and slaves don't hand over their count, they are copied
+    if (other.m_state == normal) {
+      other.m_intern = nullptr;
+    } else {
+      this->m_state = (other.m_state == master ? slave : normal);
 
-    if (!isNull()) {
-      this->m_intern->count++;
+      if (!isNull()) {
+        this->m_intern->count++;
+      }
     }
   }
 
@@ -198,8 +231,7 @@ class ref {
 
       if (m_intern != other.m_intern) {
         if (m_intern->count == 0) {
-          delete m_intern->on;
-          delete m_intern;
+          destroy();
           m_intern = nullptr;
         }
 
@@ -214,6 +246,26 @@ class ref {
     return *this;
   }
 
+  ref<TOn> &operator=(ref<TOn> &&other) noexcept {
+    if ((this == &other) || (other.m_state != normal)) {
+      return (*this = other);
+    }
+
+    if (!isNull()) {
+      m_intern->count--;
+
+      if (m_intern->count == 0) {
+        destroy();
+      }
+    }
+
+    this->m_state = normal;
+    this->m_intern = other.m_intern;
+    other.m_intern = nullptr;
+
+    return *this;
+  }
+
   bool operator==(void *other) {
     return (isNull() ? false : (m_intern->on == other));
   }
@@ -225,8 +277,7 @@ class ref {
       m_intern->count--;
 
       if ((m_intern->count == 0) || (m_state == master)) {
-        delete m_intern->on;
-        delete m_intern;
+        destroy();
       }
     }
   }
@@ -238,6 +289,16 @@ class ref {
       return nullptr;
     } else {
       TOn *res = m_intern->on;
+
+      // Values made in place or held by another ref can't be handed over
+      if (m_intern->inplace || (m_intern->owner != nullptr)) {
+        throw NotReleasableError();
+      }
+
+      if ((m_state != slave) && (--m_intern->count == 0)) {
+        delete m_intern;
+      }
+
       this->m_intern = nullptr;
 
       return res;
@@ -282,6 +343,26 @@ class ref {
   TOn *expose() { return (m_intern->on); }
 
  private:
+  explicit ref(Intern *intern) : m_intern(intern), m_state(normal) {}
+
+  void destroy() {
+    if (m_intern->owner != nullptr) {
+      m_intern->drop(m_intern->owner);
+      delete m_intern;
+    } else if (!m_intern->inplace) {
+      delete m_intern->on;
+      delete m_intern;
+    } else if (m_intern->arena == nullptr) {
+      m_intern->on->~TOn();
+      ::operator delete(m_intern);
+    } else {
+      Arena *arena = m_intern->arena;
+
+      m_intern->on->~TOn();
+      arena->release(m_intern);
+    }
+  }
+
   Intern *m_intern;
   State m_state;
 
@@ -292,13 +373,16 @@ class ref {
   ref_friend_all_operator(long long);
 
   template <typename T>
-  friend T *dereference(ref<T>);
+  friend T *dereference(const ref<T> &);
 
   template <typename T>
   friend ref<T> autoref(T *);
 
   template <typename T>
   friend void master(ref<T> &);
+
+  template <typename T, typename... TArgs>
+  friend ref<T> make_ref(TArgs &&...);
 };
 
 template <typename TOn>
@@ -317,7 +401,7 @@ ref<double> operator"" _ref(long double in);
 ref<char> operator"" _ref(char in);
 
 template <typename T>
-T *dereference(ref<T> ref) {
+T *dereference(const ref<T> &ref) {
   if (ref.isNull()) {
     throw NullReferenceError();
   }
@@ -338,19 +422,57 @@ void master(ref<T> &ref) {
   ref.m_state = tanuki::ref<T>::State::master;
 }
 
+/**
+ * @brief Build a T in place: the value and its counter share one block. During
+ * the parse of a fragment with an arena, the block comes from the arena.
+ */
+template <typename T, typename... TArgs>
+ref<T> make_ref(TArgs &&... args) {
+  struct Block {
+    typename ref<T>::Intern intern;
+    typename std::aligned_storage<sizeof(T), alignof(T)>::type value;
+  };
+
+  Arena *arena = Arena::current();
+  Block *block =
+      (Block *)((arena == nullptr)
+                    ? ::operator new(sizeof(Block))
+                    : arena->allocate(sizeof(Block), alignof(Block)));
+
+  try {
+    block->intern.on = new (&block->value) T(std::forward<TArgs>(args)...);
+  } catch (...) {
+    if (arena == nullptr) {
+      ::operator delete(block);
+    } else {
+      arena->release(block);
+    }
+
+    throw;
+  }
+
+  block->intern.count = 1;
+  block->intern.inplace = true;
+  block->intern.arena = arena;
+  block->intern.owner = nullptr;
+  block->intern.drop = nullptr;
+
+  return ref<T>(&block->intern);
+}
+
 template <typename TReturn>
 struct Piece {
   typedef ref<TReturn> TResult;
 
-  operator bool() { return ((bool)result); }
+  operator bool() const { return ((bool)result); }
 
-  uint32_t length;
+  uint64_t length;
   TResult result;
 };
 
 template <typename TToken>
 struct Optional {
-  operator bool() { return ((bool)token); }
+  operator bool() const { return ((bool)token); }
 
   TToken token;
 };
@@ -369,14 +491,14 @@ class Yielder {
       intern++;
       (*self)++;
     }
-    T operator*() { return *intern; }
+    T &operator*() { return *intern; }
     bool operator!=(const YielderIterator &other) {
       return (intern != other.intern);
     }
   };
 
  public:
-  Yielder() : m_data(new TContainer()), m_current(0) {}
+  Yielder() : m_data(make_ref<TContainer>()), m_current(0) {}
 
   void reset() { m_current = 0; }
   void load(const ref<TContainer> &data) { this->m_data = data; }
@@ -385,6 +507,7 @@ class Yielder {
   YielderIterator end() { return {m_data->end(), nullptr}; }
 
   void push(const T &value) { m_data->push_back(value); }
+  void push(T &&value) { m_data->push_back(std::move(value)); }
   size_t size() { return m_data->size(); }
 
  private:
@@ -0,0 +1,102 @@
+#include "scanner.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace tanuki {
+CharScanner::CharScanner() : m_ranges(0) {}
+
+CharScanner::CharScanner(const CharSet &set) : m_set(set), m_ranges(0) {
+  int ranges = 0;
+  int c = 0;
+
+  while (c < 256) {
+    if (!set.has(c)) {
+      c++;
+      continue;
+    }
+
+    int from = c;
+
+    while ((c < 256) && set.has(c)) {
+      c++;
+    }
+
+    if (ranges == maximumRanges) {
+      return;
+    }
+
+    m_low[ranges] = from;
+    m_width[ranges] = (c - 1 - from);
+    ranges++;
+  }
+
+  m_ranges = ranges;
+}
+
+int64_t CharScanner::span(const char *data, int64_t length) const {
+  const unsigned char *bytes = (const unsigned char *)data;
+  int64_t i = 0;
+
+  // A byte is in [low, low + width] when byte - low <= width, unsigned. Both
+  // sides are biased by 0x80 to be compared signed.
+#if defined(__AVX2__)
+  if (m_ranges > 0) {
+    const __m256i bias = _mm256_set1_epi8((char)0x80);
+
+    for (; (i + 32) <= length; i += 32) {
+      __m256i block = _mm256_loadu_si256((const __m256i *)(bytes + i));
+      __m256i outside = _mm256_set1_epi8((char)0xff);
+
+      for (int r = 0; r < m_ranges; r++) {
+        __m256i shifted = _mm256_xor_si256(
+            _mm256_sub_epi8(block, _mm256_set1_epi8((char)m_low[r])), bias);
+        __m256i above = _mm256_cmpgt_epi8(
+            shifted, _mm256_set1_epi8((char)(m_width[r] ^ 0x80)));
+
+        outside = _mm256_and_si256(outside, above);
+      }
+
+      uint32_t mask = _mm256_movemask_epi8(outside);
+
+      if (mask != 0) {
+        return (i + __builtin_ctz(mask));
+      }
+    }
+  }
+#elif defined(__SSE2__)
+  if (m_ranges > 0) {
+    const __m128i bias = _mm_set1_epi8((char)0x80);
+
+    for (; (i + 16) <= length; i += 16) {
+      __m128i block = _mm_loadu_si128((const __m128i *)(bytes + i));
+      __m128i outside = _mm_set1_epi8((char)0xff);
+
+      for (int r = 0; r < m_ranges; r++) {
+        __m128i shifted = _mm_xor_si128(
+            _mm_sub_epi8(block, _mm_set1_epi8((char)m_low[r])), bias);
+        __m128i above =
+            _mm_cmpgt_epi8(shifted, _mm_set1_epi8((char)(m_width[r] ^ 0x80)));
+
+        outside = _mm_and_si128(outside, above);
+      }
+
+      uint32_t mask = _mm_movemask_epi8(outside);
+
+      if (mask != 0) {
+        return (i + __builtin_ctz(mask));
+      }
+    }
+  }
+#endif
+
+  while ((i < length) && m_set.has(bytes[i])) {
+    i++;
+  }
+
+  return i;
+}
+}
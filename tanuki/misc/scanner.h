@@ -0,0 +1,31 @@
+#pragma once
+
+#include <cstdint>
+
+#include "charset.h"
+
+namespace tanuki {
+/**
+ * @brief The CharScanner class measures runs of bytes of a CharSet. A set made
+ * of a few ranges (letters, digits...) is compared 32 or 16 bytes at a time
+ * when the build targets AVX2 or SSE2, any other set one byte at a time.
+ */
+class CharScanner {
+ public:
+  CharScanner();
+  explicit CharScanner(const CharSet &set);
+
+  /**
+   * @brief Number of bytes at the start of data which are in the set.
+   */
+  int64_t span(const char *data, int64_t length) const;
+
+ private:
+  static const int maximumRanges = 4;
+
+  CharSet m_set;
+  uint8_t m_low[maximumRanges];    // First byte of each range
+  uint8_t m_width[maximumRanges];  // Last byte of each range, minus the first
+  int m_ranges;                    // 0 when the set is scanned byte by byte
+};
+}
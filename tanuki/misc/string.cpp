@@ -3,53 +3,110 @@
 #include <cstring>
 #include <cstdlib>
 
-#include <iostream>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "exception.h"
 
 namespace tanuki {
-String::String() {
-  this->m_master = true;
-  this->m_length = 0;
-  this->m_shared = new Shared();
-  this->m_shared->m_count = 1;
-}
+String::String() : m_shared(nullptr), m_offset(0), m_length(0) {}
 
-String::String(const char* data) {
-  this->m_master = true;
-  this->m_length = strlen(data);
-  this->m_shared = new Shared();
-  this->m_shared->m_count = 1;
+String::String(const char* data) : String(data, strlen(data)) {}
 
-  if (m_length > 0) {
-    this->m_shared->m_data = (char*)malloc(sizeof(char) * m_length);
-    memcpy(m_shared->m_data, data, m_length);
+String::String(const char* data, int64_t length) : String() {
+  if (length > 0) {
+    // Counter & data are stored in the same block
+    this->m_shared = (Shared*)malloc(sizeof(Shared) + sizeof(char) * length);
+    this->m_shared->m_count = 1;
+    this->m_shared->m_data = (char*)(m_shared + 1);
+    this->m_shared->m_mapped = 0;
+    this->m_length = length;
+
+    memcpy(m_shared->m_data, data, length);
   }
 }
 
-String::String(const String& other) {
-  this->m_master = other.m_master;
-  this->m_length = other.m_length;
+String::String(const String& other)
+    : m_shared(other.m_shared),
+      m_offset(other.m_offset),
+      m_length(other.m_length) {
+  if (m_shared != nullptr) {
+    m_shared->m_count++;
+  }
+}
 
-  this->m_shared = other.m_shared;
-  this->m_shared->m_count++;
+String::String(String&& other)
+    : m_shared(other.m_shared),
+      m_offset(other.m_offset),
+      m_length(other.m_length) {
+  other.m_shared = nullptr;
+  other.m_offset = 0;
+  other.m_length = 0;
 }
 
-String::String(const std::string& other) : String(other.c_str()) {}
+String::String(const std::string& other)
+    : String(other.data(), other.size()) {}
+
+String::~String() { release(); }
+
+String String::map(const std::string& path) {
+  int fd = open(path.c_str(), O_RDONLY);
+
+  if (fd < 0) {
+    throw FileError();
+  }
+
+  struct stat info;
+
+  if (fstat(fd, &info) < 0) {
+    close(fd);
+    throw FileError();
+  }
+
+  String result;
 
-String::~String() {
-  m_shared->m_count--;
+  if (info.st_size > 0) {
+    void* data = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
 
-  if (m_shared->m_count == 0) {
-    if (m_master && (m_length > 0)) {
-      free(m_shared->m_data);
+    if (data == MAP_FAILED) {
+      close(fd);
+      throw FileError();
     }
 
-    delete m_shared;
+    madvise(data, info.st_size, MADV_SEQUENTIAL);
+
+    result.m_shared = (Shared*)malloc(sizeof(Shared));
+    result.m_shared->m_count = 1;
+    result.m_shared->m_data = (char*)data;
+    result.m_shared->m_mapped = info.st_size;
+    result.m_length = info.st_size;
   }
+
+  // The mapping stays valid once the descriptor is closed
+  close(fd);
+
+  return result;
 }
 
-char String::operator[](int index) const { return m_shared->m_data[index]; }
+void String::release() {
+  if (m_shared != nullptr) {
+    m_shared->m_count--;
+
+    if (m_shared->m_count == 0) {
+      if (m_shared->m_mapped > 0) {
+        munmap(m_shared->m_data, m_shared->m_mapped);
+      }
 
-String String::substr(int from, int length) const {
+      free(m_shared);
+    }
+
+    m_shared = nullptr;
+  }
+}
+
+String String::substr(int64_t from, int64_t length) const {
   if (length == -1) {
     length = m_length;
   }
@@ -57,56 +114,61 @@ String String::substr(int from, int length) const {
   length -= from;
 
   String result;
-  result.m_master = false;
-  result.m_length = length;
 
   if (length > 0) {
-    result.m_shared->m_data = (m_shared->m_data + from);
+    result.m_shared = m_shared;
+    result.m_offset = m_offset + from;
+    result.m_length = length;
+
+    m_shared->m_count++;
   }
 
   return result;
 }
 
-int String::size() const { return m_length; }
-
-bool String::empty() const { return m_length <= 0; }
-
 std::string String::toStdString() const {
-  char data[m_length + 1];
-
   if (m_length > 0) {
-    memcpy(data, m_shared->m_data, m_length);
+    return std::string(data(), m_length);
+  } else {
+    return std::string();
+  }
+}
+
+String& String::operator=(const String& other) {
+  if (other.m_shared != nullptr) {
+    other.m_shared->m_count++;
   }
 
-  data[m_length] = '\0';
+  release();
+
+  this->m_shared = other.m_shared;
+  this->m_offset = other.m_offset;
+  this->m_length = other.m_length;
 
-  return std::string(data);
+  return *this;
 }
 
-String& String::operator=(const String& other) {
-  m_shared->m_count--;
+String& String::operator=(String&& other) {
+  if (this != &other) {
+    release();
 
-  if (m_shared->m_count == 0) {
-    if (m_master && (m_length > 0)) {
-      free(m_shared->m_data);
-    }
+    this->m_shared = other.m_shared;
+    this->m_offset = other.m_offset;
+    this->m_length = other.m_length;
 
-    delete m_shared;
+    other.m_shared = nullptr;
+    other.m_offset = 0;
+    other.m_length = 0;
   }
 
-  this->m_master = other.m_master;
-  this->m_length = other.m_length;
-  this->m_shared = other.m_shared;
-  this->m_shared->m_count++;
-
   return *this;
 }
 
 bool String::operator==(const std::string& other) const {
-  if (m_length == 0) {
-    return other.empty();
+  if (m_length != (int64_t)other.size()) {
+    return false;
   }
 
-  return !memcmp(m_shared->m_data, other.c_str(), m_length);
+  return ((m_length == 0) || !memcmp(data(), other.data(), m_length));
 }
 }
@@ -1,32 +1,59 @@
 #pragma once
 
+#include <cstdint>
 #include <string>
 
 namespace tanuki {
+/**
+ * @brief The String class is a view on a shared buffer. Slicing a String
+ * doesn't allocate: the slice shares the buffer and keeps it alive.
+ */
 class String {
  public:
   String();
   String(const char *data);
+  String(const char *data, int64_t length);
   String(const std::string &other);
   String(const String &other);
+  String(String &&other);
   ~String();
-  char operator[](int index) const;
-  String substr(int from, int length = -1) const;
-  int size() const;
-  bool empty() const;
+
+  /**
+   * @brief Map the file at path read-only, the returned String is a view on
+   * the mapping which is released with the last slice. Throws FileError.
+   */
+  static String map(const std::string &path);
+
+  // Called for each byte read by tokens, so they are inlined
+  char operator[](int64_t index) const {
+    return m_shared->m_data[m_offset + index];
+  }
+  // Unsigned as the offsets into the string, see Piece::length
+  uint64_t size() const { return m_length; }
+  const char *data() const {
+    return ((m_shared == nullptr) ? nullptr : (m_shared->m_data + m_offset));
+  }
+  bool empty() const { return m_length <= 0; }
+
+  String substr(int64_t from, int64_t length = -1) const;
   std::string toStdString() const;
 
   String &operator=(const String &other);
+  String &operator=(String &&other);
   bool operator==(const std::string &other) const;
 
  private:
   struct Shared {
-      int m_count;
-      char *m_data;
+    int m_count;
+    char *m_data;
+    size_t m_mapped;  // Length of the mapping, 0 if data follows the block
   };
 
-  Shared *m_shared;
-  int m_length;
-  bool m_master;
+  void release();
+
+  Shared *m_shared;  // nullptr for an empty string
+  // 64 bits, so that mapped files may be larger than 2 GB
+  int64_t m_offset;
+  int64_t m_length;
 };
 }
@@ -0,0 +1,261 @@
+#include "automaton.h"
+
+#include <map>
+#include <utility>
+
+namespace tanuki {
+namespace {
+/**
+ * @brief Ordered NFA of a pattern (Thompson construction), the first target of
+ * a split has the priority.
+ */
+class Nfa {
+ public:
+  struct Instruction {
+    enum Op { Byte, Split, Match } op;
+    CharSet chars;
+    int next;
+    int alternative;
+  };
+
+  explicit Nfa(const ref<Pattern> &pattern) {
+    add(Instruction{Instruction::Match, CharSet(), -1, -1});
+
+    m_start = compile(pattern, 0);
+  }
+
+  int start() const { return m_start; }
+  const std::vector<Instruction> &code() const { return m_code; }
+
+  /**
+   * @brief Add the threads reached from pc to list, by priority. Threads with
+   * a lower priority than a match are dropped, as they can't win anymore.
+   */
+  void follow(int pc, std::vector<int> &list, std::vector<bool> &visited,
+              bool &matched) const {
+    if (matched || visited[pc]) {
+      return;
+    }
+
+    visited[pc] = true;
+
+    const Instruction &instruction = m_code[pc];
+
+    switch (instruction.op) {
+      case Instruction::Byte:
+        list.push_back(pc);
+        break;
+      case Instruction::Match:
+        list.push_back(pc);
+        matched = true;
+        break;
+      case Instruction::Split:
+        follow(instruction.next, list, visited, matched);
+        follow(instruction.alternative, list, visited, matched);
+        break;
+    }
+  }
+
+ private:
+  int add(const Instruction &instruction) {
+    m_code.push_back(instruction);
+
+    return (m_code.size() - 1);
+  }
+
+  int compile(const ref<Pattern> &pattern, int next) {
+    const std::vector<ref<Pattern>> &children = pattern->children;
+
+    switch (pattern->kind) {
+      case Pattern::Set:
+        return add(Instruction{Instruction::Byte, pattern->chars, next, -1});
+      case Pattern::Sequence:
+        for (auto it = children.rbegin(); it != children.rend(); it++) {
+          next = compile(*it, next);
+        }
+
+        return next;
+      case Pattern::Choice: {
+        int alternative = compile(children.back(), next);
+
+        for (int i = children.size() - 2; i >= 0; i--) {
+          int first = compile(children[i], next);
+
+          alternative = add(
+              Instruction{Instruction::Split, CharSet(), first, alternative});
+        }
+
+        return alternative;
+      }
+      case Pattern::Plus: {
+        // The loop is greedy: going on has the priority over leaving
+        int loop = add(Instruction{Instruction::Split, CharSet(), -1, next});
+        int start = compile(children.front(), loop);
+
+        m_code[loop].next = start;
+
+        return start;
+      }
+      case Pattern::Optional: {
+        int first = compile(children.front(), next);
+
+        return add(Instruction{Instruction::Split, CharSet(), first, next});
+      }
+    }
+
+    return next;
+  }
+
+  std::vector<Instruction> m_code;
+  int m_start;
+};
+}
+
+AutomatonToken::AutomatonToken(ref<Pattern> pattern)
+    : Token<std::string>(), m_pattern(pattern), m_classCount(1) {
+  if (!pattern) {
+    throw NotRegularError();
+  }
+
+  Nfa nfa(pattern);
+  const std::vector<Nfa::Instruction> &code = nfa.code();
+
+  // Bytes are split in classes by each set of the NFA
+  for (int c = 0; c < 256; c++) {
+    m_classes[c] = 0;
+  }
+
+  for (const Nfa::Instruction &instruction : code) {
+    if (instruction.op == Nfa::Instruction::Byte) {
+      std::map<std::pair<int, bool>, int> split;
+
+      for (int c = 0; c < 256; c++) {
+        std::pair<int, bool> key(m_classes[c], instruction.chars.has(c));
+        auto known = split.find(key);
+
+        if (known == split.end()) {
+          known = split.insert(std::make_pair(key, split.size())).first;
+        }
+
+        m_classes[c] = known->second;
+      }
+
+      m_classCount = split.size();
+    }
+  }
+
+  std::vector<int> representatives(m_classCount);
+
+  for (int c = 255; c >= 0; c--) {
+    representatives[m_classes[c]] = c;
+  }
+
+  // Subset construction, a state is the ordered list of its threads
+  std::map<std::vector<int>, int> known;
+  std::vector<std::vector<int>> states;
+
+  auto state = [&](std::vector<int> &&threads) -> int {
+    if (threads.empty()) {
+      return -1;
+    }
+
+    auto found = known.find(threads);
+
+    if (found != known.end()) {
+      return found->second;
+    }
+
+    int row = states.size() * m_classCount;
+
+    known.insert(std::make_pair(threads, row));
+    states.push_back(std::move(threads));
+
+    return row;
+  };
+
+  {
+    std::vector<int> threads;
+    std::vector<bool> visited(code.size(), false);
+    bool matched = false;
+
+    nfa.follow(nfa.start(), threads, visited, matched);
+    state(std::move(threads));
+  }
+
+  for (size_t current = 0; current < states.size(); current++) {
+    bool accepting = false;
+
+    for (int pc : states[current]) {
+      accepting = (accepting || (code[pc].op == Nfa::Instruction::Match));
+    }
+
+    // Indexed by row as the transitions, so matching needs no multiplication
+    m_accepting.insert(m_accepting.end(), m_classCount, accepting);
+
+    for (int k = 0; k < m_classCount; k++) {
+      std::vector<int> threads;
+      std::vector<bool> visited(code.size(), false);
+      bool matched = false;
+
+      for (int pc : states[current]) {
+        if ((code[pc].op == Nfa::Instruction::Byte) &&
+            code[pc].chars.has(representatives[k])) {
+          nfa.follow(code[pc].next, threads, visited, matched);
+        }
+      }
+
+      m_transitions.push_back(state(std::move(threads)));
+    }
+  }
+}
+
+ref<std::string> AutomatonToken::match(const tanuki::String &in) {
+  return ((recognizeAt(in, 0) == (int64_t)in.size())
+              ? make_ref<std::string>(in.toStdString())
+              : ref<std::string>());
+}
+
+Piece<std::string> AutomatonToken::consumeAt(const tanuki::String &in,
+                                             uint64_t offset) {
+  int64_t length = recognizeAt(in, offset);
+
+  if (length < 0) {
+    return Piece<std::string>{0, ref<std::string>()};
+  }
+
+  return Piece<std::string>{
+      (uint64_t)length, make_ref<std::string>(in.data() + offset, length)};
+}
+
+int64_t AutomatonToken::recognizeAt(const tanuki::String &in, uint64_t offset) {
+  // The last accepting state reached gives the length
+  int64_t result = (m_accepting[0] ? 0 : -1);
+  int64_t length = in.size() - offset;
+  const unsigned char *data = (const unsigned char *)in.data() + offset;
+  int current = 0;
+
+  for (int64_t i = 0; i < length; i++) {
+    current = m_transitions[current + m_classes[data[i]]];
+
+    if (current < 0) {
+      break;
+    }
+
+    if (m_accepting[current]) {
+      result = i + 1;
+    }
+  }
+
+  return result;
+}
+
+bool AutomatonToken::first(CharSet &set) {
+  for (int c = 0; c < 256; c++) {
+    if (m_transitions[m_classes[c]] >= 0) {
+      set.add(c);
+    }
+  }
+
+  return m_accepting[0];
+}
+}
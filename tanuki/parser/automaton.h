@@ -0,0 +1,42 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "tanuki/misc/misc.h"
+
+#include "pattern.h"
+#include "tokens.h"
+
+namespace tanuki {
+/**
+ * @brief The AutomatonToken class is a token compiled into a DFA, it matches
+ * the same lengths as the token its pattern comes from without any virtual
+ * call nor allocation per byte. Throws NotRegularError if there is no pattern.
+ */
+class AutomatonToken : public Token<std::string> {
+ public:
+  explicit AutomatonToken(ref<Pattern> pattern);
+  ref<std::string> match(const tanuki::String &in) override;
+  Piece<std::string> consumeAt(const tanuki::String &in,
+                               uint64_t offset) override;
+  int64_t recognizeAt(const tanuki::String &in, uint64_t offset) override;
+  bool first(CharSet &set) override;
+  ref<Pattern> pattern() override { return m_pattern; }
+
+  int states() const { return m_accepting.size() / m_classCount; }
+
+ private:
+  ref<Pattern> m_pattern;
+
+  // Bytes are mapped to classes of bytes no pattern set tells apart
+  uint8_t m_classes[256];
+  int m_classCount;
+
+  // Row of the next state for each row and class (rows are states times
+  // m_classCount), -1 when nothing can match anymore
+  std::vector<int32_t> m_transitions;
+  std::vector<uint8_t> m_accepting;
+};
+}
@@ -0,0 +1,325 @@
+#include "dictionary.h"
+
+#include <algorithm>
+#include <climits>
+#include <cstdio>
+#include <cstring>
+#include <unordered_map>
+#include <utility>
+
+namespace tanuki {
+namespace {
+const uint32_t magic = 0x444b4e54;  // "TNKD" on a little endian machine
+const uint32_t version = 1;
+const int headerSize = 4 * sizeof(uint32_t);
+
+/**
+ * @brief Incremental construction of a minimized acyclic automaton from
+ * sorted words (Daciuk et al.). Once a word is added, the states of the
+ * previous one past their common prefix can't change anymore: each is
+ * replaced by an equivalent state already registered, or registered itself.
+ */
+class Builder {
+ public:
+  explicit Builder(std::vector<std::string> words) {
+    std::sort(words.begin(), words.end());
+    words.erase(std::unique(words.begin(), words.end()), words.end());
+
+    std::vector<int> path{create()};
+    const std::string *previous = nullptr;
+
+    for (const std::string &word : words) {
+      size_t common = 0;
+
+      if (previous != nullptr) {
+        while ((common < previous->size()) && (common < word.size()) &&
+               ((*previous)[common] == word[common])) {
+          common++;
+        }
+      }
+
+      while (path.size() > (common + 1)) {
+        path.pop_back();
+        minimize(path.back());
+      }
+
+      for (size_t i = common; i < word.size(); i++) {
+        int state = create();
+
+        m_states[path.back()].arcs.push_back(
+            std::make_pair((unsigned char)word[i], state));
+        path.push_back(state);
+      }
+
+      m_states[path.back()].final = true;
+      previous = &word;
+    }
+
+    while (path.size() > 1) {
+      path.pop_back();
+      minimize(path.back());
+    }
+  }
+
+  /**
+   * @brief The flat layout read by DictionaryToken, states numbered depth
+   * first from the root.
+   */
+  std::string serialize() const {
+    std::vector<bool> seen(m_states.size(), false);
+    std::vector<int> number(m_states.size(), -1);
+    std::vector<int> order;
+    std::vector<int> stack{0};
+    uint32_t arcs = 0;
+
+    seen[0] = true;
+
+    // Unused states aren't reachable, so they are dropped here
+    while (!stack.empty()) {
+      int state = stack.back();
+      stack.pop_back();
+
+      number[state] = order.size();
+      order.push_back(state);
+      arcs += m_states[state].arcs.size();
+
+      for (auto it = m_states[state].arcs.rbegin();
+           it != m_states[state].arcs.rend(); it++) {
+        if (!seen[it->second]) {
+          seen[it->second] = true;
+          stack.push_back(it->second);
+        }
+      }
+    }
+
+    std::vector<uint32_t> words{magic, version, (uint32_t)order.size(), arcs};
+    std::vector<uint32_t> targets;
+    std::string labels;
+
+    for (int state : order) {
+      const std::vector<std::pair<unsigned char, int>> &out =
+          m_states[state].arcs;
+
+      words.push_back(targets.size());
+      words.push_back((out.size() << 1) | (m_states[state].final ? 1 : 0));
+
+      for (const auto &arc : out) {
+        targets.push_back(number[arc.second]);
+        labels.push_back(arc.first);
+      }
+    }
+
+    words.insert(words.end(), targets.begin(), targets.end());
+
+    std::string result((const char *)words.data(),
+                       words.size() * sizeof(uint32_t));
+    result += labels;
+
+    return result;
+  }
+
+ private:
+  struct State {
+    std::vector<std::pair<unsigned char, int>> arcs;
+    bool final;
+  };
+
+  int create() {
+    if (m_unused.empty()) {
+      m_states.push_back(State{{}, false});
+
+      return (m_states.size() - 1);
+    }
+
+    int state = m_unused.back();
+    m_unused.pop_back();
+
+    m_states[state].final = false;
+
+    return state;
+  }
+
+  // Replace the last child of parent by its registered equivalent
+  void minimize(int parent) {
+    int child = m_states[parent].arcs.back().second;
+    std::string key(1, (m_states[child].final ? '1' : '0'));
+
+    for (const auto &arc : m_states[child].arcs) {
+      key.push_back(arc.first);
+      key.append((const char *)&arc.second, sizeof(int));
+    }
+
+    auto it = m_registry.find(key);
+
+    if (it == m_registry.end()) {
+      m_registry.emplace(std::move(key), child);
+    } else {
+      m_states[parent].arcs.back().second = it->second;
+      m_states[child].arcs.clear();
+      m_unused.push_back(child);
+    }
+  }
+
+  std::vector<State> m_states;
+  std::vector<int> m_unused;
+  std::unordered_map<std::string, int> m_registry;
+};
+}
+
+DictionaryToken::DictionaryToken(const std::vector<std::string> &words)
+    : DictionaryToken(tanuki::String(Builder(words).serialize())) {}
+
+DictionaryToken::DictionaryToken(const tanuki::String &data)
+    : Token<std::string>(), m_data(data) {
+  if (m_data.size() < headerSize) {
+    throw DictionaryError();
+  }
+
+  m_header = (const uint32_t *)m_data.data();
+
+  uint64_t states = m_header[2];
+  uint64_t arcs = m_header[3];
+
+  if ((m_header[0] != magic) || (m_header[1] != version) || (states == 0) ||
+      (states > INT_MAX) ||
+      ((headerSize + states * 8 + arcs * 5) != m_data.size())) {
+    throw DictionaryError();
+  }
+
+  m_states = (m_header + 4);
+  m_targets = (m_states + states * 2);
+  m_labels = (const unsigned char *)(m_targets + arcs);
+
+  // Lookups trust the buffer, so each state is checked once here: its arcs
+  // stay within the arrays, are sorted by label, and reach existing states
+  for (uint64_t state = 0; state < states; state++) {
+    uint64_t begin = m_states[state * 2];
+    uint64_t count = (m_states[state * 2 + 1] >> 1);
+
+    if ((begin > arcs) || (count > (arcs - begin))) {
+      throw DictionaryError();
+    }
+
+    for (uint64_t arc = begin; arc < (begin + count); arc++) {
+      if ((m_targets[arc] >= states) ||
+          ((arc > begin) && (m_labels[arc - 1] >= m_labels[arc]))) {
+        throw DictionaryError();
+      }
+    }
+  }
+}
+
+ref<DictionaryToken> DictionaryToken::load(const std::string &path) {
+  tanuki::String data(tanuki::String::map(path));
+
+  // The mapping is used as is, only the list of words is built
+  if ((data.size() >= 4) && !memcmp(data.data(), &magic, 4)) {
+    return ref<DictionaryToken>(new DictionaryToken(data));
+  }
+
+  std::vector<std::string> words;
+  const char *begin = data.data();
+  const char *end = (begin + data.size());
+
+  while (begin < end) {
+    const char *line = (const char *)memchr(begin, '\n', end - begin);
+    const char *last = ((line == nullptr) ? end : line);
+
+    if ((last > begin) && (last[-1] == '\r')) {
+      last--;
+    }
+
+    if (last > begin) {
+      words.push_back(std::string(begin, last));
+    }
+
+    begin = ((line == nullptr) ? end : (line + 1));
+  }
+
+  return ref<DictionaryToken>(new DictionaryToken(words));
+}
+
+void DictionaryToken::save(const std::string &path) const {
+  FILE *file = fopen(path.c_str(), "wb");
+
+  if (file == nullptr) {
+    throw FileError();
+  }
+
+  size_t written = fwrite(m_data.data(), 1, m_data.size(), file);
+
+  if ((fclose(file) != 0) || (written != (size_t)m_data.size())) {
+    throw FileError();
+  }
+}
+
+int DictionaryToken::next(int state, unsigned char c) const {
+  uint32_t begin = m_states[state * 2];
+  const unsigned char *labels = (m_labels + begin);
+  const unsigned char *end = (labels + (m_states[state * 2 + 1] >> 1));
+  const unsigned char *it = std::lower_bound(labels, end, c);
+
+  if ((it == end) || (*it != c)) {
+    return -1;
+  }
+
+  return m_targets[begin + (it - labels)];
+}
+
+ref<std::string> DictionaryToken::match(const tanuki::String &in) {
+  int state = 0;
+
+  for (uint64_t i = 0; (i < in.size()) && (state >= 0); i++) {
+    state = next(state, in[i]);
+  }
+
+  return (((state >= 0) && accepting(state))
+              ? make_ref<std::string>(in.toStdString())
+              : ref<std::string>());
+}
+
+Piece<std::string> DictionaryToken::consumeAt(const tanuki::String &in,
+                                              uint64_t offset) {
+  int64_t length = recognizeAt(in, offset);
+
+  if (length < 0) {
+    return Piece<std::string>{0, ref<std::string>()};
+  }
+
+  return Piece<std::string>{
+      (uint64_t)length, make_ref<std::string>(in.data() + offset, length)};
+}
+
+int64_t DictionaryToken::recognizeAt(const tanuki::String &in,
+                                     uint64_t offset) {
+  // The last accepting state reached gives the length
+  int64_t result = (accepting(0) ? 0 : -1);
+  int64_t length = in.size() - offset;
+  const unsigned char *data = (const unsigned char *)in.data() + offset;
+  int state = 0;
+
+  for (int64_t i = 0; i < length; i++) {
+    state = next(state, data[i]);
+
+    if (state < 0) {
+      break;
+    }
+
+    if (accepting(state)) {
+      result = (i + 1);
+    }
+  }
+
+  return result;
+}
+
+bool DictionaryToken::first(CharSet &set) {
+  const unsigned char *labels = (m_labels + m_states[0]);
+
+  for (uint32_t i = 0; i < (m_states[1] >> 1); i++) {
+    set.add(labels[i]);
+  }
+
+  return accepting(0);
+}
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "tanuki/misc/misc.h"
+
+#include "tokens.h"
+
+namespace tanuki {
+/**
+ * @brief The DictionaryToken class matches the longest word of a list, stored
+ * as a minimized acyclic automaton (words sharing a suffix share its states).
+ * The automaton is a flat buffer which is saved as is, and mapped back without
+ * any parsing.
+ */
+class DictionaryToken : public Token<std::string> {
+ public:
+  explicit DictionaryToken(const std::vector<std::string> &words);
+
+  /**
+   * @brief Load a file written by save(), or a list of words, one per line.
+   * Throws FileError if it can't be read, DictionaryError if a saved
+   * automaton is truncated or corrupted.
+   */
+  static ref<DictionaryToken> load(const std::string &path);
+
+  /**
+   * @brief Write the automaton to path, in the byte order of this machine.
+   * Throws FileError.
+   */
+  void save(const std::string &path) const;
+
+  ref<std::string> match(const tanuki::String &in) override;
+  Piece<std::string> consumeAt(const tanuki::String &in,
+                               uint64_t offset) override;
+  int64_t recognizeAt(const tanuki::String &in, uint64_t offset) override;
+  bool first(CharSet &set) override;
+
+  int states() const { return m_header[2]; }
+
+ private:
+  explicit DictionaryToken(const tanuki::String &data);
+
+  // Target of the arc labelled c from state, -1 if there is none
+  int next(int state, unsigned char c) const;
+  bool accepting(int state) const { return (m_states[state * 2 + 1] & 1); }
+
+  // Header (magic, version, states, arcs), then two words per state (first
+  // arc, arcs << 1 | final), the target of each arc, and its label. Arcs of
+  // a state follow each other, sorted by label.
+  tanuki::String m_data;
+  const uint32_t *m_header;
+  const uint32_t *m_states;
+  const uint32_t *m_targets;
+  const unsigned char *m_labels;
+};
+}
@@ -0,0 +1,370 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <initializer_list>
+#include <string>
+#include <vector>
+
+#include "tanuki/misc/misc.h"
+
+#include "pattern.h"
+#include "tokens.h"
+
+namespace tanuki {
+/**
+ * @brief Statically dispatched tokens. They mirror chars, constants and the
+ * combinators of tokens.h, but are plain values: the type of an expression
+ * holds the whole tree, so calls to inner expressions are direct and can be
+ * inlined. They only recognize, token() wraps an expression into a Token
+ * for fragments.
+ */
+namespace direct {
+/**
+ * @brief The Expression class is the base of the statically dispatched
+ * tokens, it only tells the operators which types they apply to.
+ */
+template <typename TDerived>
+class Expression {
+ public:
+  const TDerived &self() const { return static_cast<const TDerived &>(*this); }
+};
+
+/**
+ * @brief One byte of a set.
+ */
+class Chars : public Expression<Chars> {
+ public:
+  explicit Chars(const CharSet &set) : m_set(set) {}
+
+  int64_t recognizeAt(const tanuki::String &in, uint64_t offset) const {
+    return (((offset < in.size()) &&
+             m_set.has((unsigned char)in[offset]))
+                ? 1
+                : -1);
+  }
+
+  bool first(CharSet &set) const {
+    set.merge(m_set);
+
+    return false;
+  }
+
+  ref<Pattern> pattern() const { return make_ref<Pattern>(m_set); }
+
+ private:
+  CharSet m_set;
+};
+
+/**
+ * @brief A string.
+ */
+class Constant : public Expression<Constant> {
+ public:
+  explicit Constant(const std::string &constant) : m_constant(constant) {}
+
+  int64_t recognizeAt(const tanuki::String &in, uint64_t offset) const {
+    uint64_t length = m_constant.size();
+
+    if ((in.size() - offset) < length) {
+      return -1;
+    }
+
+    return (memcmp(in.data() + offset, m_constant.data(), length) ? -1
+                                                                   : length);
+  }
+
+  bool first(CharSet &set) const {
+    if (m_constant.empty()) {
+      return true;
+    }
+
+    set.add(m_constant[0]);
+
+    return false;
+  }
+
+  ref<Pattern> pattern() const {
+    std::vector<ref<Pattern>> chars;
+
+    for (char c : m_constant) {
+      CharSet set;
+      set.add(c);
+
+      chars.push_back(make_ref<Pattern>(set));
+    }
+
+    return make_ref<Pattern>(Pattern::Sequence, chars);
+  }
+
+ private:
+  std::string m_constant;
+};
+
+/**
+ * @brief The left expression if it matches, the right one otherwise.
+ */
+template <typename TLeft, typename TRight>
+class Or : public Expression<Or<TLeft, TRight>> {
+ public:
+  Or(const TLeft &left, const TRight &right) : m_left(left), m_right(right) {}
+
+  int64_t recognizeAt(const tanuki::String &in, uint64_t offset) const {
+    int64_t left = m_left.recognizeAt(in, offset);
+
+    return ((left >= 0) ? left : m_right.recognizeAt(in, offset));
+  }
+
+  bool first(CharSet &set) const {
+    bool left = m_left.first(set);
+    bool right = m_right.first(set);
+
+    return (left || right);
+  }
+
+  ref<Pattern> pattern() const {
+    ref<Pattern> left = m_left.pattern();
+    ref<Pattern> right = m_right.pattern();
+
+    if (!(bool)left || !(bool)right) {
+      return ref<Pattern>();
+    }
+
+    return make_ref<Pattern>(Pattern::Choice,
+                             std::vector<ref<Pattern>>{left, right});
+  }
+
+ private:
+  TLeft m_left;
+  TRight m_right;
+};
+
+/**
+ * @brief Both expressions, matching the same length.
+ */
+template <typename TLeft, typename TRight>
+class And : public Expression<And<TLeft, TRight>> {
+ public:
+  And(const TLeft &left, const TRight &right) : m_left(left), m_right(right) {}
+
+  int64_t recognizeAt(const tanuki::String &in, uint64_t offset) const {
+    int64_t left = m_left.recognizeAt(in, offset);
+
+    if (left < 0) {
+      return -1;
+    }
+
+    return ((m_right.recognizeAt(in, offset) == left) ? left : -1);
+  }
+
+  bool first(CharSet &set) const {
+    CharSet right;
+
+    // Both sides consume the same input, the left one is enough to start with
+    bool nullable = m_left.first(set);
+
+    return (m_right.first(right) && nullable);
+  }
+
+  // An intersection isn't a pattern
+  ref<Pattern> pattern() const { return ref<Pattern>(); }
+
+ private:
+  TLeft m_left;
+  TRight m_right;
+};
+
+/**
+ * @brief The expression, as many times as possible, at least once.
+ */
+template <typename TInner>
+class Plus : public Expression<Plus<TInner>> {
+ public:
+  explicit Plus(const TInner &inner) : m_inner(inner) {}
+
+  int64_t recognizeAt(const tanuki::String &in, uint64_t offset) const {
+    uint64_t current = offset;
+    uint64_t length = in.size();
+    bool matched = false;
+
+    while (current < length) {
+      int64_t sub = m_inner.recognizeAt(in, current);
+
+      if (sub < 0) {
+        break;
+      }
+
+      current += sub;
+      matched = true;
+
+      // An empty match would be repeated forever
+      if (sub == 0) {
+        break;
+      }
+    }
+
+    return (matched ? (int64_t)(current - offset) : -1);
+  }
+
+  bool first(CharSet &set) const { return m_inner.first(set); }
+
+  ref<Pattern> pattern() const {
+    ref<Pattern> inner = m_inner.pattern();
+
+    return ((bool)inner ? make_ref<Pattern>(Pattern::Plus,
+                                            std::vector<ref<Pattern>>{inner})
+                        : ref<Pattern>());
+  }
+
+ private:
+  TInner m_inner;
+};
+
+/**
+ * @brief The expression if it matches, nothing otherwise.
+ */
+template <typename TInner>
+class Optional : public Expression<Optional<TInner>> {
+ public:
+  explicit Optional(const TInner &inner) : m_inner(inner) {}
+
+  int64_t recognizeAt(const tanuki::String &in, uint64_t offset) const {
+    int64_t sub = m_inner.recognizeAt(in, offset);
+
+    return ((sub < 0) ? 0 : sub);
+  }
+
+  bool first(CharSet &set) const {
+    m_inner.first(set);
+
+    return true;
+  }
+
+  ref<Pattern> pattern() const {
+    ref<Pattern> inner = m_inner.pattern();
+
+    return ((bool)inner ? make_ref<Pattern>(Pattern::Optional,
+                                            std::vector<ref<Pattern>>{inner})
+                        : ref<Pattern>());
+  }
+
+ private:
+  TInner m_inner;
+};
+
+template <typename TInner>
+using Star = Optional<Plus<TInner>>;
+
+// Leaves
+inline Chars constant(char character) {
+  CharSet set;
+  set.add(character);
+
+  return Chars(set);
+}
+
+inline Constant constant(const std::string &constant) {
+  return Constant(constant);
+}
+
+inline Chars anyIn(char inferiorBound, char superiorBound) {
+  CharSet set;
+  set.add(inferiorBound, superiorBound);
+
+  return Chars(set);
+}
+
+template <typename... TRest>
+Chars anyOf(TRest... chars) {
+  CharSet set;
+
+  for (char c : {chars...}) {
+    set.add(c);
+  }
+
+  return Chars(set);
+}
+
+inline Chars space() { return constant(' '); }
+inline Chars tab() { return constant('\t'); }
+inline Chars blank() { return anyOf(' ', '\t'); }
+inline Chars lineTerminator() { return anyOf('\r', '\n'); }
+inline Chars digit() { return anyIn('0', '9'); }
+inline Chars letter() { return anyIn('A', 'z'); }
+
+// Operators, the same as the ones of tokens
+template <typename TLeft, typename TRight>
+Or<TLeft, TRight> operator||(const Expression<TLeft> &left,
+                             const Expression<TRight> &right) {
+  return Or<TLeft, TRight>(left.self(), right.self());
+}
+
+template <typename TLeft, typename TRight>
+And<TLeft, TRight> operator&&(const Expression<TLeft> &left,
+                              const Expression<TRight> &right) {
+  return And<TLeft, TRight>(left.self(), right.self());
+}
+
+template <typename TInner>
+Plus<TInner> operator+(const Expression<TInner> &inner) {
+  return Plus<TInner>(inner.self());
+}
+
+template <typename TInner>
+Star<TInner> operator*(const Expression<TInner> &inner) {
+  return Star<TInner>(Plus<TInner>(inner.self()));
+}
+
+template <typename TInner>
+Optional<TInner> operator~(const Expression<TInner> &inner) {
+  return Optional<TInner>(inner.self());
+}
+}
+
+/**
+ * @brief The DirectToken class wraps a statically dispatched expression into
+ * a token returning the text it matched, where a fragment needs one. Only
+ * calls from the fragment are virtual.
+ */
+template <typename TExpression>
+class DirectToken : public Token<std::string> {
+ public:
+  explicit DirectToken(const TExpression &expression)
+      : Token<std::string>(), m_expression(expression) {}
+
+  ref<std::string> match(const tanuki::String &in) override {
+    return ((m_expression.recognizeAt(in, 0) == (int64_t)in.size())
+                ? make_ref<std::string>(in.toStdString())
+                : ref<std::string>());
+  }
+
+  Piece<std::string> consumeAt(const tanuki::String &in,
+                               uint64_t offset) override {
+    int64_t length = m_expression.recognizeAt(in, offset);
+
+    if (length < 0) {
+      return Piece<std::string>{0, ref<std::string>()};
+    }
+
+    return Piece<std::string>{
+        (uint64_t)length, make_ref<std::string>(in.data() + offset, length)};
+  }
+
+  int64_t recognizeAt(const tanuki::String &in, uint64_t offset) override {
+    return m_expression.recognizeAt(in, offset);
+  }
+
+  bool first(CharSet &set) override { return m_expression.first(set); }
+  ref<Pattern> pattern() override { return m_expression.pattern(); }
+
+ private:
+  TExpression m_expression;
+};
+
+namespace direct {
+template <typename TExpression>
+ref<DirectToken<TExpression>> token(const Expression<TExpression> &expression) {
+  return make_ref<DirectToken<TExpression>>(expression.self());
+}
+}
+}
@@ -0,0 +1,465 @@
+#include "floating.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+namespace tanuki {
+namespace {
+const int smallestPower = -342;  // Below, any 19 digits round to zero
+const int largestPower = 308;    // Above, they round to infinity
+
+/**
+ * @brief Unsigned integer of any size, stored by 32 bits words from the
+ * lowest one. Only what the table of powers needs.
+ */
+class Big {
+ public:
+  explicit Big(uint32_t value) : m_words{value} {}
+
+  void multiply(uint32_t factor) {
+    uint64_t carry = 0;
+
+    for (uint32_t &word : m_words) {
+      carry += (uint64_t)word * factor;
+      word = (uint32_t)carry;
+      carry >>= 32;
+    }
+
+    if (carry != 0) {
+      m_words.push_back(carry);
+    }
+  }
+
+  void divide(uint32_t divisor) {
+    uint64_t rest = 0;
+
+    for (int i = (m_words.size() - 1); i >= 0; i--) {
+      rest = ((rest << 32) | m_words[i]);
+      m_words[i] = (rest / divisor);
+      rest %= divisor;
+    }
+
+    while ((m_words.size() > 1) && (m_words.back() == 0)) {
+      m_words.pop_back();
+    }
+  }
+
+  void shift(int count) {
+    Big result(0);
+    result.m_words.assign(m_words.size() + (count + 31) / 32 + 1, 0);
+
+    for (int i = 0, end = size(); i < end; i++) {
+      if (bit(i)) {
+        int target = (i + count);
+        result.m_words[target / 32] |= ((uint32_t)1 << (target % 32));
+      }
+    }
+
+    *this = result;
+  }
+
+  void increment() {
+    for (uint32_t &word : m_words) {
+      if (++word != 0) {
+        return;
+      }
+    }
+
+    m_words.push_back(1);
+  }
+
+  bool bit(int index) const {
+    return ((index >= 0) && (index < (int)(m_words.size() * 32)) &&
+            ((m_words[index / 32] >> (index % 32)) & 1));
+  }
+
+  // Number of bits up to the highest one set
+  int size() const {
+    for (int i = (m_words.size() - 1); i >= 0; i--) {
+      if (m_words[i] != 0) {
+        return (i * 32 + 32 - __builtin_clz(m_words[i]));
+      }
+    }
+
+    return 0;
+  }
+
+  // 64 bits from index, bits below 0 are zeros
+  uint64_t bits(int index) const {
+    uint64_t result = 0;
+
+    for (int i = 0; i < 64; i++) {
+      if (bit(index + i)) {
+        result |= ((uint64_t)1 << i);
+      }
+    }
+
+    return result;
+  }
+
+  // Bits from index on, the ones below it dropped
+  Big above(int index) const {
+    Big result(0);
+    result.m_words.assign(m_words.size(), 0);
+
+    for (int i = index, end = size(); i < end; i++) {
+      if (bit(i)) {
+        int target = (i - index);
+        result.m_words[target / 32] |= ((uint32_t)1 << (target % 32));
+      }
+    }
+
+    return result;
+  }
+
+ private:
+  std::vector<uint32_t> m_words;
+};
+
+/**
+ * @brief The 128 highest bits of 5^q for each q from smallestPower to
+ * largestPower, two words each. Negative powers are 2^b / 5^-q rounded up
+ * (Lemire, "Number Parsing at a Gigabyte per Second", 2021).
+ */
+std::vector<uint64_t> buildPowers() {
+  std::vector<uint64_t> result;
+  std::vector<uint64_t> negative;
+
+  // 2^1800 is enough for the largest b, twice the size of 5^342 plus 128
+  const int scale = 1800;
+  Big inverse(1);
+  Big power(1);
+
+  inverse.shift(scale);
+
+  for (int n = 1; n <= -smallestPower; n++) {
+    inverse.divide(5);
+    power.multiply(5);
+
+    int z = power.size();
+    int b = ((n <= 27) ? (z + 127) : (2 * z + 128));
+    Big rounded = inverse.above(scale - b);
+    rounded.increment();
+
+    int size = rounded.size();
+    negative.push_back(rounded.bits(size - 128));
+    negative.push_back(rounded.bits(size - 64));
+  }
+
+  for (int n = -smallestPower; n >= 1; n--) {
+    result.push_back(negative[2 * (n - 1) + 1]);
+    result.push_back(negative[2 * (n - 1)]);
+  }
+
+  power = Big(1);
+
+  for (int q = 0; q <= largestPower; q++) {
+    int size = power.size();
+
+    result.push_back(power.bits(size - 64));
+    result.push_back(power.bits(size - 128));
+    power.multiply(5);
+  }
+
+  return result;
+}
+
+const uint64_t *powers() {
+  static const std::vector<uint64_t> table = buildPowers();
+
+  return table.data();
+}
+
+/**
+ * @brief The double nearest to w * 10^q, false if it can't be told from an
+ * approximation of 5^q on 128 bits.
+ */
+bool eiselLemire(int64_t q, uint64_t w, double &value) {
+  uint64_t bits;
+
+  if ((w == 0) || (q < smallestPower)) {
+    bits = 0;
+  } else if (q > largestPower) {
+    bits = ((uint64_t)0x7ff << 52);
+  } else {
+    int zeros = __builtin_clzll(w);
+    w <<= zeros;
+
+    const uint64_t *power = powers() + 2 * (q - smallestPower);
+    unsigned __int128 product = (unsigned __int128)w * power[0];
+    uint64_t high = (product >> 64);
+    uint64_t low = (uint64_t)product;
+
+    // Only the 55 highest bits matter, the lower ones may carry into them
+    if ((high & 0x1ff) == 0x1ff) {
+      uint64_t second = (((unsigned __int128)w * power[1]) >> 64);
+
+      low += second;
+      high += (second > low);
+
+      if ((low == ~(uint64_t)0) && ((q < -27) || (q > 55))) {
+        return false;
+      }
+    }
+
+    int upper = (high >> 63);
+    uint64_t mantissa = (high >> (upper + 9));
+    int power2 =
+        ((((152170 + 65536) * (int)q) >> 16) + 63 + upper - zeros + 1023);
+
+    if (power2 <= 0) {
+      // Subnormal
+      if ((-power2 + 1) >= 64) {
+        mantissa = 0;
+        power2 = 0;
+      } else {
+        mantissa >>= (-power2 + 1);
+        mantissa += (mantissa & 1);
+        mantissa >>= 1;
+        power2 = ((mantissa < ((uint64_t)1 << 52)) ? 0 : 1);
+      }
+
+      bits = (mantissa | ((uint64_t)power2 << 52));
+    } else {
+      // Exactly half way, rounded to even
+      if ((low <= 1) && (q >= -4) && (q <= 23) && ((mantissa & 3) == 1) &&
+          ((mantissa << (upper + 9)) == high)) {
+        mantissa &= ~(uint64_t)1;
+      }
+
+      mantissa += (mantissa & 1);
+      mantissa >>= 1;
+
+      if (mantissa >= ((uint64_t)2 << 52)) {
+        mantissa = ((uint64_t)1 << 52);
+        power2++;
+      }
+
+      mantissa &= ~((uint64_t)1 << 52);
+
+      if (power2 >= 0x7ff) {
+        power2 = 0x7ff;
+        mantissa = 0;
+      }
+
+      bits = (mantissa | ((uint64_t)power2 << 52));
+    }
+  }
+
+  memcpy(&value, &bits, sizeof(value));
+
+  return true;
+}
+
+bool digit(const char *p, const char *end) {
+  return ((p < end) && ((unsigned char)(*p - '0') <= 9));
+}
+}
+
+FloatingToken::FloatingToken(bool sign) : Token<double>(), m_sign(sign) {}
+
+int64_t FloatingToken::read(const tanuki::String &in, uint64_t offset,
+                            bool convert, double &value) {
+  if (offset >= in.size()) {
+    return -1;
+  }
+
+  const char *begin = in.data() + offset;
+  const char *end = in.data() + in.size();
+  const char *p = begin;
+  bool negative = (m_sign && (*p == '-'));
+
+  if (negative) {
+    p++;
+  }
+
+  // The 19 first significant digits are kept, the others only tell whether
+  // the mantissa was truncated.
+  uint64_t mantissa = 0;
+  int significant = 0;
+  int64_t exponent = 0;
+  bool truncated = false;
+  bool digits = false;
+
+  while (digit(p, end)) {
+    int d = (*p++ - '0');
+
+    if (significant < 19) {
+      mantissa = ((mantissa * 10) + d);
+      significant += (mantissa != 0);
+    } else {
+      exponent++;
+      truncated |= (d != 0);
+    }
+
+    digits = true;
+  }
+
+  if ((p < end) && (*p == '.') && (digits || digit(p + 1, end))) {
+    p++;
+
+    while (digit(p, end)) {
+      int d = (*p++ - '0');
+
+      if (significant < 19) {
+        mantissa = ((mantissa * 10) + d);
+        significant += (mantissa != 0);
+        exponent--;
+      } else {
+        truncated |= (d != 0);
+      }
+    }
+
+    digits = true;
+  }
+
+  if (!digits) {
+    return -1;
+  }
+
+  // The exponent is only part of the number with at least one digit
+  if ((p < end) && ((*p == 'e') || (*p == 'E'))) {
+    const char *q = (p + 1);
+    bool below = ((q < end) && (*q == '-'));
+
+    if ((q < end) && ((*q == '-') || (*q == '+'))) {
+      q++;
+    }
+
+    if (digit(q, end)) {
+      int64_t written = 0;
+
+      while (digit(q, end)) {
+        if (written < 100000) {
+          written = ((written * 10) + (*q - '0'));
+        }
+
+        q++;
+      }
+
+      exponent += (below ? -written : written);
+      p = q;
+    }
+  }
+
+  int64_t length = (p - begin);
+
+  if (!convert) {
+    return length;
+  }
+
+  static const double exact[] = {1e0,  1e1,  1e2,  1e3,  1e4,  1e5,
+                                 1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+                                 1e12, 1e13, 1e14, 1e15, 1e16, 1e17,
+                                 1e18, 1e19, 1e20, 1e21, 1e22};
+
+  if (!truncated && (mantissa <= ((uint64_t)1 << 53)) && (exponent >= -22) &&
+      (exponent <= 22)) {
+    // Both are exact doubles, so one operation rounds correctly (Clinger)
+    value = (double)mantissa;
+    value = ((exponent < 0) ? (value / exact[-exponent])
+                            : (value * exact[exponent]));
+  } else {
+    double lower, upper;
+    bool found = eiselLemire(exponent, mantissa, lower);
+
+    // Truncated digits are between the mantissa and the next one
+    if (found && truncated) {
+      found = (eiselLemire(exponent, mantissa + 1, upper) && (lower == upper));
+    }
+
+    if (found) {
+      value = lower;
+    } else {
+      std::string text(begin + (negative ? 1 : 0), p);
+      value = strtod(text.c_str(), nullptr);
+    }
+  }
+
+  if (negative) {
+    value = -value;
+  }
+
+  return length;
+}
+
+ref<double> FloatingToken::match(const tanuki::String &in) {
+  double value;
+
+  return ((read(in, 0, true, value) == (int64_t)in.size())
+              ? make_ref<double>(value)
+              : ref<double>());
+}
+
+Piece<double> FloatingToken::consumeAt(const tanuki::String &in,
+                                       uint64_t offset) {
+  double value;
+  int64_t length = read(in, offset, true, value);
+
+  if (length < 0) {
+    return Piece<double>{0, ref<double>()};
+  }
+
+  return Piece<double>{(uint64_t)length, make_ref<double>(value)};
+}
+
+int64_t FloatingToken::recognizeAt(const tanuki::String &in, uint64_t offset) {
+  double value;
+
+  return read(in, offset, false, value);
+}
+
+bool FloatingToken::first(CharSet &set) {
+  set.add('0', '9');
+  set.add('.');
+
+  if (m_sign) {
+    set.add('-');
+  }
+
+  return false;
+}
+
+ref<Pattern> FloatingToken::pattern() {
+  auto set = [](const char *chars) {
+    CharSet result;
+
+    for (const char *c = chars; *c != '\0'; c++) {
+      result.add(*c);
+    }
+
+    return make_ref<Pattern>(result);
+  };
+  auto node = [](Pattern::Kind kind, std::vector<ref<Pattern>> children) {
+    return make_ref<Pattern>(kind, children);
+  };
+
+  const char *digits = "0123456789";
+
+  // digits ('.' digits*)? | '.' digits, then (e [+-]? digits)?
+  ref<Pattern> whole = node(
+      Pattern::Sequence,
+      {node(Pattern::Plus, {set(digits)}),
+       node(Pattern::Optional,
+            {node(Pattern::Sequence,
+                  {set("."), node(Pattern::Optional,
+                                  {node(Pattern::Plus, {set(digits)})})})})});
+  ref<Pattern> fraction = node(
+      Pattern::Sequence, {set("."), node(Pattern::Plus, {set(digits)})});
+  ref<Pattern> exponent = node(
+      Pattern::Optional,
+      {node(Pattern::Sequence,
+            {set("eE"), node(Pattern::Optional, {set("+-")}),
+             node(Pattern::Plus, {set(digits)})})});
+
+  std::vector<ref<Pattern>> sequence{node(Pattern::Choice, {whole, fraction}),
+                                     exponent};
+
+  if (m_sign) {
+    sequence.insert(sequence.begin(), node(Pattern::Optional, {set("-")}));
+  }
+
+  return node(Pattern::Sequence, sequence);
+}
+}
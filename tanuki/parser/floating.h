@@ -0,0 +1,36 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+#include "tanuki/misc/misc.h"
+
+#include "pattern.h"
+#include "tokens.h"
+
+namespace tanuki {
+/**
+ * @brief The FloatingToken class represents a decimal number read as the
+ * nearest double: digits with an optional fraction, or a fraction alone,
+ * then an optional exponent, preceded by '-' if sign is set. Most numbers are
+ * converted with the Eisel-Lemire algorithm, the few it can't decide on go
+ * through strtod.
+ */
+class FloatingToken : public Token<double> {
+ public:
+  explicit FloatingToken(bool sign = false);
+  ref<double> match(const tanuki::String &in) override;
+  Piece<double> consumeAt(const tanuki::String &in, uint64_t offset) override;
+  int64_t recognizeAt(const tanuki::String &in, uint64_t offset) override;
+  bool first(CharSet &set) override;
+  ref<Pattern> pattern() override;
+
+ private:
+  // Length of the number at offset, -1 if there is none. The value is only
+  // converted if convert is set.
+  int64_t read(const tanuki::String &in, uint64_t offset, bool convert,
+               double &value);
+
+  bool m_sign;
+};
+}
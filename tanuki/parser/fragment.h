@@ -1,12 +1,21 @@
 #pragma once
 
+#include <algorithm>
 #include <functional>
+#include <initializer_list>
+#include <memory>
+#include <mutex>
+#include <utility>
 #include <vector>
 #include <cassert>
 
 #include "tanuki/misc/misc.h"
 #include "tanuki/misc/exception.h"
 
+#include "grammar.h"
+#include "memo.h"
+#include "pattern.h"
+#include "program.h"
 #include "rule.h"
 
 namespace tanuki {
@@ -17,7 +26,7 @@ class Fragment {
   static ref<Fragment<TResult>> select(ref<Fragment<TResult>> self, TRef ref) {
     self->handle(
         [](typename TRef::TDeepType in) -> tanuki::ref<TResult> {
-          return ((typename TRef::TValue::TReturnType*)in);
+          return in;
         },
         ref);
 
@@ -29,29 +38,57 @@ class Fragment {
                                        TRefs... refs) {
     self->handle(
         [](typename TRef::TDeepType in) -> tanuki::ref<TResult> {
-          return ((typename TRef::TValue::TReturnType*)in);
+          return in;
         },
         ref);
 
     return Fragment<TResult>::select<TRefs...>(self, refs...);
   }
 
+  // Only functions and function pointers can be empty
+  template <typename TCallback>
+  static bool callable(const TCallback&) {
+    return true;
+  }
+
+  template <typename TSignature>
+  static bool callable(const std::function<TSignature>& callback) {
+    return (bool)callback;
+  }
+
+  template <typename TReturn, typename... TArguments>
+  static bool callable(TReturn (*callback)(TArguments...)) {
+    return (callback != nullptr);
+  }
+
  public:
   typedef TResult TReturnType;
 
   int exactSize() { return -1; }
   int biggestSize() { return -1; }
 
-  Fragment() : skipAtEnd(false) {}
+  // Fragments are never compiled, even when their rules are regular
+  ref<Pattern> pattern() { return ref<Pattern>(); }
+
+  explicit Fragment(Policy policy = Policy::Longest)
+      : policy(policy),
+        skipAtEnd(false),
+        memoize(false),
+        arena(false),
+        deferred(false),
+        m_grammar(std::make_shared<Grammar>()),
+        m_nullable(false),
+        m_analysed(0),
+        m_pass(0) {}
   virtual ~Fragment() = default;
 
   template <typename TRef>
   static ref<Fragment<TResult>> select(TRef ref) {
-    tanuki::ref<Fragment<TReturnType>> result(new Fragment<TResult>());
+    tanuki::ref<Fragment<TReturnType>> result(make_ref<Fragment<TResult>>());
 
     result->handle(
         [](typename TRef::TDeepType in) -> tanuki::ref<TResult> {
-          return ((typename TRef::TValue::TReturnType*)in);
+          return in;
         },
         ref);
 
@@ -60,40 +97,31 @@ class Fragment {
 
   template <typename TRef, typename... TRefs>
   static ref<Fragment<TResult>> select(TRef ref, TRefs... refs) {
-    tanuki::ref<Fragment<TResult>> result(new Fragment<TResult>());
+    tanuki::ref<Fragment<TResult>> result(make_ref<Fragment<TResult>>());
 
     result->handle(
         [](typename TRef::TDeepType in) -> tanuki::ref<TResult> {
-          return ((typename TRef::TValue::TReturnType*)in);
+          return in;
         },
         ref);
 
     return Fragment<TResult>::select<TRefs...>(result, refs...);
   }
 
-  template <typename... TRefs>
-  void handle(std::function<ref<TResult>(
-                  std::tuple<typename TRefs::TDeepType...>)> callback,
-              TRefs... refs) {
-    Rule<TResult, TRefs...>* rule =
-        new Rule<TResult, TRefs...>(this, refs..., callback);
-    if (isLeftRecursive<TRefs...>(refs...)) {
-      if (sizeof...(TRefs) == 1) {
-        assert(false && "You try to create a rule : S -> S");
-      }
-
-      m_lr_rules.push_back(ref<Matchable<TResult>>(rule));
-    } else {
-      m_nlr_rules.push_back(ref<Matchable<TResult>>(rule));
+  /**
+   * @brief Add a rule made of refs. The callback gets the result of each ref,
+   * one by one or as a tuple, and is stored as is in the rule. Throws
+   * NoExecuteDefinition if it is an empty function.
+   */
+  template <typename TCallback, typename... TRefs>
+  void handle(TCallback callback, TRefs... refs) {
+    if (!callable(callback)) {
+      throw NoExecuteDefinition();
     }
-  }
 
-  template <typename... TRefs>
-  void handle(
-      std::function<ref<TResult>(typename TRefs::TDeepType...)> callback,
-      TRefs... refs) {
-    Rule<TResult, TRefs...>* rule =
-        new Rule<TResult, TRefs...>(this, refs..., callback);
+    Rule<TResult, TCallback, TRefs...>* rule =
+        new Rule<TResult, TCallback, TRefs...>(this, refs...,
+                                               std::move(callback));
     if (isLeftRecursive<TRefs...>(refs...)) {
       if (sizeof...(TRefs) == 1) {
         assert(false && "You try to create a rule : S -> S");
@@ -103,6 +131,7 @@ class Fragment {
     } else {
       m_nlr_rules.push_back(ref<Matchable<TResult>>(rule));
     }
+    m_grammar->modified();
   }
 
   template <typename TRef, typename... TRefs>
@@ -116,23 +145,27 @@ class Fragment {
   }
 
   tanuki::ref<TResult> match(const tanuki::String& input) {
+    Session::Scope scope(arena);
+
+    if (memoize || deferred || (policy == Policy::FirstMatch)) {
+      Piece<TResult> piece = consume(input);
+
+      return ((piece.length == input.size()) ? piece.result : ref<TResult>());
+    }
+
     ref<TResult> result;
 
     ref<std::vector<Piece<TResult>>> nonLeftRecursiveResults(
-        new std::vector<Piece<TResult>>);
-
-    for (ref<Matchable<TResult>> rule : m_nlr_rules) {
-      Piece<TResult> inner = rule->consume(input);
+        make_ref<std::vector<Piece<TResult>>>());
 
-      if (inner) {
-        nonLeftRecursiveResults->push_back(inner);
-      }
+    for (Matchable<TResult>* rule : candidates(input, 0)) {
+      rule->consumeEach(input, 0, *dereference(nonLeftRecursiveResults));
     }
 
     Yielder<Piece<TResult>> own;
     own.load(nonLeftRecursiveResults);
 
-    for (Piece<TResult> sub : own) {
+    for (const Piece<TResult>& sub : own) {
       if (sub.length == input.size()) {
         result = sub.result;
         break;
@@ -148,16 +181,17 @@ class Fragment {
         queues[i].load(nonLeftRecursiveResults);
       }
 
-      int initialResultLength, current;
+      size_t initialResultLength;
+      int current;
 
       do {
         initialResultLength = own.size();
         current = 0;
 
-        for (ref<Matchable<TResult>> rule : m_lr_rules) {
-          rule->consume(input, queues[current]);
+        for (const ref<Matchable<TResult>>& rule : m_lr_rules) {
+          rule->consumeAt(input, 0, queues[current]);
 
-          for (Piece<TResult> sub : own) {
+          for (const Piece<TResult>& sub : own) {
             if (sub.length == input.size()) {
               result = sub.result;
               goto out;
@@ -177,27 +211,585 @@ class Fragment {
   }
 
   tanuki::Piece<TResult> consume(const tanuki::String& input) {
-    tanuki::Piece<TResult> result{0, ref<TResult>()};
+    return consumeAt(input, 0);
+  }
 
-    ref<std::vector<Piece<TResult>>> nonLeftRecursiveResults(
-        new std::vector<Piece<TResult>>);
+  /**
+   * @brief Match the content of the file at path, the file is mapped and never
+   * copied. Throws FileError if it can't be mapped.
+   */
+  tanuki::ref<TResult> matchFile(const std::string& path) {
+    return match(tanuki::String::map(path));
+  }
+
+  tanuki::Piece<TResult> consumeFile(const std::string& path) {
+    return consumeAt(tanuki::String::map(path), 0);
+  }
 
-    for (ref<Matchable<TResult>> rule : m_nlr_rules) {
-      Piece<TResult> inner = rule->consume(input);
+  tanuki::Piece<TResult> consumeAt(const tanuki::String& input,
+                                   uint64_t offset) {
+    Session::Scope scope(arena);
+
+    if (candidates(input, offset).empty()) {
+      // Nothing can start here, left recursive rules neither
+      return Piece<TResult>{0, ref<TResult>()};
+    } else if (deferred) {
+      return derive(input, offset);
+    } else if (!memoize) {
+      return ((policy == Policy::FirstMatch) ? resolveFirst(input, offset)
+                                             : resolve(input, offset));
+    }
 
-      if (inner) {
-        nonLeftRecursiveResults->push_back(inner);
+    typename MemoTable<Piece<TResult>>::Entry* memo =
+        m_memo.find(input, offset);
+
+    if (memo != nullptr) {
+      if (memo->evaluating) {
+        Session::recurse(memo);
       }
+
+      return memo->value;
+    }
+
+    return consumeMemoized(input, offset);
+  }
+
+  /**
+   * @brief Recognize the whole input without building any result nor calling
+   * any callback.
+   */
+  bool matches(const tanuki::String& input) {
+    return (recognizeAt(input, 0) == (int64_t)input.size());
+  }
+
+  /**
+   * @brief The fragment and everything it reaches lowered into a program,
+   * which recognizes the same input without recursing on the C++ stack. Only
+   * recognition goes through it, match and consume still recurse.
+   */
+  ref<Program> program() {
+    return Program::Builder().build(
+        this, [this](Program::Builder& builder) { lower(builder); });
+  }
+
+  /**
+   * @brief Lower the rules into builder as a choice. Left recursion is grown
+   * by the fragment itself, so it is called as it is when it has some.
+   */
+  void lower(Program::Builder& builder) {
+    if (!m_lr_rules.empty()) {
+      builder.native(
+          [this](const tanuki::String& in, uint64_t offset) {
+            return recognizeAt(in, offset);
+          },
+          "left recursive " + Program::Builder::name(typeid(*this)));
+
+      return;
+    }
+
+    std::vector<Program::Alternative> alternatives;
+    CharSet set;
+
+    // Runs the analysis of the grammar if it changed
+    first(set);
+
+    for (const ref<Matchable<TResult>>& rule : m_nlr_rules) {
+      Matchable<TResult>* lowered = rule.operator->();
+      Program::Alternative alternative;
+
+      alternative.nullable = lowered->first(alternative.first);
+      alternative.body = [lowered](Program::Builder& builder) {
+        lowered->lower(builder);
+      };
+
+      alternatives.push_back(alternative);
+    }
+
+    builder.choose(alternatives, (policy == Policy::Longest));
+  }
+
+  int64_t recognizeAt(const tanuki::String& input, uint64_t offset) {
+    Session::Scope scope;
+
+    if (candidates(input, offset).empty()) {
+      return -1;
+    } else if (!memoize) {
+      return ((policy == Policy::FirstMatch) ? recognizeFirst(input, offset)
+                                             : recognize(input, offset));
+    }
+
+    typename MemoTable<int64_t>::Entry* memo = m_recognized.find(input, offset);
+
+    if (memo != nullptr) {
+      if (memo->evaluating) {
+        Session::recurse(memo);
+      }
+
+      return memo->value;
+    }
+
+    memo = m_recognized.insert(input, offset, -1);
+
+    int64_t result = growRecognition(input, offset, memo);
+
+    if (memo->involved) {
+      m_recognized.erase(input, offset);
+    } else {
+      memo->evaluating = false;
+      memo->value = result;
+    }
+
+    return result;
+  }
+
+  template <typename TToken, typename... TOther>
+  void skip(TToken token, TOther... other) {
+    skip<TToken>(token);
+    skip<TOther...>(other...);
+  }
+
+  template <typename TToken>
+  void skip(TToken token) {
+    this->m_skipped.push_back(Skipped{
+        [token](const tanuki::String& in, uint64_t offset) -> int64_t {
+          int64_t length = token->recognizeAt(in, offset);
+
+          return ((length > 0) ? length : 0);
+        },
+        [token](CharSet& set) { token->first(set); },
+        [token]() { return token->pattern(); }});
+
+    m_grammar->modified();
+  }
+
+  void firstSkipped(CharSet& set) {
+    for (const Skipped& skipped : m_skipped) {
+      skipped.first(set);
+    }
+  }
+
+  int64_t shouldSkip(const tanuki::String& in, uint64_t offset) {
+    int64_t res = 0;
+
+    for (const Skipped& skipped : m_skipped) {
+      int64_t current = skipped.recognize(in, offset);
+
+      if (current > 0) {
+        res = current;
+        break;
+      }
+    }
+
+    return res;
+  }
+
+  /**
+   * @brief Offset of the first byte from offset which isn't skipped.
+   */
+  uint64_t skipFrom(const tanuki::String& in, uint64_t offset) {
+    if (m_skipped.empty() || (offset >= in.size())) {
+      return offset;
+    }
+
+    const Skipping& skipping = skippingTable();
+
+    if (skipping.runs) {
+      return (offset +
+              skipping.scanner.span(in.data() + offset, in.size() - offset));
+    }
+
+    // No skipped token starts outside of skipping.first
+    while ((offset < in.size()) &&
+           skipping.first.has((unsigned char)in[offset])) {
+      int64_t toSkip = shouldSkip(in, offset);
+
+      if (toSkip == 0) {
+        break;
+      }
+
+      offset += toSkip;
+    }
+
+    return offset;
+  }
+
+  /**
+   * @brief Lower skipFrom into builder, as a span when it is one.
+   */
+  void lowerSkipped(Program::Builder& builder) {
+    if (m_skipped.empty()) {
+      return;
+    }
+
+    const Skipping& skipping = skippingTable();
+
+    if (skipping.runs) {
+      builder.span(skipping.chars);
+    } else {
+      builder.native(
+          [this](const tanuki::String& in, uint64_t offset) {
+            return (int64_t)(skipFrom(in, offset) - offset);
+          },
+          "tokens skipped by " + Program::Builder::name(typeid(*this)));
+    }
+  }
+
+  /**
+   * @brief Add the bytes a match can start with to set, returns whether the
+   * fragment can match without consuming anything. The sets of the grammar
+   * are computed again once a rule or a skip is added to one of its
+   * fragments, by the first thread needing them.
+   */
+  bool first(CharSet& set) {
+    if (Grammar::analysing()) {
+      Grammar::join(Grammar::analysed(), m_grammar);
+
+      if (m_pass != Grammar::pass()) {
+        update();
+      }
+    } else if (m_analysed.load(std::memory_order_acquire) !=
+               m_grammar->version()) {
+      std::lock_guard<std::recursive_mutex> lock(Grammar::mutex());
+
+      if (m_analysed.load(std::memory_order_relaxed) != m_grammar->version()) {
+        Grammar::Analysis analysis(m_grammar);
+
+        while (analysis.next()) {
+          update();
+        }
+      }
+    }
+
+    set.merge(m_first);
+
+    return m_nullable;
+  }
+
+  Policy policy;
+
+  bool skipAtEnd;
+
+  /**
+   * @brief When set, consumed pieces are cached by position until the end of
+   * the top-level parse (packrat parsing). Left recursion is then grown from
+   * the memo, which also resolves indirect left recursion as long as one of
+   * the fragments of the cycle is memoized.
+   */
+  bool memoize;
+
+  /**
+   * @brief When set on the top-level fragment, the results of a parse are
+   * allocated from an arena which is released in one shot once every result
+   * of the parse is dropped.
+   */
+  bool arena;
+
+  /**
+   * @brief When set, the derivation is first recognized and only the winning
+   * one is built: callbacks of discarded candidates are never called.
+   */
+  bool deferred;
+
+ private:
+  // Rules to try by next byte, and the factored rules they point to
+  struct Dispatch {
+    std::vector<std::vector<Matchable<TResult>*>> alternatives;
+    uint16_t index[257];  // In alternatives, 256 is the end
+    std::vector<ref<Matchable<TResult>>> factored;
+  };
+
+  struct Skipped {
+    std::function<int64_t(const tanuki::String&, uint64_t)> recognize;
+    std::function<void(CharSet&)> first;
+    std::function<ref<Pattern>()> pattern;
+  };
+
+  // When each skipped token matches runs of a char class, all the skipped
+  // bytes are scanned at once, otherwise their FIRST set tells where none
+  // applies
+  struct Skipping {
+    CharSet first;
+    CharScanner scanner;
+    CharSet chars;
+    bool runs;
+  };
+
+  const Skipping& skippingTable() {
+    return m_skipping.get([this]() { return m_grammar->version(); },
+                          [this]() { return compileSkipped(); });
+  }
+
+  Skipping compileSkipped() {
+    Skipping skipping;
+    bool regular = true;
+
+    for (const Skipped& skipped : m_skipped) {
+      ref<Pattern> pattern = skipped.pattern();
+
+      skipped.first(skipping.first);
+      regular = (regular && (bool)pattern && pattern->run(skipping.chars));
+    }
+
+    skipping.scanner = CharScanner(skipping.chars);
+    skipping.runs = regular;
+
+    return skipping;
+  }
+
+  tanuki::Piece<TResult> consumeMemoized(const tanuki::String& input,
+                                         uint64_t offset) {
+    typename MemoTable<Piece<TResult>>::Entry* memo =
+        m_memo.insert(input, offset, Piece<TResult>{0, ref<TResult>()});
+
+    Piece<TResult> result = grow(input, offset, memo);
+
+    if (memo->involved) {
+      m_memo.erase(input, offset);
+    } else {
+      memo->evaluating = false;
+      memo->value = result;
+    }
+
+    return result;
+  }
+
+  /**
+   * @brief Deferred resolution, the reachable lengths are recognized with the
+   * rule which reached them, then only the chain of the longest one is built.
+   */
+  tanuki::Piece<TResult> derive(const tanuki::String& input, uint64_t offset) {
+    if (memoize) {
+      return deriveMemoized(input, offset);
+    }
+
+    struct Reach {
+      uint64_t length;
+      int from;  // Reach extended by a left recursive rule, -1 for a seed
+      Matchable<TResult>* rule;
+    };
+
+    std::vector<Reach> reaches;
+
+    auto reach = [&reaches](int64_t length, int from,
+                            Matchable<TResult>* rule) {
+      for (const Reach& known : reaches) {
+        if (known.length == (uint64_t)length) {
+          return;
+        }
+      }
+
+      reaches.push_back(Reach{(uint64_t)length, from, rule});
+    };
+
+    std::vector<std::pair<Matchable<TResult>*, int64_t>> seeds;
+
+    bool first = (policy == Policy::FirstMatch);
+
+    for (Matchable<TResult>* rule : candidates(input, offset)) {
+      rule->recognizeEach(input, offset, seeds);
+
+      if (first && !seeds.empty()) {
+        seeds.resize(1);
+        break;
+      }
+    }
+
+    for (const std::pair<Matchable<TResult>*, int64_t>& seed : seeds) {
+      reach(seed.second, -1, seed.first);
+    }
+
+    // With the first match policy, each reach is extended at most once
+    for (size_t i = 0; (i < reaches.size()) && !m_lr_rules.empty(); i++) {
+      for (const ref<Matchable<TResult>>& rule : m_lr_rules) {
+        int64_t length = rule->extendAt(input, offset, reaches[i].length);
+
+        if (length >= 0) {
+          reach(length, i, dereference(rule));
+
+          if (first) {
+            break;
+          }
+        }
+      }
+    }
+
+    if (reaches.empty()) {
+      return Piece<TResult>{0, ref<TResult>()};
+    }
+
+    int best = 0;
+
+    for (size_t i = 1; i < reaches.size(); i++) {
+      if (reaches[best].length < reaches[i].length) {
+        best = i;
+      }
+    }
+
+    std::vector<Matchable<TResult>*> chain;
+
+    for (int i = best; i >= 0; i = reaches[i].from) {
+      chain.push_back(reaches[i].rule);
+    }
+
+    Piece<TResult> result = chain.back()->consumeAt(input, offset);
+    chain.pop_back();
+
+    while (result && !chain.empty()) {
+      result = chain.back()->extendAt(input, offset, result);
+      chain.pop_back();
+    }
+
+    return result;
+  }
+
+  /**
+   * @brief Deferred seed growing, the stages are recognized with the rule which
+   * won each of them and built again in order. Each built stage is memoized, so
+   * the left recursive call of the next one gets it back.
+   */
+  tanuki::Piece<TResult> deriveMemoized(const tanuki::String& input,
+                                        uint64_t offset) {
+    typename MemoTable<Piece<TResult>>::Entry* memo =
+        m_memo.find(input, offset);
+
+    if (memo != nullptr) {
+      if (memo->evaluating) {
+        Session::recurse(memo);
+      }
+
+      return memo->value;
+    }
+
+    std::vector<Matchable<TResult>*> stages;
+
+    if (!trace(input, offset, stages)) {
+      // Involved in the left recursion of another fragment
+      return consumeMemoized(input, offset);
+    }
+
+    memo = m_memo.insert(input, offset, Piece<TResult>{0, ref<TResult>()});
+    memo->evaluating = false;
+
+    for (Matchable<TResult>* rule : stages) {
+      Piece<TResult> stage = rule->consumeAt(input, offset);
+      memo->value = std::move(stage);
+    }
+
+    return memo->value;
+  }
+
+  bool trace(const tanuki::String& input, uint64_t offset,
+             std::vector<Matchable<TResult>*>& stages) {
+    m_recognized.erase(input, offset);
+
+    typename MemoTable<int64_t>::Entry* memo =
+        m_recognized.insert(input, offset, -1);
+    std::pair<Matchable<TResult>*, int64_t> best;
+
+    {
+      Session::Evaluation evaluation(memo);
+
+      best = recognizeBest(input, offset);
+
+      while (memo->head && (memo->value < best.second)) {
+        stages.push_back(best.first);
+        memo->value = best.second;
+        best = recognizeBest(input, offset);
+      }
+    }
+
+    if (memo->involved) {
+      m_recognized.erase(input, offset);
+      stages.clear();
+
+      return false;
+    }
+
+    if (!memo->head && (best.second >= 0)) {
+      stages.push_back(best.first);
+      memo->value = best.second;
+    }
+
+    memo->evaluating = false;
+
+    return true;
+  }
+
+  std::pair<Matchable<TResult>*, int64_t> recognizeBest(
+      const tanuki::String& input, uint64_t offset) {
+    std::pair<Matchable<TResult>*, int64_t> result(nullptr, -1);
+    int64_t remaining = input.size() - offset;
+
+    std::vector<std::pair<Matchable<TResult>*, int64_t>> reached;
+
+    // Factored rules report the rule reaching each length, which is built
+    auto attempt = [&](Matchable<TResult>* rule) {
+      reached.clear();
+      rule->recognizeEach(input, offset, reached);
+
+      if (policy == Policy::FirstMatch) {
+        if (!reached.empty()) {
+          result = reached.front();
+        }
+
+        return !reached.empty();
+      }
+
+      for (const std::pair<Matchable<TResult>*, int64_t>& sub : reached) {
+        if (result.second < sub.second) {
+          result = sub;
+        }
+      }
+
+      return (result.second == remaining);
+    };
+
+    if (policy == Policy::FirstMatch) {
+      for (const ref<Matchable<TResult>>& rule : m_lr_rules) {
+        if (attempt(dereference(rule))) {
+          return result;
+        }
+      }
+    }
+
+    for (Matchable<TResult>* rule : candidates(input, offset)) {
+      if (attempt(rule)) {
+        return result;
+      }
+    }
+
+    if (policy == Policy::Longest) {
+      for (const ref<Matchable<TResult>>& rule : m_lr_rules) {
+        if (attempt(dereference(rule))) {
+          return result;
+        }
+      }
+    }
+
+    return result;
+  }
+
+  tanuki::Piece<TResult> resolve(const tanuki::String& input,
+                                 uint64_t offset) {
+    tanuki::Piece<TResult> result{0, ref<TResult>()};
+    uint64_t remaining = input.size() - offset;
+
+    ref<std::vector<Piece<TResult>>> nonLeftRecursiveResults(
+        make_ref<std::vector<Piece<TResult>>>());
+
+    for (Matchable<TResult>* rule : candidates(input, offset)) {
+      rule->consumeEach(input, offset,
+                        *dereference(nonLeftRecursiveResults));
     }
 
     Yielder<Piece<TResult>> own;
     own.load(nonLeftRecursiveResults);
 
-    for (Piece<TResult> sub : own) {
+    for (const Piece<TResult>& sub : own) {
       if (result.length < sub.length) {
         result = sub;
 
-        if (sub.length == input.size()) {
+        if (sub.length == remaining) {
           goto end;
         }
       }
@@ -212,20 +804,21 @@ class Fragment {
         queues[i].load(nonLeftRecursiveResults);
       }
 
-      int initialResultLength, current;
+      size_t initialResultLength;
+      int current;
 
       do {
         initialResultLength = own.size();
         current = 0;
 
-        for (ref<Matchable<TResult>> rule : m_lr_rules) {
-          rule->consume(input, queues[current]);
+        for (const ref<Matchable<TResult>>& rule : m_lr_rules) {
+          rule->consumeAt(input, offset, queues[current]);
 
-          for (Piece<TResult> sub : own) {
+          for (const Piece<TResult>& sub : own) {
             if (result.length < sub.length) {
               result = sub;
 
-              if (sub.length == input.size()) {
+              if (sub.length == remaining) {
                 goto out;
               }
             }
@@ -245,59 +838,402 @@ class Fragment {
     return result;
   }
 
-  template <typename TToken, typename... TOther>
-  void skip(TToken token, TOther... other) {
-    this->m_skipped.push_back([token](const tanuki::String& in) -> int {
-      Piece<typename TToken::TValue::TReturnType> result = token->consume(in);
+  /**
+   * @brief Ordered choice, the first rule which succeeds is the seed. It is
+   * then extended by the first left recursive rule which gets it longer.
+   */
+  tanuki::Piece<TResult> resolveFirst(const tanuki::String& input,
+                                      uint64_t offset) {
+    tanuki::Piece<TResult> result{0, ref<TResult>()};
+
+    for (Matchable<TResult>* rule : candidates(input, offset)) {
+      result = rule->consumeAt(input, offset);
 
-      if (result.result) {
-        return result.length;
-      } else {
-        return 0;
+      if (result) {
+        break;
       }
-    });
+    }
 
-    skip<TOther...>(other...);
-  }
+    bool extended = (bool)result;
 
-  template <typename TToken>
-  void skip(TToken token) {
-    this->m_skipped.push_back([token](const tanuki::String& in) -> int {
-      Piece<typename TToken::TValue::TReturnType> result = token->consume(in);
+    while (extended) {
+      extended = false;
 
-      if (result.result) {
-        return result.length;
-      } else {
-        return 0;
+      for (const ref<Matchable<TResult>>& rule : m_lr_rules) {
+        Piece<TResult> sub = rule->extendAt(input, offset, result);
+
+        if (sub) {
+          extended = (result.length < sub.length);
+
+          if (extended) {
+            result = std::move(sub);
+          }
+
+          break;
+        }
       }
-    });
+    }
+
+    return result;
   }
 
-  int shouldSkip(const tanuki::String& in) {
-    int res = 0;
+  int64_t recognizeFirst(const tanuki::String& input, uint64_t offset) {
+    int64_t result = -1;
 
-    for (const std::function<int(const tanuki::String&)>& skipped : m_skipped) {
-      int current = skipped(in);
+    for (Matchable<TResult>* rule : candidates(input, offset)) {
+      result = rule->recognizeAt(input, offset);
 
-      if (current > 0) {
-        res = current;
+      if (result >= 0) {
         break;
       }
     }
 
-    return res;
+    bool extended = (result >= 0);
+
+    while (extended) {
+      extended = false;
+
+      for (const ref<Matchable<TResult>>& rule : m_lr_rules) {
+        int64_t length = rule->extendAt(input, offset, result);
+
+        if (length >= 0) {
+          extended = (result < length);
+
+          if (extended) {
+            result = length;
+          }
+
+          break;
+        }
+      }
+    }
+
+    return result;
   }
 
-  bool skipAtEnd;
+  /**
+   * @brief Seed-growing resolution of left recursion (Warth et al.), left
+   * recursive rules are resolved as any other rule and reach the memo entry
+   * again. Once this happens, the seed is grown until it stops getting longer.
+   */
+  tanuki::Piece<TResult> grow(const tanuki::String& input, uint64_t offset,
+                              typename MemoTable<Piece<TResult>>::Entry* memo) {
+    Session::Evaluation evaluation(memo);
+
+    Piece<TResult> result = resolveAll(input, offset);
+
+    while (memo->head && (memo->value.length < result.length)) {
+      memo->value = std::move(result);
+      result = resolveAll(input, offset);
+    }
+
+    return (memo->head ? memo->value : result);
+  }
+
+  tanuki::Piece<TResult> resolveAll(const tanuki::String& input,
+                                    uint64_t offset) {
+    tanuki::Piece<TResult> result{0, ref<TResult>()};
+
+    bool first = (policy == Policy::FirstMatch);
+
+    auto attempt = [&](Matchable<TResult>* rule) {
+      Piece<TResult> sub = rule->consumeAt(input, offset);
+
+      if (sub && (first || (result.length < sub.length))) {
+        result = std::move(sub);
+      }
+
+      return (result && (first || (result.length == (input.size() - offset))));
+    };
+
+    // The first match grows the seed with left recursive rules before others
+    if (first) {
+      for (const ref<Matchable<TResult>>& rule : m_lr_rules) {
+        if (attempt(dereference(rule))) {
+          return result;
+        }
+      }
+    }
+
+    for (Matchable<TResult>* rule : candidates(input, offset)) {
+      if (attempt(rule)) {
+        return result;
+      }
+    }
+
+    if (!first) {
+      for (const ref<Matchable<TResult>>& rule : m_lr_rules) {
+        if (attempt(dereference(rule))) {
+          return result;
+        }
+      }
+    }
+
+    return result;
+  }
+
+  int64_t recognize(const tanuki::String& input, uint64_t offset) {
+    int64_t result = -1;
+    int64_t remaining = input.size() - offset;
+
+    if (m_lr_rules.empty()) {
+      for (Matchable<TResult>* rule : candidates(input, offset)) {
+        result = std::max(result, rule->recognizeAt(input, offset));
+
+        if (result == remaining) {
+          break;
+        }
+      }
+
+      return result;
+    }
+
+    // Left recursive rules extend every seed, not only the longest one
+    std::vector<std::pair<Matchable<TResult>*, int64_t>> seeds;
+    std::vector<uint64_t> lengths;
+
+    for (Matchable<TResult>* rule : candidates(input, offset)) {
+      rule->recognizeEach(input, offset, seeds);
+    }
+
+    for (const std::pair<Matchable<TResult>*, int64_t>& seed : seeds) {
+      if (seed.second == remaining) {
+        return seed.second;
+      }
+
+      result = std::max(result, seed.second);
+
+      if (std::find(lengths.begin(), lengths.end(), (uint64_t)seed.second) ==
+          lengths.end()) {
+        lengths.push_back(seed.second);
+      }
+    }
+
+    if (lengths.empty()) {
+      return result;
+    }
+
+    std::vector<size_t> cursors(m_lr_rules.size(), 0);
+    size_t initialSize;
+
+    do {
+      initialSize = lengths.size();
+
+      for (size_t i = 0; i < m_lr_rules.size(); i++) {
+        m_lr_rules[i]->recognizeAt(input, offset, lengths, cursors[i]);
+      }
+    } while (initialSize < lengths.size());
+
+    for (uint64_t length : lengths) {
+      result = std::max(result, (int64_t)length);
+    }
+
+    return result;
+  }
+
+  int64_t growRecognition(const tanuki::String& input, uint64_t offset,
+                          typename MemoTable<int64_t>::Entry* memo) {
+    Session::Evaluation evaluation(memo);
+
+    int64_t result = recognizeAll(input, offset);
+
+    while (memo->head && (memo->value < result)) {
+      memo->value = result;
+      result = recognizeAll(input, offset);
+    }
+
+    return (memo->head ? memo->value : result);
+  }
+
+  int64_t recognizeAll(const tanuki::String& input, uint64_t offset) {
+    int64_t result = -1;
+    int64_t remaining = input.size() - offset;
+
+    if (policy == Policy::FirstMatch) {
+      for (const ref<Matchable<TResult>>& rule : m_lr_rules) {
+        result = rule->recognizeAt(input, offset);
+
+        if (result >= 0) {
+          return result;
+        }
+      }
+
+      for (Matchable<TResult>* rule : candidates(input, offset)) {
+        result = rule->recognizeAt(input, offset);
+
+        if (result >= 0) {
+          return result;
+        }
+      }
+
+      return result;
+    }
+
+    for (Matchable<TResult>* rule : candidates(input, offset)) {
+      result = std::max(result, rule->recognizeAt(input, offset));
+
+      if (result == remaining) {
+        return result;
+      }
+    }
+
+    for (const ref<Matchable<TResult>>& rule : m_lr_rules) {
+      result = std::max(result, rule->recognizeAt(input, offset));
+
+      if (result == remaining) {
+        return result;
+      }
+    }
+
+    return result;
+  }
+
+  /**
+   * @brief One pass of the analysis, the sets of the rules are merged with the
+   * approximation of the other fragments.
+   */
+  void update() {
+    CharSet set(m_first);
+    bool nullable = m_nullable;
+
+    m_pass = Grammar::pass();
+
+    for (std::vector<ref<Matchable<TResult>>>* rules :
+         {&m_nlr_rules, &m_lr_rules}) {
+      for (const ref<Matchable<TResult>>& rule : *rules) {
+        nullable = (rule->first(set) || nullable);
+      }
+    }
+
+    if ((set != m_first) || (nullable != m_nullable)) {
+      m_first = set;
+      m_nullable = nullable;
+
+      Grammar::changed();
+    }
+
+    Grammar::Analysis::reached(m_analysed);
+  }
+
+  /**
+   * @brief Non left recursive rules which can start at offset, in order. Left
+   * recursive rules start with the fragment itself, so they need one of them.
+   */
+  const std::vector<Matchable<TResult>*>& candidates(
+      const tanuki::String& input, uint64_t offset) {
+    const Dispatch& table =
+        m_dispatch.get([this]() { return m_grammar->version(); },
+                       [this]() { return dispatch(); });
+
+    // Past the last byte, only rules consuming nothing are left
+    int next = ((offset < input.size())
+                    ? (unsigned char)input.data()[offset]
+                    : 256);
+
+    return table.alternatives[table.index[next]];
+  }
+
+  Dispatch dispatch() {
+    Dispatch table;
+    CharSet set;
+    first(set);
+
+    std::vector<Matchable<TResult>*> rules = factor(table.factored);
+    std::vector<CharSet> sets(rules.size());
+    std::vector<bool> nullables;
+
+    for (size_t i = 0; i < rules.size(); i++) {
+      nullables.push_back(rules[i]->first(sets[i]));
+    }
+
+    // Most bytes share the same rules, the lists are stored once
+    for (int next = 0; next <= 256; next++) {
+      std::vector<Matchable<TResult>*> alternatives;
+
+      for (size_t i = 0; i < rules.size(); i++) {
+        if (nullables[i] || ((next < 256) && sets[i].has(next))) {
+          alternatives.push_back(rules[i]);
+        }
+      }
+
+      auto known = std::find(table.alternatives.begin(),
+                             table.alternatives.end(), alternatives);
+
+      table.index[next] = (known - table.alternatives.begin());
+
+      if (known == table.alternatives.end()) {
+        table.alternatives.push_back(std::move(alternatives));
+      }
+    }
+
+    return table;
+  }
+
+  /**
+   * @brief Left factoring of the non left recursive rules, adjacent rules
+   * starting with the same ref are grouped so it is consumed once. Only
+   * adjacent ones are, so the first of the longest results is still the same.
+   * The rules made are kept in factored.
+   */
+  std::vector<Matchable<TResult>*> factor(
+      std::vector<ref<Matchable<TResult>>>& factored) {
+    std::vector<Matchable<TResult>*> result;
+
+    for (size_t i = 0; i < m_nlr_rules.size();) {
+      const void* leader = m_nlr_rules[i]->leader();
+      size_t end = i + 1;
+
+      while ((leader != nullptr) && (end < m_nlr_rules.size()) &&
+             (m_nlr_rules[end]->leader() == leader)) {
+        end++;
+      }
+
+      if ((end - i) > 1) {
+        std::vector<Matchable<TResult>*> rules;
+
+        for (size_t j = i; j < end; j++) {
+          rules.push_back(dereference(m_nlr_rules[j]));
+        }
+
+        ref<Matchable<TResult>> grouped = m_nlr_rules[i]->factor(rules);
+
+        if (grouped) {
+          result.push_back(dereference(grouped));
+          factored.push_back(grouped);
+          i = end;
+
+          continue;
+        }
+      }
+
+      result.push_back(dereference(m_nlr_rules[i]));
+      i++;
+    }
+
+    return result;
+  }
 
- private:
   std::vector<ref<Matchable<TResult>>> m_lr_rules;
   std::vector<ref<Matchable<TResult>>> m_nlr_rules;
-  std::vector<std::function<int(const tanuki::String&)>> m_skipped;
+  std::vector<Skipped> m_skipped;
+  MemoTable<Piece<TResult>> m_memo;
+  MemoTable<int64_t> m_recognized;
+
+  std::shared_ptr<Grammar> m_grammar;
+
+  // FIRST set of the fragment, valid for the m_analysed grammar version
+  CharSet m_first;
+  bool m_nullable;
+  std::atomic<unsigned int> m_analysed;
+  unsigned int m_pass;
+
+  // Built on first use and again once the grammar changes
+  Lazy<Dispatch> m_dispatch;
+  Lazy<Skipping> m_skipping;
 };
 
 template <typename T>
-tanuki::ref<Fragment<T>> fragment() {
-  return tanuki::ref<Fragment<T>>(new Fragment<T>);
+tanuki::ref<Fragment<T>> fragment(Policy policy = Policy::Longest) {
+  return make_ref<Fragment<T>>(policy);
 }
 }
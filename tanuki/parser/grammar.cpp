@@ -0,0 +1,159 @@
+#include "grammar.h"
+
+namespace tanuki {
+namespace {
+// Versions are unique across grammars, so one joined to another can't keep
+// the version a stamp was set for
+std::atomic<unsigned int> versionCounter(1);
+std::atomic<unsigned int> epochCounter(1);
+std::atomic<unsigned int> revisionCounter(1);
+
+// Top-level parses running, and what was retired while they were
+std::atomic<unsigned int> parses(0);
+std::vector<std::unique_ptr<Grammar::Retired>> retired;
+
+thread_local unsigned int passCounter = 0;
+thread_local Grammar::Analysis *running = nullptr;
+thread_local bool dirty = false;
+}
+
+Grammar::Grammar()
+    : m_parent(nullptr), m_size(1), m_version(versionCounter++) {}
+
+unsigned int Grammar::version() const {
+  return root()->m_version.load(std::memory_order_acquire);
+}
+
+void Grammar::modified() {
+  root()->m_version.store(versionCounter++, std::memory_order_release);
+  epochCounter++;
+}
+
+void Grammar::join(const std::shared_ptr<Grammar> &first,
+                   const std::shared_ptr<Grammar> &second) {
+  std::lock_guard<std::recursive_mutex> lock(mutex());
+  std::shared_ptr<Grammar> big = root(first);
+  std::shared_ptr<Grammar> small = root(second);
+
+  if (big == small) {
+    return;
+  }
+
+  // The smaller one is joined, so paths to roots stay logarithmic
+  if (big->m_size < small->m_size) {
+    std::swap(big, small);
+  }
+
+  big->m_size += small->m_size;
+  big->m_version.store(versionCounter++, std::memory_order_release);
+  small->m_owner = big;
+  small->m_parent.store(big.get(), std::memory_order_release);
+}
+
+unsigned int Grammar::epoch() { return epochCounter.load(); }
+
+unsigned int Grammar::revision() { return revisionCounter.load(); }
+
+// The first sets of fragments may change too
+void Grammar::revised() {
+  revisionCounter++;
+  epochCounter++;
+}
+
+std::recursive_mutex &Grammar::mutex() {
+  static std::recursive_mutex guard;
+
+  return guard;
+}
+
+bool Grammar::analysing() { return (running != nullptr); }
+
+unsigned int Grammar::pass() { return passCounter; }
+
+void Grammar::changed() { dirty = true; }
+
+const std::shared_ptr<Grammar> &Grammar::analysed() {
+  return running->m_grammar;
+}
+
+Grammar::Retired::~Retired() {}
+
+void Grammar::retire(Retired *value) {
+  std::lock_guard<std::recursive_mutex> lock(mutex());
+
+  if (parses.load() == 0) {
+    delete value;
+  } else {
+    retired.emplace_back(value);
+  }
+}
+
+void Grammar::started() { parses++; }
+
+void Grammar::finished() {
+  if (--parses == 0) {
+    std::lock_guard<std::recursive_mutex> lock(mutex());
+
+    // A parse started since can only read values which weren't retired
+    if (parses.load() == 0) {
+      retired.clear();
+    }
+  }
+}
+
+const Grammar *Grammar::root() const {
+  const Grammar *current = this;
+  const Grammar *parent;
+
+  while ((parent = current->m_parent.load(std::memory_order_acquire)) !=
+         nullptr) {
+    current = parent;
+  }
+
+  return current;
+}
+
+Grammar *Grammar::root() {
+  return const_cast<Grammar *>(static_cast<const Grammar *>(this)->root());
+}
+
+std::shared_ptr<Grammar> Grammar::root(std::shared_ptr<Grammar> grammar) {
+  while (grammar->m_owner) {
+    grammar = grammar->m_owner;
+  }
+
+  return grammar;
+}
+
+Grammar::Analysis::Analysis(const std::shared_ptr<Grammar> &grammar)
+    : m_grammar(grammar), m_first(true), m_outer(running), m_dirty(dirty) {
+  running = this;
+}
+
+Grammar::Analysis::~Analysis() {
+  running = m_outer;
+  dirty = m_dirty;
+}
+
+bool Grammar::Analysis::next() {
+  if (!m_first && !dirty) {
+    unsigned int version = m_grammar->version();
+
+    for (std::atomic<unsigned int> *stamp : m_reached) {
+      stamp->store(version, std::memory_order_release);
+    }
+
+    return false;
+  }
+
+  m_first = false;
+  dirty = false;
+  passCounter++;
+
+  return true;
+}
+
+void Grammar::Analysis::reached(std::atomic<unsigned int> &stamp) {
+  running->m_reached.push_back(&stamp);
+}
+}
@@ -0,0 +1,194 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace tanuki {
+/**
+ * @brief The Grammar class is the set of fragments which reach each other,
+ * and drives their static analysis (FIRST sets and nullability). A new rule
+ * or skip only invalidates the analysis of its own grammar, which then runs
+ * passes until the sets of the fragments reached stop growing, so cycles
+ * between fragments are resolved. Fragments reached by an analysis are
+ * joined to its grammar.
+ *
+ * Grammars may be parsed from several threads at once, but not modified
+ * while they are. What fragments and tokens build lazily is built under
+ * mutex(), see Lazy.
+ */
+class Grammar {
+ public:
+  Grammar();
+
+  /**
+   * @brief Changes whenever a fragment of the grammar is modified or the
+   * grammar is joined to another one.
+   */
+  unsigned int version() const;
+  void modified();
+
+  /**
+   * @brief Make one grammar of first and second.
+   */
+  static void join(const std::shared_ptr<Grammar> &first,
+                   const std::shared_ptr<Grammar> &second);
+
+  /**
+   * @brief Changes whenever any grammar is modified, for tokens which can't
+   * tell the fragments they reach.
+   */
+  static unsigned int epoch();
+
+  /**
+   * @brief Changes whenever a token is changed in place (see
+   * AnyOfToken::validate), for what is built from the patterns of tokens.
+   */
+  static unsigned int revision();
+  static void revised();
+
+  /**
+   * @brief Guards the analyses and everything built lazily.
+   */
+  static std::recursive_mutex &mutex();
+
+  static bool analysing();
+  static unsigned int pass();
+  static void changed();
+
+  /**
+   * @brief The grammar of the analysis running on this thread.
+   */
+  static const std::shared_ptr<Grammar> &analysed();
+
+  /**
+   * @brief A value which was built lazily and is superseded, see Lazy.
+   */
+  class Retired {
+   public:
+    virtual ~Retired();
+  };
+
+  /**
+   * @brief Free retired once no parse runs anymore, since they may still be
+   * reading it.
+   */
+  static void retire(Retired *retired);
+
+  /**
+   * @brief Called by the sessions when a top-level parse starts and ends.
+   */
+  static void started();
+  static void finished();
+
+  /**
+   * @brief The Analysis class runs the passes of one analysis, fragments are
+   * updated once per pass and use the approximation of the others. Their
+   * stamps are only set once it ends, so other threads don't use sets which
+   * are still growing.
+   */
+  class Analysis {
+   public:
+    explicit Analysis(const std::shared_ptr<Grammar> &grammar);
+    ~Analysis();
+
+    /**
+     * @brief Start a new pass, returns false once the last one changed nothing
+     * and the stamps are set.
+     */
+    bool next();
+
+    /**
+     * @brief Set stamp to the version of the grammar once the last pass ends.
+     */
+    static void reached(std::atomic<unsigned int> &stamp);
+
+    Analysis(const Analysis &) = delete;
+    Analysis &operator=(const Analysis &) = delete;
+
+   private:
+    friend class Grammar;
+
+    std::shared_ptr<Grammar> m_grammar;
+    bool m_first;
+    std::vector<std::atomic<unsigned int> *> m_reached;
+
+    // State of the analysis this one is nested in
+    Analysis *m_outer;
+    bool m_dirty;
+  };
+
+  Grammar(const Grammar &) = delete;
+  Grammar &operator=(const Grammar &) = delete;
+
+ private:
+  const Grammar *root() const;
+  Grammar *root();
+  static std::shared_ptr<Grammar> root(std::shared_ptr<Grammar> grammar);
+
+  // Set once the grammar is joined to another, which then holds the version
+  std::atomic<Grammar *> m_parent;
+  std::shared_ptr<Grammar> m_owner;  // Keeps m_parent alive
+  size_t m_size;
+  std::atomic<unsigned int> m_version;
+};
+
+/**
+ * @brief The Lazy class holds a value built from a grammar on first use, and
+ * again once the version it was built for changed. The first thread needing
+ * it builds it under Grammar::mutex(), the others wait for it. A value is
+ * never rebuilt in place: the previous one is retired, and freed once the
+ * parses which may still read it are over (see Grammar::retire).
+ */
+template <typename T>
+class Lazy {
+ public:
+  Lazy() : m_current(nullptr) {}
+  ~Lazy() { delete m_current.load(); }
+
+  /**
+   * @brief The value built by build() for the current version, version()
+   * is read again once it is built since building may join grammars.
+   */
+  template <typename TVersion, typename TBuild>
+  const T &get(TVersion version, TBuild build) {
+    Built *current = m_current.load(std::memory_order_acquire);
+
+    if ((current != nullptr) && (current->version == version())) {
+      return current->value;
+    }
+
+    std::lock_guard<std::recursive_mutex> lock(Grammar::mutex());
+    current = m_current.load(std::memory_order_relaxed);
+
+    if ((current == nullptr) || (current->version != version())) {
+      T value = build();
+      Built *previous = current;
+
+      current = new Built(version(), std::move(value));
+      m_current.store(current, std::memory_order_release);
+
+      if (previous != nullptr) {
+        Grammar::retire(previous);
+      }
+    }
+
+    return current->value;
+  }
+
+  Lazy(const Lazy &) = delete;
+  Lazy &operator=(const Lazy &) = delete;
+
+ private:
+  struct Built : public Grammar::Retired {
+    Built(unsigned int version, T &&value)
+        : version(version), value(std::move(value)) {}
+
+    unsigned int version;
+    T value;
+  };
+
+  std::atomic<Built *> m_current;
+};
+}
@@ -0,0 +1,117 @@
+#include "memo.h"
+
+#include <vector>
+
+#include "grammar.h"
+
+namespace tanuki {
+namespace {
+thread_local int depth = 0;
+thread_local std::unordered_map<const MemoTableBase *,
+                                std::unique_ptr<MemoTableBase::Entries>>
+    tables;
+thread_local std::vector<Recursion *> evaluations;
+}
+
+MemoTableBase::MemoTableBase() {}
+
+// A table destroyed during a parse, once its fragment is released, may not
+// leave entries another table could be allocated over
+MemoTableBase::~MemoTableBase() { Session::forget(this); }
+
+MemoTableBase::Entries::~Entries() {}
+
+MemoTableBase::Entries *MemoTableBase::entries(
+    bool create, std::unique_ptr<Entries> (*make)()) const {
+  Entries *current = Session::entries(this);
+
+  if ((current == nullptr) && create) {
+    current = Session::track(this, make());
+  }
+
+  return current;
+}
+
+Session::Scope::Scope(bool arena) {
+  if (depth == 0) {
+    Grammar::started();
+
+    if (arena) {
+      Arena::open();
+    }
+  }
+
+  depth++;
+}
+
+Session::Scope::~Scope() {
+  depth--;
+
+  // Clearing a table may release the last reference on another fragment, so
+  // the tables are dropped one at a time.
+  while (depth == 0 && !tables.empty()) {
+    auto first = tables.begin();
+    std::unique_ptr<MemoTableBase::Entries> entries = std::move(first->second);
+    tables.erase(first);
+  }
+
+  // Blocks still referenced keep the arena alive until they are released
+  if (depth == 0 && Arena::current() != nullptr) {
+    Arena::close();
+  }
+
+  if (depth == 0) {
+    Grammar::finished();
+  }
+}
+
+Session::Evaluation::Evaluation(Recursion *recursion) {
+  evaluations.push_back(recursion);
+}
+
+Session::Evaluation::~Evaluation() { evaluations.pop_back(); }
+
+bool Session::active() { return (depth > 0); }
+
+void Session::recurse(Recursion *head) {
+  head->head = true;
+
+  for (auto it = evaluations.rbegin(); it != evaluations.rend(); it++) {
+    if (*it == head) {
+      break;
+    }
+
+    (*it)->involved = true;
+  }
+}
+
+MemoTableBase::Entries *Session::entries(const MemoTableBase *table) {
+  auto found = tables.find(table);
+
+  return ((found == tables.end()) ? nullptr : found->second.get());
+}
+
+MemoTableBase::Entries *Session::track(
+    const MemoTableBase *table,
+    std::unique_ptr<MemoTableBase::Entries> entries) {
+  MemoTableBase::Entries *result = entries.get();
+  tables[table] = std::move(entries);
+
+  return result;
+}
+
+void Session::forget(const MemoTableBase *table) {
+  // Tables are all dropped once the parse is over, and the list may already
+  // be destroyed along with the thread
+  if (depth == 0) {
+    return;
+  }
+
+  auto found = tables.find(table);
+
+  if (found != tables.end()) {
+    std::unique_ptr<MemoTableBase::Entries> entries = std::move(found->second);
+    tables.erase(found);
+  }
+}
+}
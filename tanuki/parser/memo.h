@@ -0,0 +1,182 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <unordered_map>
+#include <utility>
+
+#include "tanuki/misc/misc.h"
+
+namespace tanuki {
+/**
+ * @brief The MemoTableBase class is the untyped part of a packrat table. The
+ * entries live in the session of each thread, keyed by the table, and are
+ * dropped once its top-level parse is over, so a fragment may be parsed from
+ * several threads at once.
+ */
+class MemoTableBase {
+ public:
+  MemoTableBase();
+  virtual ~MemoTableBase();
+
+  MemoTableBase(const MemoTableBase &) = delete;
+  MemoTableBase &operator=(const MemoTableBase &) = delete;
+
+  /**
+   * @brief The entries of one table in the session of one thread.
+   */
+  class Entries {
+   public:
+    virtual ~Entries();
+  };
+
+ protected:
+  /**
+   * @brief The entries of the table on this thread, nullptr when it has none
+   * yet and create isn't set.
+   */
+  Entries *entries(bool create, std::unique_ptr<Entries> (*make)()) const;
+};
+
+/**
+ * @brief The Recursion struct is the state of a memo entry while its fragment
+ * is being resolved, used to grow left recursive seeds.
+ */
+struct Recursion {
+  bool evaluating;  // The fragment is being resolved at this position
+  bool head;        // It was reached again, the seed must be grown
+  bool involved;    // It reached a head, so it cannot be cached yet
+};
+
+/**
+ * @brief The Session class delimits one top-level parse. Scopes are opened by
+ * every entry point of a fragment, only the outermost one releases the memo.
+ */
+class Session {
+ public:
+  class Scope {
+   public:
+    /**
+     * @brief When arena is set and the scope is the outermost one, the results
+     * of the parse are allocated from a per-parse arena.
+     */
+    explicit Scope(bool arena = false);
+    ~Scope();
+
+    Scope(const Scope &) = delete;
+    Scope &operator=(const Scope &) = delete;
+  };
+
+  /**
+   * @brief The Evaluation class keeps a memo entry on the recursion stack as
+   * long as its fragment is being resolved.
+   */
+  class Evaluation {
+   public:
+    explicit Evaluation(Recursion *recursion);
+    ~Evaluation();
+
+    Evaluation(const Evaluation &) = delete;
+    Evaluation &operator=(const Evaluation &) = delete;
+  };
+
+  static bool active();
+
+  /**
+   * @brief Called when a fragment is reached again at a position it is still
+   * resolving: the entry becomes a head and every entry above it on the
+   * stack is involved in its left recursion.
+   */
+  static void recurse(Recursion *head);
+
+ private:
+  static MemoTableBase::Entries *entries(const MemoTableBase *table);
+  static MemoTableBase::Entries *track(const MemoTableBase *table,
+                                       std::unique_ptr<MemoTableBase::Entries>
+                                           entries);
+  static void forget(const MemoTableBase *table);
+
+  friend class MemoTableBase;
+};
+
+/**
+ * @brief The MemoTable class caches what a fragment produced (a piece, or a
+ * length when only recognizing), keyed by the position in the input.
+ */
+template <typename TValue>
+class MemoTable : public MemoTableBase {
+ public:
+  struct Entry : public Recursion {
+    TValue value;
+  };
+
+ private:
+  struct Key {
+    const char *position;
+    int64_t size;
+
+    bool operator==(const Key &other) const {
+      return (position == other.position) && (size == other.size);
+    }
+  };
+
+  struct KeyHash {
+    std::size_t operator()(const Key &key) const {
+      return std::hash<const char *>()(key.position) ^
+             (std::hash<int64_t>()(key.size) << 1);
+    }
+  };
+
+  struct Map : public Entries {
+    std::unordered_map<Key, Entry, KeyHash> entries;
+  };
+
+ public:
+  Entry *find(const tanuki::String &in, uint64_t offset) {
+    Map *map = this->map(false);
+
+    if (map == nullptr) {
+      return nullptr;
+    }
+
+    auto found = map->entries.find(key(in, offset));
+
+    return ((found == map->entries.end()) ? nullptr : &found->second);
+  }
+
+  /**
+   * @brief Insert an entry under evaluation, holding the failing seed.
+   */
+  Entry *insert(const tanuki::String &in, uint64_t offset, TValue seed) {
+    Entry &entry = map(true)->entries[key(in, offset)];
+    entry.evaluating = true;
+    entry.head = false;
+    entry.involved = false;
+    entry.value = std::move(seed);
+
+    return &entry;
+  }
+
+  void erase(const tanuki::String &in, uint64_t offset) {
+    Map *map = this->map(false);
+
+    if (map != nullptr) {
+      map->entries.erase(key(in, offset));
+    }
+  }
+
+ private:
+  static Key key(const tanuki::String &in, uint64_t offset) {
+    return Key{in.data() + offset, (int64_t)(in.size() - offset)};
+  }
+
+  static std::unique_ptr<Entries> make() {
+    return std::unique_ptr<Entries>(new Map());
+  }
+
+  Map *map(bool create) const {
+    return static_cast<Map *>(entries(create, &MemoTable::make));
+  }
+};
+}
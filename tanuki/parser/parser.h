@@ -1,7 +1,12 @@
 #pragma once
 
 #include "tokens.h"
+#include "automaton.h"
+#include "direct.h"
+#include "dictionary.h"
+#include "floating.h"
 #include "fragment.h"
 #include "operation.h"
+#include "program.h"
 #include "rule.h"
 #include "special.h"
@@ -0,0 +1,115 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "tanuki/misc/misc.h"
+
+namespace tanuki {
+/**
+ * @brief The Pattern class is the regular expression matched by a token, when
+ * there is one. Choices are ordered and repetitions are greedy, as the tokens
+ * they come from, so a pattern matches the same length as its token.
+ */
+class Pattern {
+ public:
+  enum Kind {
+    Set,       // One byte of chars
+    Sequence,  // Each child, one after the other
+    Choice,    // The first child which matches
+    Plus,      // The child, as many times as possible
+    Optional   // The child if it matches, nothing otherwise
+  };
+
+  explicit Pattern(const CharSet &chars) : kind(Set), chars(chars) {}
+  Pattern(Kind kind, std::vector<ref<Pattern>> children)
+      : kind(kind), children(children) {}
+
+  /**
+   * @brief Whether the pattern always matches one byte, which is then in set.
+   */
+  bool single(CharSet &set) const {
+    switch (kind) {
+      case Set:
+        set.merge(chars);
+
+        return true;
+      case Sequence:
+        return ((children.size() == 1) && children[0]->single(set));
+      case Choice:
+        for (const ref<Pattern> &child : children) {
+          if (!child->single(set)) {
+            return false;
+          }
+        }
+
+        return true;
+      default:
+        return false;
+    }
+  }
+
+  /**
+   * @brief Whether matching the pattern again and again, until it matches
+   * nothing, consumes exactly the longest run of bytes of set.
+   */
+  bool run(CharSet &set) const {
+    CharSet chars;
+
+    if (single(chars)) {
+      set.merge(chars);
+
+      return true;
+    }
+
+    switch (kind) {
+      case Sequence:
+        return ((children.size() == 1) && children[0]->run(set));
+      case Plus:
+      case Optional:
+        return children[0]->run(set);
+      default:
+        return false;
+    }
+  }
+
+  /**
+   * @brief Append the bytes every match starts with to literal, returns
+   * whether they are the whole match.
+   */
+  bool prefix(std::string &literal) const {
+    switch (kind) {
+      case Set:
+        if (chars.size() != 1) {
+          return false;
+        }
+
+        for (int c = 0; c < 256; c++) {
+          if (chars.has(c)) {
+            literal.push_back((char)c);
+          }
+        }
+
+        return true;
+      case Sequence:
+        for (const ref<Pattern> &child : children) {
+          if (!child->prefix(literal)) {
+            return false;
+          }
+        }
+
+        return true;
+      case Plus:
+        children[0]->prefix(literal);
+
+        return false;
+      default:
+        return false;
+    }
+  }
+
+  Kind kind;
+  CharSet chars;
+  std::vector<ref<Pattern>> children;
+};
+}
@@ -0,0 +1,709 @@
+#include "program.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <ostream>
+#include <set>
+#include <unordered_map>
+
+#include "tanuki/misc/exception.h"
+
+#include "tokens.h"
+
+#ifdef __GNUG__
+#include <cxxabi.h>
+#endif
+
+namespace tanuki {
+Program::Builder::Builder() : m_program(new Program()) {}
+
+ref<Program> Program::Builder::build(const void *key,
+                                     std::function<void(Builder &)> body) {
+  call(key, body);
+  emit(End);
+
+  // Bodies may call others, which are lowered after them
+  while (!m_pending.empty()) {
+    std::pair<const void *, std::function<void(Builder &)>> next =
+        std::move(m_pending.back());
+    m_pending.pop_back();
+
+    m_entries[next.first] = m_program->m_code.size();
+    next.second(*this);
+    emit(Return);
+  }
+
+  for (const std::pair<int, const void *> &site : m_calls) {
+    m_program->m_code[site.first].argument = m_entries[site.second];
+  }
+
+  return m_program;
+}
+
+void Program::Builder::call(const void *key,
+                            std::function<void(Builder &)> body,
+                            bool memoize) {
+  if (m_entries.find(key) == m_entries.end()) {
+    m_entries[key] = -1;
+    m_pending.push_back(std::make_pair(key, body));
+  }
+
+  m_calls.push_back(std::make_pair(emit(memoize ? MemoCall : Call), key));
+}
+
+void Program::Builder::choose(const std::vector<Alternative> &alternatives,
+                              bool longest) {
+  std::vector<Instruction> &code = m_program->m_code;
+
+  if (longest) {
+    emit(Longest);
+
+    for (const Alternative &alternative : alternatives) {
+      int next = emit(Next);
+      int test = (alternative.nullable ? -1
+                                       : emit(Test, 0, set(alternative.first)));
+
+      alternative.body(*this);
+      emit(Keep);
+
+      code[next].argument = code.size();
+
+      if (test >= 0) {
+        code[test].argument = code.size();
+      }
+    }
+
+    emit(Close);
+  } else {
+    std::vector<int> commits;
+
+    for (const Alternative &alternative : alternatives) {
+      int test = (alternative.nullable ? -1
+                                       : emit(Test, 0, set(alternative.first)));
+      int choice = emit(Choice);
+
+      alternative.body(*this);
+      commits.push_back(emit(Commit));
+
+      code[choice].argument = code.size();
+
+      if (test >= 0) {
+        code[test].argument = code.size();
+      }
+    }
+
+    emit(Fail);
+
+    for (int commit : commits) {
+      code[commit].argument = code.size();
+    }
+  }
+}
+
+void Program::Builder::pattern(const Pattern &pattern) {
+  std::vector<Instruction> &code = m_program->m_code;
+  CharSet chars;
+
+  switch (pattern.kind) {
+    case Pattern::Set:
+      if (pattern.chars.size() == 1) {
+        for (int c = 0; c < 256; c++) {
+          if (pattern.chars.has(c)) {
+            emit(Char, c);
+          }
+        }
+      } else {
+        emit(Set, 0, set(pattern.chars));
+      }
+
+      break;
+    case Pattern::Sequence:
+      for (const ref<Pattern> &child : pattern.children) {
+        this->pattern(*dereference(child));
+      }
+
+      break;
+    case Pattern::Choice: {
+      // Ordered, a child which matched is never tried again
+      std::vector<int> commits;
+
+      if (pattern.children.empty()) {
+        emit(Fail);
+      }
+
+      for (size_t i = 0; i < pattern.children.size(); i++) {
+        if ((i + 1) == pattern.children.size()) {
+          this->pattern(*dereference(pattern.children[i]));
+        } else {
+          int choice = emit(Choice);
+
+          this->pattern(*dereference(pattern.children[i]));
+          commits.push_back(emit(Commit));
+          code[choice].argument = code.size();
+        }
+      }
+
+      for (int commit : commits) {
+        code[commit].argument = code.size();
+      }
+
+      break;
+    }
+    case Pattern::Plus:
+      if (pattern.children[0]->single(chars)) {
+        emit(Set, 0, set(chars));
+        span(chars);
+      } else {
+        const Pattern &child = *dereference(pattern.children[0]);
+
+        this->pattern(child);
+
+        int choice = emit(Choice);
+        int body = code.size();
+
+        this->pattern(child);
+        emit(PartialCommit, body);
+        code[choice].argument = code.size();
+      }
+
+      break;
+    case Pattern::Optional: {
+      int choice = emit(Choice);
+
+      this->pattern(*dereference(pattern.children[0]));
+      emit(Commit, code.size() + 1);
+      code[choice].argument = code.size();
+
+      break;
+    }
+  }
+}
+
+void Program::Builder::span(const CharSet &chars) {
+  emit(Span, 0, set(chars));
+}
+
+void Program::Builder::integer(uint64_t limit, bool sign) {
+  m_program->m_bounds.push_back(Bound{limit, sign});
+
+  emit(Number, m_program->m_bounds.size() - 1);
+}
+
+void Program::Builder::native(Native function, const std::string &name) {
+  m_program->m_natives.push_back(function);
+  m_program->m_names.push_back(name);
+
+  emit(Invoke, m_program->m_natives.size() - 1);
+}
+
+std::string Program::Builder::name(const std::type_info &type) {
+#ifdef __GNUG__
+  int status = 0;
+  char *demangled = abi::__cxa_demangle(type.name(), nullptr, nullptr, &status);
+
+  if (status == 0) {
+    std::string readable(demangled);
+    std::free(demangled);
+
+    return readable;
+  }
+#endif
+
+  return type.name();
+}
+
+int Program::Builder::emit(Op op, int32_t argument, int chars) {
+  m_program->m_code.push_back(Instruction{op, (uint16_t)chars, argument});
+
+  return (m_program->m_code.size() - 1);
+}
+
+int Program::Builder::set(const CharSet &chars) {
+  std::vector<CharSet> &sets = m_program->m_sets;
+  auto known = std::find(sets.begin(), sets.end(), chars);
+
+  if (known != sets.end()) {
+    return (known - sets.begin());
+  }
+
+  sets.push_back(chars);
+  m_program->m_scanners.push_back(CharScanner(chars));
+
+  return (sets.size() - 1);
+}
+
+int64_t Program::recognizeAt(const tanuki::String &in,
+                             uint64_t offset) const {
+  enum Kind : uint8_t { Backtrack, Caller, MemoCaller, Best };
+
+  struct Entry {
+    Kind kind;
+    uint32_t pc;        // Where to go on failure, or to return to
+    uint64_t position;  // Where to go back to on failure, or was called from
+    int64_t best;       // End of the longest alternative, -1 if none matched,
+                        // or the entry called for MemoCaller
+  };
+
+  std::vector<Entry> stack;
+
+  // End of each memoized call by entry and offset, -1 when it failed
+  std::unordered_map<uint64_t, int64_t> memo;
+  auto key = [this](int64_t entry, uint64_t position) {
+    return (((uint64_t)position * m_code.size()) + entry);
+  };
+
+  const char *data = in.data();
+  uint64_t length = in.size();
+  uint32_t pc = 0;
+  uint64_t position = offset;
+
+  for (;;) {
+    const Instruction &instruction = m_code[pc];
+    bool failed = false;
+
+    switch (instruction.op) {
+      case Char:
+        failed = ((position >= length) ||
+                  (data[position] != (char)instruction.argument));
+        position++;
+        pc++;
+        break;
+      case Set:
+        failed = ((position >= length) ||
+                  !m_sets[instruction.set].has(data[position]));
+        position++;
+        pc++;
+        break;
+      case Span:
+        if (position < length) {
+          position += m_scanners[instruction.set].span(data + position,
+                                                       length - position);
+        }
+
+        pc++;
+        break;
+      case Number: {
+        const Bound &bound = m_bounds[instruction.argument];
+        bool negative = ((position < length) && bound.sign &&
+                         (data[position] == '-'));
+        uint64_t start = (negative ? (position + 1) : position);
+        uint64_t value;
+        int64_t digits =
+            ((start < length)
+                 ? readDigits(data + start, length - start,
+                              (negative ? (bound.limit + 1) : bound.limit),
+                              value)
+                 : -1);
+
+        failed = (digits < 0);
+        position = (start + digits);
+        pc++;
+        break;
+      }
+      case Test:
+        pc = (((position < length) &&
+                m_sets[instruction.set].has(data[position]))
+                  ? (pc + 1)
+                  : instruction.argument);
+        break;
+      case Choice:
+        stack.push_back(Entry{Backtrack, (uint32_t)instruction.argument,
+                              position, -1});
+        pc++;
+        break;
+      case Commit:
+        stack.pop_back();
+        pc = instruction.argument;
+        break;
+      case PartialCommit:
+        // A repetition which consumed nothing would loop forever
+        if (stack.back().position == position) {
+          stack.pop_back();
+          pc++;
+        } else {
+          stack.back().position = position;
+          pc = instruction.argument;
+        }
+
+        break;
+      case Longest:
+        stack.push_back(Entry{Best, pc + 1, position, -1});
+        pc++;
+        break;
+      case Next:
+        stack.back().pc = instruction.argument;
+        pc++;
+        break;
+      case Keep:
+        stack.back().best = std::max(stack.back().best, (int64_t)position);
+        position = stack.back().position;
+        pc = stack.back().pc;
+        break;
+      case Close:
+        failed = (stack.back().best < 0);
+        position = (failed ? position : stack.back().best);
+        stack.pop_back();
+        pc++;
+        break;
+      case Call:
+        stack.push_back(Entry{Caller, pc + 1, position, -1});
+        pc = instruction.argument;
+        break;
+      case MemoCall: {
+        auto known = memo.find(key(instruction.argument, position));
+
+        if (known == memo.end()) {
+          stack.push_back(
+              Entry{MemoCaller, pc + 1, position, instruction.argument});
+          pc = instruction.argument;
+        } else {
+          failed = (known->second < 0);
+          position = (failed ? position : known->second);
+          pc++;
+        }
+
+        break;
+      }
+      case Return:
+        if (stack.back().kind == MemoCaller) {
+          memo[key(stack.back().best, stack.back().position)] = position;
+        }
+
+        pc = stack.back().pc;
+        stack.pop_back();
+        break;
+      case Jump:
+        pc = instruction.argument;
+        break;
+      case Invoke: {
+        int64_t consumed = m_natives[instruction.argument](in, position);
+
+        failed = (consumed < 0);
+        position += consumed;
+        pc++;
+        break;
+      }
+      case Fail:
+        failed = true;
+        break;
+      case End:
+        return (position - offset);
+    }
+
+    if (!failed) {
+      continue;
+    }
+
+    // Return addresses are dropped up to the last alternative to try, the
+    // calls they belong to failed
+    while (!stack.empty() && ((stack.back().kind == Caller) ||
+                              (stack.back().kind == MemoCaller))) {
+      if (stack.back().kind == MemoCaller) {
+        memo[key(stack.back().best, stack.back().position)] = -1;
+      }
+
+      stack.pop_back();
+    }
+
+    if (stack.empty()) {
+      return -1;
+    }
+
+    position = stack.back().position;
+    pc = stack.back().pc;
+
+    if (stack.back().kind == Backtrack) {
+      stack.pop_back();
+    }
+  }
+}
+
+void Program::generateRecognizer(std::ostream &out, const std::string &name,
+                                 bool natives) const {
+  if (!natives && !m_natives.empty()) {
+    throw NotLoweredError(m_names.front() +
+                          " has no pattern, it can only be generated as a "
+                          "native");
+  }
+
+  bool memoized = std::any_of(m_code.begin(), m_code.end(),
+                              [](const Instruction &instruction) {
+                                return (instruction.op == MemoCall);
+                              });
+
+  // Memo key of the call to entry from position, as the machine's
+  auto key = [this](const std::string &position, const std::string &entry) {
+    return ("((uint64_t)" + position + " * " + std::to_string(m_code.size()) +
+            " + " + entry + ")");
+  };
+  std::string returned = key("stack.back().position", "stack.back().best");
+
+  // Addresses reached through the stack go through the dispatch switch
+  std::set<int> dispatched;
+  std::set<int> labels;
+
+  for (size_t pc = 0; pc < m_code.size(); pc++) {
+    const Instruction &instruction = m_code[pc];
+
+    switch (instruction.op) {
+      case Choice:
+      case Next:
+        dispatched.insert(instruction.argument);
+        break;
+      case Call:
+      case MemoCall:
+        dispatched.insert(pc + 1);
+        labels.insert(instruction.argument);
+        break;
+      case Test:
+      case Commit:
+      case PartialCommit:
+      case Jump:
+        labels.insert(instruction.argument);
+        break;
+      default:
+        break;
+    }
+  }
+
+  labels.insert(dispatched.begin(), dispatched.end());
+
+  out << "#include <algorithm>\n"
+      << "#include <cstdint>\n"
+      << "#include <string>\n"
+      << "#include <unordered_map>\n"
+      << "#include <vector>\n\n"
+      << "// Recognizer generated by tanuki, see Program::generateRecognizer\n"
+      << "struct " << name << " {\n";
+
+  if (!m_natives.empty()) {
+    out << "  // Defined by the user, length recognized from offset or -1:\n";
+
+    for (size_t index = 0; index < m_names.size(); index++) {
+      out << "  //   " << index << ": " << m_names[index] << "\n";
+    }
+
+    out << "  static int64_t native(int index, const std::string &in,\n"
+        << "                        uint64_t offset);\n\n";
+  }
+
+  out << "  static int64_t recognizeAt(const std::string &in, "
+         "uint64_t offset) {\n";
+
+  if (!m_sets.empty()) {
+    out << "    static const uint8_t sets[" << m_sets.size() << "][32] = {\n";
+
+    for (const CharSet &chars : m_sets) {
+      out << "        {";
+
+      for (int byte = 0; byte < 32; byte++) {
+        int bits = 0;
+
+        for (int bit = 0; bit < 8; bit++) {
+          bits |= (chars.has((byte * 8) + bit) ? (1 << bit) : 0);
+        }
+
+        out << ((byte == 0) ? "" : ", ") << bits;
+      }
+
+      out << "},\n";
+    }
+
+    out << "    };\n";
+  }
+
+  out << "    struct Entry {\n"
+      << "      // 0 backtrack, 1 return, 2 longest, 3 memoized return\n"
+      << "      uint8_t kind;\n"
+      << "      uint32_t pc;\n"
+      << "      uint64_t position;\n"
+      << "      int64_t best;  // Or the entry called for 3\n"
+      << "    };\n\n"
+      << "    std::vector<Entry> stack;\n"
+      << "    const char *data = in.data();\n"
+      << "    uint64_t length = in.size();\n"
+      << "    uint64_t position = offset;\n"
+      << "    uint32_t pc = 0;\n"
+      << "    int64_t best = -1;\n";
+
+  if (!m_bounds.empty()) {
+    out << "    bool negative;\n"
+        << "    uint64_t limit, start, value, digit;\n";
+  }
+
+  if (!m_natives.empty()) {
+    out << "    int64_t consumed;\n";
+  }
+
+  if (memoized) {
+    out << "    std::unordered_map<uint64_t, int64_t> memo;\n"
+        << "    std::unordered_map<uint64_t, int64_t>::iterator known;\n";
+  }
+
+  out << "\n";
+
+  for (size_t pc = 0; pc < m_code.size(); pc++) {
+    const Instruction &instruction = m_code[pc];
+    std::string set = "sets[" + std::to_string(instruction.set) + "]";
+    std::string argument = std::to_string(instruction.argument);
+    std::string target = "L" + argument;
+
+    if (labels.count(pc)) {
+      out << "  L" << pc << ":\n";
+    }
+
+    switch (instruction.op) {
+      case Char:
+        out << "    if ((position >= length) || (data[position] != (char)"
+            << instruction.argument << ")) goto fail;\n"
+            << "    position++;\n";
+        break;
+      case Set:
+        out << "    if ((position >= length) || !has(" << set
+            << ", data[position])) goto fail;\n"
+            << "    position++;\n";
+        break;
+      case Span:
+        out << "    while ((position < length) && has(" << set
+            << ", data[position])) position++;\n";
+        break;
+      case Number: {
+        const Bound &bound = m_bounds[instruction.argument];
+
+        out << "    negative = "
+            << (bound.sign
+                    ? "((position < length) && (data[position] == '-'))"
+                    : "false")
+            << ";\n"
+            << "    limit = " << bound.limit << "ULL + negative;\n"
+            << "    start = position + negative;\n"
+            << "    value = 0;\n"
+            << "    for (position = start; position < length; position++) {\n"
+            << "      digit = (unsigned char)data[position] - '0';\n"
+            << "      if (digit > 9) break;\n"
+            << "      if ((digit > limit) || (value > (limit - digit) / 10))"
+               " goto fail;\n"
+            << "      value = value * 10 + digit;\n"
+            << "    }\n"
+            << "    if (position == start) goto fail;\n";
+        break;
+      }
+      case Test:
+        out << "    if ((position >= length) || !has(" << set
+            << ", data[position])) goto " << target << ";\n";
+        break;
+      case Choice:
+        out << "    stack.push_back(Entry{0, " << instruction.argument
+            << ", position, -1});\n";
+        break;
+      case Commit:
+        out << "    stack.pop_back();\n"
+            << "    goto " << target << ";\n";
+        break;
+      case PartialCommit:
+        out << "    if (stack.back().position != position) {\n"
+            << "      stack.back().position = position;\n"
+            << "      goto " << target << ";\n"
+            << "    }\n"
+            << "    stack.pop_back();\n";
+        break;
+      case Longest:
+        out << "    stack.push_back(Entry{2, " << (pc + 1)
+            << ", position, -1});\n";
+        break;
+      case Next:
+        out << "    stack.back().pc = " << instruction.argument << ";\n";
+        break;
+      case Keep:
+        out << "    best = stack.back().best;\n"
+            << "    stack.back().best = std::max(best, (int64_t)position);\n"
+            << "    position = stack.back().position;\n"
+            << "    pc = stack.back().pc;\n"
+            << "    goto dispatch;\n";
+        break;
+      case Close:
+        out << "    best = stack.back().best;\n"
+            << "    stack.pop_back();\n"
+            << "    if (best < 0) goto fail;\n"
+            << "    position = best;\n";
+        break;
+      case Call:
+        out << "    stack.push_back(Entry{1, " << (pc + 1)
+            << ", position, -1});\n"
+            << "    goto " << target << ";\n";
+        break;
+      case MemoCall:
+        out << "    known = memo.find(" << key("position", argument)
+            << ");\n"
+            << "    if (known == memo.end()) {\n"
+            << "      stack.push_back(Entry{3, " << (pc + 1) << ", position, "
+            << instruction.argument << "});\n"
+            << "      goto " << target << ";\n"
+            << "    }\n"
+            << "    if (known->second < 0) goto fail;\n"
+            << "    position = known->second;\n";
+        break;
+      case Return:
+        if (memoized) {
+          out << "    if (stack.back().kind == 3) {\n"
+              << "      memo[" << returned << "] = position;\n"
+              << "    }\n";
+        }
+
+        out << "    pc = stack.back().pc;\n"
+            << "    stack.pop_back();\n"
+            << "    goto dispatch;\n";
+        break;
+      case Jump:
+        out << "    goto " << target << ";\n";
+        break;
+      case Invoke:
+        out << "    consumed = native(" << instruction.argument
+            << ", in, position);\n"
+            << "    if (consumed < 0) goto fail;\n"
+            << "    position += consumed;\n";
+        break;
+      case Fail:
+        out << "    goto fail;\n";
+        break;
+      case End:
+        out << "    return (position - offset);\n";
+        break;
+    }
+  }
+
+  out << "  fail:\n"
+      << "    while (!stack.empty() && (stack.back().kind & 1)) {\n";
+
+  if (memoized) {
+    out << "      if (stack.back().kind == 3) {\n"
+        << "        memo[" << returned << "] = -1;\n"
+        << "      }\n";
+  }
+
+  out << "      stack.pop_back();\n"
+      << "    }\n"
+      << "    if (stack.empty()) return -1;\n"
+      << "    position = stack.back().position;\n"
+      << "    pc = stack.back().pc;\n"
+      << "    if (stack.back().kind == 0) stack.pop_back();\n"
+      << "  dispatch:\n"
+      << "    switch (pc) {\n";
+
+  for (int pc : dispatched) {
+    out << "      case " << pc << ": goto L" << pc << ";\n";
+  }
+
+  out << "    }\n"
+      << "    return -1;\n"
+      << "  }\n\n"
+      << "  static bool matches(const std::string &in) {\n"
+      << "    return (recognizeAt(in, 0) == (int64_t)in.size());\n"
+      << "  }\n\n"
+      << " private:\n"
+      << "  static bool has(const uint8_t *set, char c) {\n"
+      << "    return (set[(uint8_t)c >> 3] & (1 << ((uint8_t)c & 7)));\n"
+      << "  }\n"
+      << "};\n";
+}
+}
@@ -0,0 +1,217 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <iosfwd>
+#include <limits>
+#include <string>
+#include <typeinfo>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "tanuki/misc/misc.h"
+
+#include "pattern.h"
+
+namespace tanuki {
+template <typename TResult>
+class Fragment;
+template <typename TInteger>
+class BasicIntegerToken;
+
+/**
+ * @brief The Program class is a fragment and everything it reaches lowered
+ * into instructions (Medeiros and Ierusalimschy, "A Parsing Machine for
+ * PEGs", 2008). A small machine recognizes the input with them, keeping its
+ * backtrack entries and return addresses on an explicit stack instead of
+ * the C++ one. Calls to memoized fragments are kept by offset for the run,
+ * as their own memo is, so rules sharing a prefix don't make the
+ * recognition exponential.
+ *
+ * The program only recognizes: no result is built and no callback is
+ * called. Fragment::match and Fragment::consume don't go through it and
+ * still recurse on the C++ stack, so deeply nested input can overflow them
+ * as before; the program can tell whether such input is well formed.
+ *
+ * Tokens are lowered from their pattern, and integers, whose bound a
+ * pattern can't tell, into an instruction of their own. Other tokens without
+ * a pattern, left recursive fragments and skipped tokens are called as they
+ * are, so they recurse as deep as their own nesting. The program is a
+ * snapshot: the grammar must outlive it, and be compiled again once it
+ * changes.
+ */
+class Program {
+ private:
+  enum Op : uint8_t {
+    Char,           // The byte argument
+    Set,            // A byte of the set
+    Span,           // As many bytes of the set as there are
+    Number,         // A decimal integer within the argument-th bound
+    Test,           // Jump to the argument unless the next byte is in set
+    Choice,         // Push a backtrack entry to the argument
+    Commit,         // Pop the backtrack entry, jump to the argument
+    PartialCommit,  // Update the backtrack entry, jump to the argument
+    Longest,        // Push an entry keeping the longest alternative
+    Next,           // On failure or Keep, go on with the argument
+    Keep,           // Record the current alternative, start the next one
+    Close,          // Pop the longest entry and go to its end
+    Call,           // Push the return address, jump to the argument
+    MemoCall,       // Call, unless the memo has the result at this offset
+    Return,         // Pop the return address
+    Jump,           // Go to the argument
+    Invoke,         // Call a native function, fail if it returns -1
+    Fail,
+    End
+  };
+
+  struct Instruction {
+    Op op;
+    uint16_t set;  // Index in m_sets for Set, Span and Test
+    int32_t argument;
+  };
+
+  // Highest magnitude of a Number, one more when it has a '-'
+  struct Bound {
+    uint64_t limit;
+    bool sign;
+  };
+
+ public:
+  typedef std::function<int64_t(const tanuki::String &, uint64_t)> Native;
+
+  class Builder;
+
+  /**
+   * @brief One rule of a choice: the bytes it can start with, whether it can
+   * match nothing, and the code lowering it.
+   */
+  struct Alternative {
+    CharSet first;
+    bool nullable;
+    std::function<void(Builder &)> body;
+  };
+
+  class Builder {
+   public:
+    Builder();
+
+    /**
+     * @brief The program running the code of body, which is identified by key
+     * so recursive calls to it aren't lowered again.
+     */
+    ref<Program> build(const void *key, std::function<void(Builder &)> body);
+
+    /**
+     * @brief Call the code lowered by body, once per key in the program. When
+     * memoize is set, what the call recognized from an offset is kept until
+     * the end of the run, as the memo of a fragment.
+     */
+    void call(const void *key, std::function<void(Builder &)> body,
+              bool memoize = false);
+
+    /**
+     * @brief Try each alternative from the same offset, keeping the longest
+     * match if longest is set, else the first one.
+     */
+    void choose(const std::vector<Alternative> &alternatives, bool longest);
+
+    void pattern(const Pattern &pattern);
+
+    /**
+     * @brief As many bytes of chars as there are, maybe none.
+     */
+    void span(const CharSet &chars);
+
+    /**
+     * @brief A decimal integer of at most limit, preceded by '-' if sign is
+     * set, as BasicIntegerToken reads it.
+     */
+    void integer(uint64_t limit, bool sign);
+
+    /**
+     * @brief Call function as it is, name tells what it recognizes when the
+     * program is generated.
+     */
+    void native(Native function, const std::string &name);
+
+    /**
+     * @brief Readable name of type, demangled when the compiler allows it.
+     */
+    static std::string name(const std::type_info &type);
+
+    template <typename TResult>
+    void lower(const ref<Fragment<TResult>> &fragment) {
+      Fragment<TResult> *reached = fragment.operator->();
+
+      call(reached, [reached](Builder &builder) { reached->lower(builder); },
+           reached->memoize);
+    }
+
+    template <typename TInteger>
+    void lower(const ref<BasicIntegerToken<TInteger>> &token) {
+      integer(std::numeric_limits<TInteger>::max(), token->sign());
+    }
+
+    template <typename TToken>
+    void lower(const ref<TToken> &token) {
+      ref<Pattern> compiled = token->pattern();
+
+      if ((bool)compiled) {
+        pattern(*dereference(compiled));
+      } else {
+        native(
+            [token](const tanuki::String &in, uint64_t offset) {
+              return token->recognizeAt(in, offset);
+            },
+            name(typeid(*dereference(token))));
+      }
+    }
+
+   private:
+    int emit(Op op, int32_t argument = 0, int chars = 0);
+    int set(const CharSet &chars);
+
+    ref<Program> m_program;
+
+    // Entry of the code of each key, -1 until it is lowered
+    std::unordered_map<const void *, int> m_entries;
+    std::vector<std::pair<int, const void *>> m_calls;
+    std::vector<std::pair<const void *, std::function<void(Builder &)>>>
+        m_pending;
+  };
+
+  /**
+   * @brief Length recognized from offset, -1 if the input doesn't match.
+   */
+  int64_t recognizeAt(const tanuki::String &in, uint64_t offset) const;
+  bool matches(const tanuki::String &in) const {
+    return (recognizeAt(in, 0) == (int64_t)in.size());
+  }
+
+  int size() const { return m_code.size(); }
+
+  /**
+   * @brief Write a standalone C++ struct named name, whose static recognizeAt
+   * and matches run the program without tanuki: each instruction becomes a
+   * few statements and jumps become gotos. It is a recognizer only, no
+   * callback is called nor result built.
+   *
+   * Natives can't be written: when natives is set, the struct declares
+   *   static int64_t native(int index, const std::string &in,
+   *                         uint64_t offset);
+   * for the user to define, each index being listed with what it recognizes.
+   * Else NotLoweredError names the first one.
+   */
+  void generateRecognizer(std::ostream &out, const std::string &name,
+                          bool natives = false) const;
+
+ private:
+  std::vector<Instruction> m_code;
+  std::vector<CharSet> m_sets;
+  std::vector<CharScanner> m_scanners;  // One per set, for Span
+  std::vector<Bound> m_bounds;
+  std::vector<Native> m_natives;
+  std::vector<std::string> m_names;  // Of each native
+};
+}
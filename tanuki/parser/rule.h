@@ -1,25 +1,59 @@
 #pragma once
 
+#include <algorithm>
 #include <functional>
 #include <vector>
 #include <tuple>
+#include <utility>
 
 #include "tanuki/misc/misc.h"
 
+#include "program.h"
+
 namespace tanuki {
+/**
+ * @brief The Policy enum tells how a fragment chooses between its rules.
+ * Longest keeps the longest result. FirstMatch keeps the first rule which
+ * succeeds, in the order they were added (PEG ordered choice). With it, left
+ * recursive rules grow a seed as long as the first of them extending it gets
+ * longer.
+ */
+enum class Policy { Longest, FirstMatch };
+
 template <typename TResult>
 class Fragment;
-template <typename TResult, typename... TRefs>
+template <typename TResult, typename TCallback, typename... TRefs>
 class Rule;
 
 template <bool, typename TResult, typename... TRefs>
 struct ResolverLeftRecursive {
-  static void resolve(Rule<TResult, TRefs...>*, const tanuki::String&,
+  template <typename TRule>
+  static void resolve(TRule*, const tanuki::String&, uint64_t,
                       Yielder<Piece<TResult>>*) {}
+  template <typename TRule>
+  static void recognize(TRule*, const tanuki::String&, uint64_t,
+                        std::vector<uint64_t>*, size_t*) {}
+  template <typename TRule>
+  static int64_t extend(TRule*, const tanuki::String&, uint64_t, uint64_t) {
+    return -1;
+  }
+  template <typename TRule>
+  static Piece<TResult> extend(TRule*, const tanuki::String&, uint64_t,
+                               const Piece<TResult>&) {
+    return Piece<TResult>{0, ref<TResult>()};
+  }
 };
 
 template <size_t N, typename TResult, typename... TRefs>
 struct Resolver;
+template <size_t N, typename TResult, typename... TRefs>
+struct Recognizer;
+template <size_t N, typename TResult, typename... TRefs>
+struct Lookahead;
+template <size_t N, typename TResult, typename... TRefs>
+struct Lowering;
+template <typename TResult, typename TRef>
+class Factored;
 
 template <typename TResult, typename... TRefs>
 struct MetaInfo {
@@ -47,58 +81,455 @@ struct MetaInfo {
   typedef typename info::FType FType;
 };
 
+/**
+ * @brief The Leading struct gives the type of the first ref of a rule, void
+ * when there is none.
+ */
+template <typename... TRefs>
+struct Leading {
+  typedef void Type;
+};
+
+template <typename TRef, typename... TRefs>
+struct Leading<TRef, TRefs...> {
+  typedef TRef Type;
+};
+
+/**
+ * @brief The Branch class is the rest of a rule once its first ref, shared
+ * with other rules, is consumed.
+ */
+template <typename TResult, typename TRef>
+class Branch {
+ public:
+  typedef decltype(std::declval<TRef>()->consumeAt(
+      std::declval<const tanuki::String&>(), 0)) TLead;
+
+  virtual ~Branch() = default;
+
+  virtual Piece<TResult> consumeAfter(const tanuki::String&, uint64_t offset,
+                                      uint64_t initial,
+                                      const TLead& lead) = 0;
+  virtual int64_t recognizeAfter(const tanuki::String&, uint64_t offset,
+                                 uint64_t initial) = 0;
+};
+
+template <typename TResult>
+class Branch<TResult, void> {
+ public:
+  typedef Piece<TResult> TLead;
+
+  virtual ~Branch() = default;
+};
+
 template <typename TResult>
 class Matchable {
  public:
   virtual ~Matchable() = default;
 
-  virtual tanuki::Piece<TResult> consume(const tanuki::String&) = 0;
-  virtual void consume(const tanuki::String&,
-                       Yielder<Piece<TResult>>& results) = 0;
+  virtual tanuki::Piece<TResult> consumeAt(const tanuki::String&,
+                                           uint64_t offset) = 0;
+  virtual void consumeAt(const tanuki::String&, uint64_t offset,
+                         Yielder<Piece<TResult>>& results) = 0;
+
+  /**
+   * @brief Same as consumeAt without building anything nor calling the
+   * callback, returns the consumed length or -1.
+   */
+  virtual int64_t recognizeAt(const tanuki::String&, uint64_t offset) = 0;
+
+  /**
+   * @brief Extend the lengths recognized from offset with a left recursive
+   * rule, starting at lengths[*cursor]. New lengths are appended.
+   */
+  virtual void recognizeAt(const tanuki::String&, uint64_t offset,
+                           std::vector<uint64_t>& lengths, size_t& cursor) = 0;
+
+  /**
+   * @brief Apply a left recursive rule once on a seed recognized from offset,
+   * returns the extended length or -1.
+   */
+  virtual int64_t extendAt(const tanuki::String&, uint64_t offset,
+                           uint64_t length) = 0;
+
+  /**
+   * @brief Apply a left recursive rule once on a seed built from offset.
+   */
+  virtual Piece<TResult> extendAt(const tanuki::String&, uint64_t offset,
+                                  const Piece<TResult>& seed) = 0;
+
+  /**
+   * @brief Add the bytes the rule can start with to set, returns whether it
+   * can match without consuming anything.
+   */
+  virtual bool first(CharSet& set) = 0;
+
+  /**
+   * @brief Lower the rule into builder, see Fragment::program(). Rules which
+   * can't be are called as they are.
+   */
+  virtual void lower(Program::Builder& builder) {
+    builder.native(
+        [this](const tanuki::String& in, uint64_t offset) {
+          return recognizeAt(in, offset);
+        },
+        Program::Builder::name(typeid(*this)));
+  }
+
+  /**
+   * @brief Push every piece consumed from offset, a rule pushes at most one.
+   */
+  virtual void consumeEach(const tanuki::String& in, uint64_t offset,
+                           std::vector<Piece<TResult>>& results) {
+    Piece<TResult> result = consumeAt(in, offset);
+
+    if (result) {
+      results.push_back(std::move(result));
+    }
+  }
+
+  /**
+   * @brief Push every length recognized from offset with the rule reaching it.
+   */
+  virtual void recognizeEach(
+      const tanuki::String& in, uint64_t offset,
+      std::vector<std::pair<Matchable<TResult>*, int64_t>>& reached) {
+    int64_t length = recognizeAt(in, offset);
+
+    if (length >= 0) {
+      reached.push_back(std::make_pair(this, length));
+    }
+  }
+
+  /**
+   * @brief The object of the first ref, rules starting with the same one can
+   * be factored. nullptr when it can't be.
+   */
+  virtual const void* leader() { return nullptr; }
+
+  /**
+   * @brief Factor rules sharing the leader of this one (this one included),
+   * returns an empty ref when they can't be.
+   */
+  virtual ref<Matchable<TResult>> factor(
+      const std::vector<Matchable<TResult>*>&) {
+    return ref<Matchable<TResult>>();
+  }
 };
 
-template <typename TResult, typename... TRefs>
-class Rule : public Matchable<TResult> {
+/**
+ * @brief The Factoring struct creates the factored rule of a leading ref.
+ */
+template <typename TResult, typename TRef>
+struct Factoring {
+  template <typename TTuple>
+  static const void* leader(const TTuple& refs) {
+    return dereference(std::get<0>(refs));
+  }
+
+  template <typename TTuple>
+  static ref<Matchable<TResult>> factor(
+      Fragment<TResult>* context, const TTuple& refs,
+      const std::vector<Matchable<TResult>*>& rules) {
+    std::vector<Branch<TResult, TRef>*> branches;
+
+    for (Matchable<TResult>* rule : rules) {
+      // The same object may be held by refs of another type
+      Branch<TResult, TRef>* branch =
+          dynamic_cast<Branch<TResult, TRef>*>(rule);
+
+      if (branch == nullptr) {
+        return ref<Matchable<TResult>>();
+      }
+
+      branches.push_back(branch);
+    }
+
+    return ref<Matchable<TResult>>(new Factored<TResult, TRef>(
+        context, std::get<0>(refs), rules, branches));
+  }
+};
+
+template <typename TResult>
+struct Factoring<TResult, void> {
+  template <typename TTuple>
+  static const void* leader(const TTuple&) {
+    return nullptr;
+  }
+
+  template <typename TTuple>
+  static ref<Matchable<TResult>> factor(
+      Fragment<TResult>*, const TTuple&,
+      const std::vector<Matchable<TResult>*>&) {
+    return ref<Matchable<TResult>>();
+  }
+};
+
+template <typename TResult, typename TCallback, typename... TRefs>
+class Rule : public Matchable<TResult>,
+             public Branch<TResult, typename Leading<TRefs...>::Type> {
  private:
   typedef MetaInfo<TResult, TRefs...> Info;
+  typedef typename Leading<TRefs...>::Type Lead;
 
- public:
-  Rule(Fragment<TResult>* context, TRefs... refs,
-       std::function<ref<TResult>(typename TRefs::TDeepType...)> callback)
-      : Matchable<TResult>(),
-        m_context(context),
-        m_refs(refs...),
-        m_callbackByExpansion(callback) {}
+  // Whether the callback takes the results one by one, or else as a tuple
+  template <typename TTested>
+  static auto expands(TTested* callback)
+      -> decltype((*callback)(std::declval<typename TRefs::TDeepType>()...),
+                  std::true_type());
+  template <typename>
+  static std::false_type expands(...);
+
+  typedef decltype(expands<TCallback>(nullptr)) Expands;
 
-  Rule(Fragment<TResult>* context, TRefs... refs,
-       std::function<ref<TResult>(std::tuple<typename TRefs::TDeepType...>)>
-           callback)
+ public:
+  Rule(Fragment<TResult>* context, TRefs... refs, TCallback callback)
       : Matchable<TResult>(),
-        m_context(context),
+        m_callback(std::move(callback)),
         m_refs(refs...),
-        m_callbackByTuple(callback) {}
+        m_context(context) {}
 
-  tanuki::Piece<TResult> consume(const tanuki::String& in) override {
-    return Resolver<sizeof...(TRefs), TResult, TRefs...>::callback(this, in,
-                                                                   in.size());
+  tanuki::Piece<TResult> consumeAt(const tanuki::String& in,
+                                   uint64_t offset) override {
+    return Resolver<sizeof...(TRefs), TResult, TRefs...>::callback(
+        this, in, offset, offset);
   }
 
-  void consume(const tanuki::String& in,
-               Yielder<Piece<TResult>>& results) override {
+  void consumeAt(const tanuki::String& in, uint64_t offset,
+                 Yielder<Piece<TResult>>& results) override {
     ResolverLeftRecursive<Info::BeginWith::value, TResult, TRefs...>::resolve(
-        this, in, &results);
+        this, in, offset, &results);
+  }
+
+  int64_t recognizeAt(const tanuki::String& in, uint64_t offset) override {
+    return Recognizer<sizeof...(TRefs), TResult, TRefs...>::recognize(
+        this, in, offset, offset);
+  }
+
+  void recognizeAt(const tanuki::String& in, uint64_t offset,
+                   std::vector<uint64_t>& lengths, size_t& cursor) override {
+    ResolverLeftRecursive<Info::BeginWith::value, TResult, TRefs...>::recognize(
+        this, in, offset, &lengths, &cursor);
+  }
+
+  int64_t extendAt(const tanuki::String& in, uint64_t offset,
+                   uint64_t length) override {
+    return ResolverLeftRecursive<Info::BeginWith::value, TResult,
+                                 TRefs...>::extend(this, in, offset, length);
+  }
+
+  Piece<TResult> extendAt(const tanuki::String& in, uint64_t offset,
+                          const Piece<TResult>& seed) override {
+    return ResolverLeftRecursive<Info::BeginWith::value, TResult,
+                                 TRefs...>::extend(this, in, offset, seed);
+  }
+
+  bool first(CharSet& set) override {
+    // Skipped tokens may come before the first ref
+    m_context->firstSkipped(set);
+
+    return Lookahead<sizeof...(TRefs), TResult, TRefs...>::first(this, set);
+  }
+
+  void lower(Program::Builder& builder) override {
+    Lowering<sizeof...(TRefs), TResult, TRefs...>::lower(this, builder);
+  }
+
+  const void* leader() override {
+    return Factoring<TResult, Lead>::leader(m_refs);
+  }
+
+  ref<Matchable<TResult>> factor(
+      const std::vector<Matchable<TResult>*>& rules) override {
+    return Factoring<TResult, Lead>::factor(m_context, m_refs, rules);
+  }
+
+  Piece<TResult> consumeAfter(
+      const tanuki::String& in, uint64_t offset, uint64_t initial,
+      const typename Branch<TResult, Lead>::TLead& lead) {
+    return Resolver<sizeof...(TRefs)-1, TResult, TRefs...>::callback(
+        this, in, offset, initial, lead.result);
+  }
+
+  int64_t recognizeAfter(const tanuki::String& in, uint64_t offset,
+                         uint64_t initial) {
+    return Recognizer<sizeof...(TRefs)-1, TResult, TRefs...>::recognize(
+        this, in, offset, initial);
   }
 
  private:
-  std::function<ref<TResult>(typename TRefs::TDeepType...)>
-      m_callbackByExpansion;
-  std::function<ref<TResult>(std::tuple<typename TRefs::TDeepType...>)>
-      m_callbackByTuple;
+  template <typename... TResults>
+  ref<TResult> call(std::true_type, TResults... results) {
+    return m_callback(std::move(results)...);
+  }
+
+  template <typename... TResults>
+  ref<TResult> call(std::false_type, TResults... results) {
+    return m_callback(std::make_tuple(std::move(results)...));
+  }
+
+  // Stored as is, so the call is direct and can be inlined
+  TCallback m_callback;
   std::tuple<TRefs...> m_refs;
   Fragment<TResult>* m_context;
 
   template <size_t, typename, typename...>
   friend struct Resolver;
+  template <size_t, typename, typename...>
+  friend struct Recognizer;
+  template <size_t, typename, typename...>
+  friend struct Lookahead;
+  template <size_t, typename, typename...>
+  friend struct Lowering;
+};
+
+/**
+ * @brief The Factored class groups rules starting with the same ref, which is
+ * consumed once before trying each of them. A callback may change the result
+ * it gets for the ref, so it is consumed again for the next rule once one
+ * matched: each callback gets its own, as if the rules weren't grouped.
+ */
+template <typename TResult, typename TRef>
+class Factored : public Matchable<TResult> {
+ public:
+  Factored(Fragment<TResult>* context, TRef leader,
+           const std::vector<Matchable<TResult>*>& rules,
+           const std::vector<Branch<TResult, TRef>*>& branches)
+      : Matchable<TResult>(),
+        m_context(context),
+        m_leader(leader),
+        m_rules(rules),
+        m_branches(branches) {}
+
+  tanuki::Piece<TResult> consumeAt(const tanuki::String& in,
+                                   uint64_t offset) override {
+    tanuki::Piece<TResult> result{0, ref<TResult>()};
+    uint64_t start = skip(in, offset);
+    auto lead = m_leader->consumeAt(in, start);
+    bool used = false;
+
+    if (!lead) {
+      return result;
+    }
+
+    for (Branch<TResult, TRef>* branch : m_branches) {
+      if (used) {
+        lead = m_leader->consumeAt(in, start);
+        used = false;
+      }
+
+      Piece<TResult> sub =
+          branch->consumeAfter(in, start + lead.length, offset, lead);
+      used = (bool)sub;
+
+      if (sub && (!result || (result.length < sub.length))) {
+        result = std::move(sub);
+
+        if ((m_context->policy == Policy::FirstMatch) ||
+            (result.length == (in.size() - offset))) {
+          break;
+        }
+      }
+    }
+
+    return result;
+  }
+
+  void consumeAt(const tanuki::String&, uint64_t,
+                 Yielder<Piece<TResult>>&) override {}
+
+  void consumeEach(const tanuki::String& in, uint64_t offset,
+                   std::vector<Piece<TResult>>& results) override {
+    uint64_t start = skip(in, offset);
+    auto lead = m_leader->consumeAt(in, start);
+    bool used = false;
+
+    if (lead) {
+      for (Branch<TResult, TRef>* branch : m_branches) {
+        if (used) {
+          lead = m_leader->consumeAt(in, start);
+          used = false;
+        }
+
+        Piece<TResult> sub =
+            branch->consumeAfter(in, start + lead.length, offset, lead);
+
+        if (sub) {
+          results.push_back(std::move(sub));
+          used = true;
+        }
+      }
+    }
+  }
+
+  int64_t recognizeAt(const tanuki::String& in, uint64_t offset) override {
+    int64_t result = -1;
+    uint64_t start = skip(in, offset);
+    int64_t lead = m_leader->recognizeAt(in, start);
+
+    if (lead >= 0) {
+      for (Branch<TResult, TRef>* branch : m_branches) {
+        result = std::max(
+            result, branch->recognizeAfter(in, start + lead, offset));
+
+        if ((result >= 0) && (m_context->policy == Policy::FirstMatch)) {
+          break;
+        }
+      }
+    }
+
+    return result;
+  }
+
+  void recognizeAt(const tanuki::String&, uint64_t, std::vector<uint64_t>&,
+                   size_t&) override {}
+
+  void recognizeEach(
+      const tanuki::String& in, uint64_t offset,
+      std::vector<std::pair<Matchable<TResult>*, int64_t>>& reached) override {
+    uint64_t start = skip(in, offset);
+    int64_t lead = m_leader->recognizeAt(in, start);
+
+    if (lead >= 0) {
+      for (size_t i = 0; i < m_branches.size(); i++) {
+        int64_t length =
+            m_branches[i]->recognizeAfter(in, start + lead, offset);
+
+        if (length >= 0) {
+          reached.push_back(std::make_pair(m_rules[i], length));
+        }
+      }
+    }
+  }
+
+  int64_t extendAt(const tanuki::String&, uint64_t, uint64_t) override {
+    return -1;
+  }
+
+  Piece<TResult> extendAt(const tanuki::String&, uint64_t,
+                          const Piece<TResult>&) override {
+    return Piece<TResult>{0, ref<TResult>()};
+  }
+
+  bool first(CharSet& set) override {
+    bool nullable = false;
+
+    for (Matchable<TResult>* rule : m_rules) {
+      nullable = (rule->first(set) || nullable);
+    }
+
+    return nullable;
+  }
+
+ private:
+  uint64_t skip(const tanuki::String& in, uint64_t offset) {
+    return m_context->skipFrom(in, offset);
+  }
+
+  Fragment<TResult>* m_context;
+  TRef m_leader;
+  std::vector<Matchable<TResult>*> m_rules;
+  std::vector<Branch<TResult, TRef>*> m_branches;
 };
 
 template <typename TResult, typename... TRefs>
@@ -107,7 +538,8 @@ struct ResolverLeftRecursive<true, TResult, TRefs...> {
   typedef MetaInfo<TResult, TRefs...> Info;
 
  public:
-  static void resolve(Rule<TResult, TRefs...>* rule, const tanuki::String& in,
+  template <typename TRule>
+  static void resolve(TRule* rule, const tanuki::String& in, uint64_t offset,
                       Yielder<Piece<TResult>>* results) {
     constexpr size_t length = sizeof...(TRefs)-1;
 
@@ -115,99 +547,168 @@ struct ResolverLeftRecursive<true, TResult, TRefs...> {
 
     do {
       subs.clear();
-      for (Piece<TResult> result : *results) {
-        Piece<TResult> sub =
-            Resolver<length, TResult, TRefs...>::callback(
-                rule, in.substr(result.length), in.size(), result.result);
+      for (const Piece<TResult>& result : *results) {
+        Piece<TResult> sub = Resolver<length, TResult, TRefs...>::callback(
+            rule, in, offset + result.length, offset, result.result);
 
         if (sub) {
-          subs.push_back(sub);
+          subs.push_back(std::move(sub));
         }
       }
 
-      for (Piece<TResult> sub : subs) {
-        results->push(sub);
+      for (Piece<TResult>& sub : subs) {
+        results->push(std::move(sub));
       }
 
     } while (!subs.empty());
   }
+
+  template <typename TRule>
+  static void recognize(TRule* rule, const tanuki::String& in,
+                        uint64_t offset, std::vector<uint64_t>* lengths,
+                        size_t* cursor) {
+    // Lengths appended here are extended in the same loop
+    for (; *cursor < lengths->size(); (*cursor)++) {
+      int64_t sub = extend(rule, in, offset, (*lengths)[*cursor]);
+
+      if ((sub >= 0) &&
+          (std::find(lengths->begin(), lengths->end(), (uint64_t)sub) ==
+           lengths->end())) {
+        lengths->push_back(sub);
+      }
+    }
+  }
+
+  template <typename TRule>
+  static int64_t extend(TRule* rule, const tanuki::String& in, uint64_t offset,
+                        uint64_t length) {
+    return Recognizer<sizeof...(TRefs)-1, TResult, TRefs...>::recognize(
+        rule, in, offset + length, offset);
+  }
+
+  template <typename TRule>
+  static Piece<TResult> extend(TRule* rule, const tanuki::String& in,
+                               uint64_t offset, const Piece<TResult>& seed) {
+    return Resolver<sizeof...(TRefs)-1, TResult, TRefs...>::callback(
+        rule, in, offset + seed.length, offset, seed.result);
+  }
 };
 
 template <size_t N, typename TResult, typename... TRefs>
 struct Resolver {
-  template <typename... TRefsResults>
-  static tanuki::Piece<TResult> callback(Rule<TResult, TRefs...>* rule,
-                                         const tanuki::String& in,
-                                         uint32_t initialSize,
+  template <typename TRule, typename... TRefsResults>
+  static tanuki::Piece<TResult> callback(TRule* rule, const tanuki::String& in,
+                                         uint64_t offset, uint64_t initial,
                                          TRefsResults... results) {
     constexpr size_t current_ref = sizeof...(TRefsResults);
 
     tanuki::Piece<TResult> result{0, tanuki::ref<TResult>()};
 
-    tanuki::String skippedIn = in;
-
-    uint32_t toSkip = rule->m_context->shouldSkip(skippedIn);
+    offset = rule->m_context->skipFrom(in, offset);
 
-    while (toSkip > 0) {
-      skippedIn = skippedIn.substr(toSkip);
+    auto consumed = std::get<current_ref>(rule->m_refs)->consumeAt(in, offset);
 
-      toSkip = rule->m_context->shouldSkip(skippedIn);
+    if (consumed) {
+      result = Resolver<N - 1, TResult, TRefs...>::callback(
+          rule, in, offset + consumed.length, initial, std::move(results)...,
+          std::move(consumed.result));
     }
 
-    auto consumed = std::get<current_ref>(rule->m_refs)->consume(skippedIn);
+    return result;
+  }
+};
+
+template <size_t N, typename TResult, typename... TRefs>
+struct Recognizer {
+  template <typename TRule>
+  static int64_t recognize(TRule* rule, const tanuki::String& in,
+                           uint64_t offset, uint64_t initial) {
+    constexpr size_t current_ref = sizeof...(TRefs) - N;
 
-    if (consumed) {
-      try {
-        typedef std::tuple<TRefs...> TupleRefs;
-        typedef typename std::tuple_element<current_ref,
-                                            TupleRefs>::type::TDeepType NType;
+    offset = rule->m_context->skipFrom(in, offset);
 
-        result = Resolver<N - 1, TResult, TRefs...>::callback(
-            rule, skippedIn.substr(consumed.length), initialSize, results...,
-            consumed.result);
+    int64_t consumed =
+        std::get<current_ref>(rule->m_refs)->recognizeAt(in, offset);
 
-      } catch (NoExecuteDefinition&) {
-        throw;
-      }
+    if (consumed < 0) {
+      return -1;
     }
 
-    return result;
+    return Recognizer<N - 1, TResult, TRefs...>::recognize(
+        rule, in, offset + consumed, initial);
   }
 };
 
 template <typename TResult, typename... TRefs>
-struct Resolver<0, TResult, TRefs...> {
-  template <typename... TRefsResults>
-  static tanuki::Piece<TResult> callback(Rule<TResult, TRefs...>* rule,
-                                         const tanuki::String& in,
-                                         uint32_t initialSize,
-                                         TRefsResults... results) {
-    tanuki::String skippedIn = in;
-
+struct Recognizer<0, TResult, TRefs...> {
+  template <typename TRule>
+  static int64_t recognize(TRule* rule, const tanuki::String& in,
+                           uint64_t offset, uint64_t initial) {
     if (rule->m_context->skipAtEnd) {
-      uint32_t toSkip = rule->m_context->shouldSkip(skippedIn);
+      offset = rule->m_context->skipFrom(in, offset);
+    }
 
-      while (toSkip > 0) {
-        skippedIn = skippedIn.substr(toSkip);
+    return (offset - initial);
+  }
+};
 
-        toSkip = rule->m_context->shouldSkip(skippedIn);
-      }
+template <size_t N, typename TResult, typename... TRefs>
+struct Lookahead {
+  template <typename TRule>
+  static bool first(TRule* rule, CharSet& set) {
+    constexpr size_t current_ref = sizeof...(TRefs) - N;
+
+    // Next refs are only reached when the current one can consume nothing
+    if (!std::get<current_ref>(rule->m_refs)->first(set)) {
+      return false;
     }
 
-    Piece<TResult> result;
+    return Lookahead<N - 1, TResult, TRefs...>::first(rule, set);
+  }
+};
+
+template <typename TResult, typename... TRefs>
+struct Lookahead<0, TResult, TRefs...> {
+  template <typename TRule>
+  static bool first(TRule*, CharSet&) { return true; }
+};
+
+template <size_t N, typename TResult, typename... TRefs>
+struct Lowering {
+  template <typename TRule>
+  static void lower(TRule* rule, Program::Builder& builder) {
+    constexpr size_t current_ref = sizeof...(TRefs) - N;
+
+    rule->m_context->lowerSkipped(builder);
+    builder.lower(std::get<current_ref>(rule->m_refs));
+
+    Lowering<N - 1, TResult, TRefs...>::lower(rule, builder);
+  }
+};
+
+template <typename TResult, typename... TRefs>
+struct Lowering<0, TResult, TRefs...> {
+  template <typename TRule>
+  static void lower(TRule* rule, Program::Builder& builder) {
+    if (rule->m_context->skipAtEnd) {
+      rule->m_context->lowerSkipped(builder);
+    }
+  }
+};
 
-    if (rule->m_callbackByExpansion) {
-      result = Piece<TResult>{initialSize - skippedIn.size(),
-                              rule->m_callbackByExpansion(results...)};
-    } else if (rule->m_callbackByTuple) {
-      result =
-          Piece<TResult>{initialSize - skippedIn.size(),
-                         rule->m_callbackByTuple(std::make_tuple(results...))};
-    } else {
-      throw NoExecuteDefinition();
+template <typename TResult, typename... TRefs>
+struct Resolver<0, TResult, TRefs...> {
+  template <typename TRule, typename... TRefsResults>
+  static tanuki::Piece<TResult> callback(TRule* rule, const tanuki::String& in,
+                                         uint64_t offset, uint64_t initial,
+                                         TRefsResults... results) {
+    if (rule->m_context->skipAtEnd) {
+      offset = rule->m_context->skipFrom(in, offset);
     }
 
-    return result;
+    return Piece<TResult>{
+        offset - initial,
+        rule->call(typename TRule::Expands(), std::move(results)...)};
   }
 };
 }
@@ -4,19 +4,31 @@
 
 namespace tanuki {
 ref<ConstantToken> constant(const std::string &constant) {
-  return ref<ConstantToken>(new ConstantToken(constant));
+  return make_ref<ConstantToken>(constant);
 }
 
 ref<CharToken> constant(char character) {
-  return ref<CharToken>(new CharToken(character));
+  return make_ref<CharToken>(character);
 }
 
 ref<IntegerToken> integer() {
-  return ref<IntegerToken>(new IntegerToken());
+  return make_ref<IntegerToken>();
+}
+
+ref<FloatingToken> floating(bool sign) {
+  return make_ref<FloatingToken>(sign);
 }
 
 ref<AnyInToken> anyIn(char inferiorBound, char superiorBound) {
-  return ref<AnyInToken>(new AnyInToken(inferiorBound, superiorBound));
+  return make_ref<AnyInToken>(inferiorBound, superiorBound);
+}
+
+ref<TrieToken> keywords(const std::vector<std::string> &words) {
+  return make_ref<TrieToken>(words, true);
+}
+
+ref<DictionaryToken> dictionary(const std::string &path) {
+  return DictionaryToken::load(path);
 }
 
 ref<CharToken> space() {
@@ -44,7 +56,7 @@ ref<AnyInToken> letter() {
 }
 
 ref<AnyOfToken> anyOf(char c) {
-  ref<AnyOfToken> result(new AnyOfToken());
+  ref<AnyOfToken> result(make_ref<AnyOfToken>());
   result->validate(c);
 
   return result;
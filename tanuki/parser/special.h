@@ -3,6 +3,9 @@
 #include "tanuki/misc/ref.h"
 
 #include "tokens.h"
+#include "automaton.h"
+#include "dictionary.h"
+#include "floating.h"
 #include "fragment.h"
 
 #include <tuple>
@@ -13,6 +16,18 @@ ref<CharToken> constant(char character);
 ref<IntegerToken> integer();
 ref<AnyInToken> anyIn(char inferiorBound, char superiorBound);
 
+/**
+ * @brief One of the words, the longest one matching, looked up in a trie.
+ */
+ref<TrieToken> keywords(const std::vector<std::string> &words);
+
+/**
+ * @brief One of the words of the file at path, the longest one matching. The
+ * file is a list of words, one per line, or an automaton written by
+ * DictionaryToken::save() which is mapped as is.
+ */
+ref<DictionaryToken> dictionary(const std::string &path);
+
 // Helper constants
 ref<CharToken> space();
 ref<CharToken> tab();
@@ -22,31 +37,54 @@ ref<AnyInToken> digit();
 ref<AnyInToken> letter();
 ref<AnyOfToken> anyOf(char c);
 
+/**
+ * @brief A decimal integer read as TInteger, preceded by '-' if sign is set.
+ * Nothing is allocated but the result, a number which overflows isn't
+ * matched.
+ */
+template <typename TInteger>
+ref<BasicIntegerToken<TInteger>> integer(bool sign = false) {
+  return make_ref<BasicIntegerToken<TInteger>>(sign);
+}
+
+/**
+ * @brief A decimal number with an optional fraction and exponent, read as
+ * the nearest double, preceded by '-' if sign is set.
+ */
+ref<FloatingToken> floating(bool sign = false);
+
 template <typename TToken>
 ref<WordToken<TToken>> word(ref<TToken> inner) {
-  return ref<WordToken<TToken>>(new WordToken<TToken>(inner));
+  return make_ref<WordToken<TToken>>(inner);
 }
 
 template <std::size_t size, typename TToken>
 ref<RepeatableToken<TToken, size>> repeat(ref<TToken> token) {
-  return ref<RepeatableToken<TToken, size>>(
-      new RepeatableToken<TToken, size>(token));
+  return make_ref<RepeatableToken<TToken, size>>(token);
 }
 
 template <typename TToken>
 ref<StartWithToken<TToken>> startWith(ref<TToken> inner) {
-  return ref<StartWithToken<TToken>>(new StartWithToken<TToken>(inner));
+  return make_ref<StartWithToken<TToken>>(inner);
 }
 
 template <typename TToken>
 ref<EndWithToken<TToken>> endWith(ref<TToken> inner) {
-  return ref<EndWithToken<TToken>>(new EndWithToken<TToken>(inner));
+  return make_ref<EndWithToken<TToken>>(inner);
 }
 
 template <typename TLeft, typename TRight>
 ref<RangeToken<TLeft, TRight>> range(ref<TLeft> left, ref<TRight> right) {
-  return ref<RangeToken<TLeft, TRight>>(
-      new RangeToken<TLeft, TRight>(left, right));
+  return make_ref<RangeToken<TLeft, TRight>>(left, right);
+}
+
+/**
+ * @brief Compile a token made of chars, constants, choices and repetitions
+ * into a DFA. Throws NotRegularError for any other token.
+ */
+template <typename TToken>
+ref<AutomatonToken> compile(ref<TToken> token) {
+  return make_ref<AutomatonToken>(token->pattern());
 }
 
 template <typename... TRest>
@@ -61,13 +99,12 @@ template <typename... TRefs>
 ref<Fragment<std::tuple<typename TRefs::TDeepType...>>> consequent(
     TRefs... refs) {
   ref<Fragment<std::tuple<typename TRefs::TDeepType...>>> result(
-      new Fragment<std::tuple<typename TRefs::TDeepType...>>());
+      make_ref<Fragment<std::tuple<typename TRefs::TDeepType...>>>());
 
   result->handle(
       [](typename TRefs::TDeepType... in)
           -> ref<std::tuple<typename TRefs::TDeepType...>> {
-            return ref<std::tuple<typename TRefs::TDeepType...>>(
-                new std::tuple<typename TRefs::TDeepType...>(in...));
+            return make_ref<std::tuple<typename TRefs::TDeepType...>>(in...);
           },
       refs...);
 
@@ -1,5 +1,9 @@
 #include "tokens.h"
 
+#include <algorithm>
+#include <climits>
+#include <cstring>
+#include <map>
 #include <string>
 
 #include "operation.h"
@@ -10,20 +14,21 @@ ConstantToken::ConstantToken(const std::string &constant)
     : Token<std::string>(), m_constant(constant) {}
 
 ref<std::string> ConstantToken::match(const tanuki::String &in) {
-  return ((in == m_constant) ? ref<std::string>(new std::string(m_constant))
+  return ((in == m_constant) ? make_ref<std::string>(m_constant)
                              : ref<std::string>());
 }
 
-Piece<std::string> ConstantToken::consume(const tanuki::String &in) {
-  uint32_t length = m_constant.size();
+Piece<std::string> ConstantToken::consumeAt(const tanuki::String &in,
+                                            uint64_t offset) {
+  uint64_t length = m_constant.size();
 
-  if (in.size() < length) {
+  if ((in.size() - offset) < length) {
     return Piece<std::string>{0, ref<std::string>()};
   } else {
     bool result = true;
 
-    for (int i = 0; i < length; i++) {
-      if (in[i] != m_constant[i]) {
+    for (uint64_t i = 0; i < length; i++) {
+      if (in[offset + i] != m_constant[i]) {
         result = false;
         break;
       }
@@ -31,99 +36,188 @@ Piece<std::string> ConstantToken::consume(const tanuki::String &in) {
 
     if (result) {
       return Piece<std::string>{length,
-                                ref<std::string>(new std::string(m_constant))};
+                                make_ref<std::string>(m_constant)};
     } else {
       return Piece<std::string>{0, ref<std::string>()};
     }
   }
 }
 
+int64_t ConstantToken::recognizeAt(const tanuki::String &in, uint64_t offset) {
+  uint64_t length = m_constant.size();
+
+  if ((in.size() - offset) < length) {
+    return -1;
+  }
+
+  return (memcmp(in.data() + offset, m_constant.data(), length) ? -1
+                                                                 : length);
+}
+
+bool ConstantToken::first(CharSet &set) {
+  if (m_constant.empty()) {
+    return true;
+  }
+
+  set.add(m_constant[0]);
+
+  return false;
+}
+
+ref<Pattern> ConstantToken::pattern() {
+  std::vector<ref<Pattern>> chars;
+
+  for (char c : m_constant) {
+    CharSet set;
+    set.add(c);
+
+    chars.push_back(make_ref<Pattern>(set));
+  }
+
+  return make_ref<Pattern>(Pattern::Sequence, chars);
+}
+
 CharToken::CharToken(char character) : Token<char>(), m_character(character) {}
 
 ref<char> CharToken::match(const tanuki::String &in) {
   if (in.size() == 1) {
-    return ((in[0] == m_character) ? ref<char>(new char(m_character))
+    return ((in[0] == m_character) ? make_ref<char>(m_character)
                                    : ref<char>());
   } else {
     return ref<char>();
   }
 }
 
-Piece<char> CharToken::consume(const tanuki::String &in) {
-  if (in.empty()) {
+Piece<char> CharToken::consumeAt(const tanuki::String &in, uint64_t offset) {
+  if (offset >= in.size()) {
     return Piece<char>{0, ref<char>()};
   } else {
-    if (in[0] == m_character) {
-      return Piece<char>{1, ref<char>(new char(m_character))};
+    if (in[offset] == m_character) {
+      return Piece<char>{1, make_ref<char>(m_character)};
     } else {
       return Piece<char>{0, ref<char>()};
     }
   }
 }
 
-IntegerToken::IntegerToken() : Token<int>() {}
+int64_t CharToken::recognizeAt(const tanuki::String &in, uint64_t offset) {
+  return (((offset < in.size()) && (in[offset] == m_character)) ? 1 : -1);
+}
 
-ref<int> IntegerToken::match(const tanuki::String &in) {
-  static auto inner(word(anyIn('0', '9')));
+bool CharToken::first(CharSet &set) {
+  set.add(m_character);
 
-  ref<std::string> result(inner->match(in));
+  return false;
+}
 
-  if (result) {
-    return ref<int>(
-        new int(std::stoi(useOnce(result.release()).exposeValue())));
-  } else {
-    return ref<int>();
-  }
+ref<Pattern> CharToken::pattern() {
+  CharSet set;
+  first(set);
+
+  return make_ref<Pattern>(set);
 }
 
-Piece<int> IntegerToken::consume(const tanuki::String &in) {
-  static auto inner(word(anyIn('0', '9')));
+int64_t readDigits(const char *data, int64_t length, uint64_t limit,
+                   uint64_t &value) {
+  int64_t i = 0;
 
-  Piece<std::string> result(inner->consume(in));
+  value = 0;
 
-  if (result.result) {
-    return Piece<int>{result.length,
-                      ref<int>(new int(std::stoi(
-                          useOnce(result.result.release()).exposeValue())))};
-  } else {
-    return Piece<int>{0, ref<int>()};
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+  // Eight digits are checked and converted in one word (SWAR)
+  while ((i + 8) <= length) {
+    uint64_t chunk;
+    memcpy(&chunk, data + i, sizeof(chunk));
+
+    if (((chunk & 0xf0f0f0f0f0f0f0f0) |
+         (((chunk + 0x0606060606060606) & 0xf0f0f0f0f0f0f0f0) >> 4)) !=
+        0x3333333333333333) {
+      break;
+    }
+
+    // Pairs of digits, then groups of four, then the eight of them
+    chunk -= 0x3030303030303030;
+    chunk = ((chunk * 10) + (chunk >> 8));
+    chunk = ((((chunk & 0x000000ff000000ff) * (100 + (1000000ULL << 32))) +
+              (((chunk >> 16) & 0x000000ff000000ff) * (1 + (10000ULL << 32))))
+             >> 32);
+
+    if ((chunk > limit) || (value > ((limit - chunk) / 100000000))) {
+      return -1;
+    }
+
+    value = ((value * 100000000) + chunk);
+    i += 8;
+  }
+#endif
+
+  for (; i < length; i++) {
+    uint64_t digit = ((unsigned char)data[i] - '0');
+
+    if (digit > 9) {
+      break;
+    }
+
+    if ((digit > limit) || (value > ((limit - digit) / 10))) {
+      return -1;
+    }
+
+    value = ((value * 10) + digit);
   }
+
+  return ((i > 0) ? i : -1);
 }
 
 AnyOfToken::AnyOfToken(std::vector<char> initial) : AnyOfToken() {
   for (char c : initial) {
-    this->m_intern[c] = true;
+    this->m_intern.add(c);
   }
 }
 
-AnyOfToken::AnyOfToken() : Token<char>() {
-  for (int i = 0; i < CHAR_MAX; i++) {
-    this->m_intern[i] = false;
-  }
-}
+AnyOfToken::AnyOfToken() : Token<char>() {}
 
-void AnyOfToken::validate(char character) { this->m_intern[character] = true; }
+void AnyOfToken::validate(char character) {
+  this->m_intern.add(character);
+  Grammar::revised();
+}
 
 ref<char> AnyOfToken::match(const tanuki::String &in) {
   if (in.size() == 1) {
-    return ((this->m_intern[in[0]]) ? ref<char>(new char(in[0])) : ref<char>());
+    return ((this->m_intern.has(in[0])) ? make_ref<char>(in[0]) : ref<char>());
   } else {
     return ref<char>();
   }
 }
 
-Piece<char> AnyOfToken::consume(const tanuki::String &in) {
-  if (in.empty()) {
+Piece<char> AnyOfToken::consumeAt(const tanuki::String &in, uint64_t offset) {
+  if (offset >= in.size()) {
     return Piece<char>{0, ref<char>()};
   } else {
-    if (this->m_intern[in[0]]) {
-      return Piece<char>{1, ref<char>(new char(in[0]))};
+    if (this->m_intern.has(in[offset])) {
+      return Piece<char>{1, make_ref<char>(in[offset])};
     } else {
       return Piece<char>{0, ref<char>()};
     }
   }
 }
 
+int64_t AnyOfToken::recognizeAt(const tanuki::String &in, uint64_t offset) {
+  return (((offset < in.size()) && this->m_intern.has(in[offset])) ? 1 : -1);
+}
+
+bool AnyOfToken::first(CharSet &set) {
+  set.merge(this->m_intern);
+
+  return false;
+}
+
+ref<Pattern> AnyOfToken::pattern() {
+  CharSet set;
+  first(set);
+
+  return make_ref<Pattern>(set);
+}
+
 AnyInToken::AnyInToken(char inferiorBound, char superiorBound)
     : Token<char>(),
       m_inferiorBound(inferiorBound),
@@ -132,22 +226,251 @@ AnyInToken::AnyInToken(char inferiorBound, char superiorBound)
 ref<char> AnyInToken::match(const tanuki::String &in) {
   if (in.size() == 1) {
     return (((in[0] >= m_inferiorBound) and (in[0] <= m_superiorBound))
-                ? ref<char>(new char(in[0]))
+                ? make_ref<char>(in[0])
                 : ref<char>());
   } else {
     return ref<char>();
   }
 }
 
-Piece<char> AnyInToken::consume(const tanuki::String &in) {
-  if (in.empty()) {
+Piece<char> AnyInToken::consumeAt(const tanuki::String &in, uint64_t offset) {
+  if (offset >= in.size()) {
     return Piece<char>{0, ref<char>()};
   } else {
-    if ((in[0] >= m_inferiorBound) and (in[0] <= m_superiorBound)) {
-      return Piece<char>{1, ref<char>(new char(in[0]))};
+    char current = in[offset];
+
+    if ((current >= m_inferiorBound) and (current <= m_superiorBound)) {
+      return Piece<char>{1, make_ref<char>(current)};
     } else {
       return Piece<char>{0, ref<char>()};
     }
   }
 }
+
+int64_t AnyInToken::recognizeAt(const tanuki::String &in, uint64_t offset) {
+  if (offset >= in.size()) {
+    return -1;
+  }
+
+  char current = in[offset];
+
+  return (((current >= m_inferiorBound) and (current <= m_superiorBound)) ? 1
+                                                                          : -1);
+}
+
+bool AnyInToken::first(CharSet &set) {
+  // Bounds are compared as char, which may be signed
+  for (int i = 0; i <= UCHAR_MAX; i++) {
+    char current = i;
+
+    if ((current >= m_inferiorBound) and (current <= m_superiorBound)) {
+      set.add(i);
+    }
+  }
+
+  return false;
+}
+
+ref<Pattern> AnyInToken::pattern() {
+  CharSet set;
+  first(set);
+
+  return make_ref<Pattern>(set);
+}
+
+TrieToken::TrieToken(const std::vector<std::string> &words, bool longest)
+    : Token<std::string>(), m_words(words), m_longest(longest) {
+  struct Branch {
+    std::map<unsigned char, int> children;
+    int word;
+  };
+
+  std::vector<Branch> branches{Branch{{}, -1}};
+
+  for (int i = 0; i < (int)words.size(); i++) {
+    int current = 0;
+
+    for (unsigned char c : words[i]) {
+      auto it = branches[current].children.find(c);
+
+      if (it == branches[current].children.end()) {
+        branches.push_back(Branch{{}, -1});
+        branches[current].children[c] = (branches.size() - 1);
+        current = (branches.size() - 1);
+      } else {
+        current = it->second;
+      }
+    }
+
+    // A duplicate keeps the index of its first occurrence
+    if (branches[current].word < 0) {
+      branches[current].word = i;
+    }
+  }
+
+  // Nodes are laid out breadth first, so that the children of a node follow
+  // each other and are found by the rank of their byte.
+  std::vector<int> order{0};
+  m_nodes.resize(branches.size());
+
+  for (size_t n = 0; n < order.size(); n++) {
+    const Branch &branch = branches[order[n]];
+    Node &node = m_nodes[n];
+
+    node.child = order.size();
+    node.word = branch.word;
+    node.lowest = ((branch.word < 0) ? INT_MAX : branch.word);
+
+    for (const auto &child : branch.children) {
+      node.edges.add(child.first);
+      order.push_back(child.second);
+    }
+  }
+
+  for (int n = (m_nodes.size() - 1); n >= 0; n--) {
+    Node &node = m_nodes[n];
+
+    for (int i = 0; i < node.edges.size(); i++) {
+      node.lowest = std::min(node.lowest, m_nodes[node.child + i].lowest);
+    }
+  }
+}
+
+bool TrieToken::literals(const ref<Pattern> &pattern,
+                         std::vector<std::string> &words) {
+  if (!(bool)pattern) {
+    return false;
+  }
+
+  switch (pattern->kind) {
+    case Pattern::Choice:
+      for (const ref<Pattern> &child : pattern->children) {
+        if (!literals(child, words)) {
+          return false;
+        }
+      }
+
+      return true;
+    case Pattern::Set:
+    case Pattern::Sequence: {
+      std::vector<ref<Pattern>> chars;
+
+      if (pattern->kind == Pattern::Set) {
+        chars.push_back(pattern);
+      } else {
+        chars = pattern->children;
+      }
+
+      std::string word;
+
+      for (const ref<Pattern> &c : chars) {
+        if ((c->kind != Pattern::Set) || (c->chars.size() != 1)) {
+          return false;
+        }
+
+        for (int i = 0; i < 256; i++) {
+          if (c->chars.has(i)) {
+            word.push_back((char)i);
+          }
+        }
+      }
+
+      words.push_back(word);
+
+      return true;
+    }
+    default:
+      return false;
+  }
+}
+
+ref<std::string> TrieToken::match(const tanuki::String &in) {
+  const Node *node = &m_nodes[0];
+
+  for (uint64_t i = 0; i < in.size(); i++) {
+    unsigned char c = in[i];
+
+    if (!node->edges.has(c)) {
+      return ref<std::string>();
+    }
+
+    node = &m_nodes[node->child + node->edges.rank(c)];
+  }
+
+  return ((node->word < 0) ? ref<std::string>()
+                           : make_ref<std::string>(m_words[node->word]));
+}
+
+Piece<std::string> TrieToken::consumeAt(const tanuki::String &in,
+                                        uint64_t offset) {
+  int64_t length = recognizeAt(in, offset);
+
+  if (length < 0) {
+    return Piece<std::string>{0, ref<std::string>()};
+  } else {
+    return Piece<std::string>{
+        (uint64_t)length,
+        make_ref<std::string>(in.data() + offset, length)};
+  }
+}
+
+int64_t TrieToken::recognizeAt(const tanuki::String &in, uint64_t offset) {
+  const Node *node = &m_nodes[0];
+  const char *data = in.data() + offset;
+  int64_t remaining = (in.size() - offset);
+  int best = node->word;
+  int64_t length = ((best < 0) ? -1 : 0);
+
+  for (int64_t i = 0; i < remaining; i++) {
+    // In order, no word below can come before the one found
+    if (!m_longest && (best >= 0) && (node->lowest >= best)) {
+      break;
+    }
+
+    unsigned char c = data[i];
+
+    if (!node->edges.has(c)) {
+      break;
+    }
+
+    node = &m_nodes[node->child + node->edges.rank(c)];
+
+    if ((node->word >= 0) &&
+        (m_longest || (best < 0) || (node->word < best))) {
+      best = node->word;
+      length = (i + 1);
+    }
+  }
+
+  return length;
+}
+
+bool TrieToken::first(CharSet &set) {
+  set.merge(m_nodes[0].edges);
+
+  return (m_nodes[0].word >= 0);
+}
+
+ref<Pattern> TrieToken::pattern() {
+  std::vector<int> order;
+
+  for (int i = 0; i < (int)m_words.size(); i++) {
+    order.push_back(i);
+  }
+
+  // The first of the longest words is the longest match
+  if (m_longest) {
+    std::stable_sort(order.begin(), order.end(), [this](int a, int b) {
+      return (m_words[a].size() > m_words[b].size());
+    });
+  }
+
+  std::vector<ref<Pattern>> choices;
+
+  for (int i : order) {
+    choices.push_back(ConstantToken(m_words[i]).pattern());
+  }
+
+  return make_ref<Pattern>(Pattern::Choice, choices);
+}
 }
@@ -7,9 +7,15 @@
 #include <array>
 
 #include <climits>
+#include <cstring>
+#include <limits>
+#include <mutex>
 
 #include "tanuki/misc/misc.h"
 
+#include "grammar.h"
+#include "pattern.h"
+
 namespace tanuki {
 // Root
 template <typename>
@@ -18,9 +24,11 @@ class Token;
 // Simple
 class ConstantToken;
 class CharToken;
-class IntegerToken;
+template <typename>
+class BasicIntegerToken;
 class AnyOfToken;
 class AnyInToken;
+class TrieToken;
 
 // Unary
 template <typename, typename>
@@ -57,13 +65,46 @@ class WordToken;
 // ~~~~~~~~ Helper
 
 /**
- * @brief The Token class is the root class of Tokens.
+ * @brief The Token class is the root class of Tokens. A token implements
+ * consumeAt, which reads the input from an offset so callers don't have to
+ * slice it for each attempt. recognizeAt only returns the consumed length (-1
+ * on failure), built-in tokens implement it without allocating.
  */
 template <typename TReturn>
 class Token {
  public:
+  virtual ~Token() = default;
+
   virtual ref<TReturn> match(const tanuki::String &in) = 0;
-  virtual Piece<TReturn> consume(const tanuki::String &in) = 0;
+  virtual Piece<TReturn> consume(const tanuki::String &in) {
+    return consumeAt(in, 0);
+  }
+  virtual Piece<TReturn> consumeAt(const tanuki::String &in,
+                                   uint64_t offset) = 0;
+  virtual int64_t recognizeAt(const tanuki::String &in, uint64_t offset) {
+    Piece<TReturn> result = consumeAt(in, offset);
+
+    return (result ? (int64_t)result.length : -1);
+  }
+  bool matches(const tanuki::String &in) {
+    return (recognizeAt(in, 0) == (int64_t)in.size());
+  }
+
+  /**
+   * @brief Add the bytes a match can start with to set, returns whether the
+   * token can match without consuming anything. Tokens which don't know it
+   * accept anything.
+   */
+  virtual bool first(CharSet &set) {
+    set.fill();
+    return true;
+  }
+
+  /**
+   * @brief The regular expression matched by the token, which can then be
+   * compiled. Empty if it isn't regular.
+   */
+  virtual ref<Pattern> pattern() { return ref<Pattern>(); }
   virtual int exactSize() { return -1; }
   virtual int biggestSize() { return -1; }
 
@@ -77,7 +118,11 @@ class ConstantToken : public Token<std::string> {
  public:
   explicit ConstantToken(const std::string &constant);
   ref<std::string> match(const tanuki::String &in) override;
-  Piece<std::string> consume(const tanuki::String &in) override;
+  Piece<std::string> consumeAt(const tanuki::String &in,
+                               uint64_t offset) override;
+  int64_t recognizeAt(const tanuki::String &in, uint64_t offset) override;
+  bool first(CharSet &set) override;
+  ref<Pattern> pattern() override;
   int exactSize() override { return m_constant.size(); }
 
  private:
@@ -91,7 +136,10 @@ class CharToken : public Token<char> {
  public:
   explicit CharToken(char character);
   ref<char> match(const tanuki::String &in) override;
-  Piece<char> consume(const tanuki::String &in) override;
+  Piece<char> consumeAt(const tanuki::String &in, uint64_t offset) override;
+  int64_t recognizeAt(const tanuki::String &in, uint64_t offset) override;
+  bool first(CharSet &set) override;
+  ref<Pattern> pattern() override;
   int exactSize() override { return 1; }
 
  private:
@@ -99,41 +147,105 @@ class CharToken : public Token<char> {
 };
 
 /**
- * @brief The IntegerToken class represents an integer.
+ * @brief Read the decimal digits at the start of data into value, 8 at a time
+ * when they are. Returns the number of digits, -1 if there is none or if the
+ * value is greater than limit.
+ */
+int64_t readDigits(const char *data, int64_t length, uint64_t limit,
+                   uint64_t &value);
+
+/**
+ * @brief The BasicIntegerToken class represents a decimal integer read as
+ * TInteger, preceded by '-' if sign is set and TInteger is signed. A number
+ * which doesn't fit in TInteger isn't matched. It has no pattern, which
+ * couldn't bound the value, so it can't be compiled; programs read it with
+ * an instruction of their own.
  */
-class IntegerToken : public Token<int> {
+template <typename TInteger>
+class BasicIntegerToken : public Token<TInteger> {
  public:
-  explicit IntegerToken();
-  ref<int> match(const tanuki::String &in) override;
-  Piece<int> consume(const tanuki::String &in) override;
+  explicit BasicIntegerToken(bool sign = false);
+  ref<TInteger> match(const tanuki::String &in) override;
+  Piece<TInteger> consumeAt(const tanuki::String &in,
+                            uint64_t offset) override;
+  int64_t recognizeAt(const tanuki::String &in, uint64_t offset) override;
+  bool first(CharSet &set) override;
+
+  bool sign() const { return m_sign; }
 
  private:
-  int m_result;
+  // Length of the number at offset, -1 if there is none
+  int64_t read(const tanuki::String &in, uint64_t offset, TInteger &value);
+
+  bool m_sign;
 };
 
+typedef BasicIntegerToken<int> IntegerToken;
+
 class AnyOfToken : public Token<char> {
  public:
   explicit AnyOfToken(std::vector<char> initial);
   explicit AnyOfToken();
   void validate(char character);
   ref<char> match(const tanuki::String &in) override;
-  Piece<char> consume(const tanuki::String &in) override;
+  Piece<char> consumeAt(const tanuki::String &in, uint64_t offset) override;
+  int64_t recognizeAt(const tanuki::String &in, uint64_t offset) override;
+  bool first(CharSet &set) override;
+  ref<Pattern> pattern() override;
 
  private:
-  bool m_intern[CHAR_MAX];
+  CharSet m_intern;
 };
 
 class AnyInToken : public Token<char> {
  public:
   explicit AnyInToken(char inferiorBound, char superiorBound);
   ref<char> match(const tanuki::String &in) override;
-  Piece<char> consume(const tanuki::String &in) override;
+  Piece<char> consumeAt(const tanuki::String &in, uint64_t offset) override;
+  int64_t recognizeAt(const tanuki::String &in, uint64_t offset) override;
+  bool first(CharSet &set) override;
+  ref<Pattern> pattern() override;
 
  private:
   char m_inferiorBound;
   char m_superiorBound;
 };
 
+/**
+ * @brief The TrieToken class represents a set of constants, looked up in a
+ * trie in one pass. It matches the longest constant, or the first one in the
+ * order they were given.
+ */
+class TrieToken : public Token<std::string> {
+ public:
+  explicit TrieToken(const std::vector<std::string> &words, bool longest);
+  ref<std::string> match(const tanuki::String &in) override;
+  Piece<std::string> consumeAt(const tanuki::String &in,
+                               uint64_t offset) override;
+  int64_t recognizeAt(const tanuki::String &in, uint64_t offset) override;
+  bool first(CharSet &set) override;
+  ref<Pattern> pattern() override;
+
+  /**
+   * @brief Constants of a pattern made only of them (or of chars), in order.
+   * Returns false if there is anything else.
+   */
+  static bool literals(const ref<Pattern> &pattern,
+                       std::vector<std::string> &words);
+
+ private:
+  struct Node {
+    CharSet edges;
+    int32_t child;   // Children are stored together, by byte
+    int32_t word;    // Index of the word ending here, -1 if none
+    int32_t lowest;  // Lowest index of a word ending here or below
+  };
+
+  std::vector<std::string> m_words;
+  std::vector<Node> m_nodes;
+  bool m_longest;
+};
+
 /**
  * @brief The UnaryToken class represents a token with a inner token.
  */
@@ -143,7 +255,8 @@ class UnaryToken : public Token<TReturn> {
   explicit UnaryToken(ref<TToken> token);
 
  protected:
-  ref<TToken> token() { return m_token; }
+  // Not a ref, so that calls to the inner token don't touch its count
+  TToken *token() { return m_token.operator->(); }
 
  private:
   ref<TToken> m_token;
@@ -158,7 +271,10 @@ class NotToken : public UnaryToken<TToken, std::string> {
  public:
   explicit NotToken(ref<TToken> token);
   ref<std::string> match(const tanuki::String &in) override;
-  Piece<std::string> consume(const tanuki::String &in) override;
+  Piece<std::string> consumeAt(const tanuki::String &in,
+                               uint64_t offset) override;
+  int64_t recognizeAt(const tanuki::String &in, uint64_t offset) override;
+  bool first(CharSet &set) override;
 };
 
 /**
@@ -173,8 +289,48 @@ class PlusToken
   explicit PlusToken(ref<TToken> token);
   ref<std::vector<ref<typename TToken::TReturnType>>> match(
       const tanuki::String &in) override;
-  Piece<std::vector<ref<typename TToken::TReturnType>>> consume(
-      const tanuki::String &in) override;
+  Piece<std::vector<ref<typename TToken::TReturnType>>> consumeAt(
+      const tanuki::String &in, uint64_t offset) override;
+  int64_t recognizeAt(const tanuki::String &in, uint64_t offset) override;
+  bool first(CharSet &set) override;
+  ref<Pattern> pattern() override;
+
+ private:
+  struct Scanner {
+    CharScanner scanner;
+    bool single;
+  };
+
+  const CharScanner *scanner();
+
+  // Runs of a token matching one char of a set are measured by a scanner,
+  // set up when the token is made and again once the inner token is changed
+  Lazy<Scanner> m_scanner;
+};
+
+/**
+ * @brief The Single struct makes the result of a token matching one byte from
+ * the byte alone, for the results it knows.
+ */
+template <typename T>
+struct Single {
+  static const bool known = false;
+
+  static ref<T> make(char) { return ref<T>(); }
+};
+
+template <>
+struct Single<char> {
+  static const bool known = true;
+
+  static ref<char> make(char c) { return make_ref<char>(c); }
+};
+
+template <>
+struct Single<std::string> {
+  static const bool known = true;
+
+  static ref<std::string> make(char c) { return make_ref<std::string>(1, c); }
 };
 
 /**
@@ -190,8 +346,11 @@ class StarToken
   explicit StarToken(ref<TToken> token);
   ref<Optional<ref<std::vector<ref<typename TToken::TReturnType>>>>> match(
       const tanuki::String &in) override;
-  Piece<Optional<ref<std::vector<ref<typename TToken::TReturnType>>>>> consume(
-      const tanuki::String &in) override;
+  Piece<Optional<ref<std::vector<ref<typename TToken::TReturnType>>>>>
+  consumeAt(const tanuki::String &in, uint64_t offset) override;
+  int64_t recognizeAt(const tanuki::String &in, uint64_t offset) override;
+  bool first(CharSet &set) override;
+  ref<Pattern> pattern() override;
 
  private:
   ref<OptionalToken<PlusToken<TToken>>> m_inner;
@@ -207,8 +366,11 @@ class OptionalToken
   explicit OptionalToken(ref<TToken> inner);
   ref<Optional<ref<typename TToken::TReturnType>>> match(
       const tanuki::String &in) override;
-  Piece<Optional<ref<typename TToken::TReturnType>>> consume(
-      const tanuki::String &in) override;
+  Piece<Optional<ref<typename TToken::TReturnType>>> consumeAt(
+      const tanuki::String &in, uint64_t offset) override;
+  int64_t recognizeAt(const tanuki::String &in, uint64_t offset) override;
+  bool first(CharSet &set) override;
+  ref<Pattern> pattern() override;
 };
 
 /**
@@ -219,8 +381,10 @@ class StartWithToken : public UnaryToken<TToken, typename TToken::TReturnType> {
  public:
   explicit StartWithToken(ref<TToken> inner);
   ref<typename TToken::TReturnType> match(const tanuki::String &in) override;
-  Piece<typename TToken::TReturnType> consume(
-      const tanuki::String &in) override;
+  Piece<typename TToken::TReturnType> consumeAt(const tanuki::String &in,
+                                                uint64_t offset) override;
+  int64_t recognizeAt(const tanuki::String &in, uint64_t offset) override;
+  bool first(CharSet &set) override;
 };
 
 /**
@@ -231,8 +395,20 @@ class EndWithToken : public UnaryToken<TToken, typename TToken::TReturnType> {
  public:
   explicit EndWithToken(ref<TToken> inner);
   ref<typename TToken::TReturnType> match(const tanuki::String &in) override;
-  Piece<typename TToken::TReturnType> consume(
-      const tanuki::String &in) override;
+  Piece<typename TToken::TReturnType> consumeAt(const tanuki::String &in,
+                                                uint64_t offset) override;
+  int64_t recognizeAt(const tanuki::String &in, uint64_t offset) override;
+  bool first(CharSet &set) override;
+
+ private:
+  const Finder &finder();
+
+  // Offsets where the inner token can't start are skipped. The finder is
+  // built with the token, and again once the inner token is changed. Inner
+  // tokens without a pattern may reach fragments, for them it is built again
+  // once any grammar changes.
+  Lazy<Finder> m_finder;
+  bool m_regular;
 };
 
 /**
@@ -246,8 +422,10 @@ class RepeatableToken
   explicit RepeatableToken(ref<TToken> inner);
   ref<std::array<typename TToken::TReturnType, size>> match(
       const tanuki::String &in) override;
-  Piece<std::array<typename TToken::TReturnType, size>> consume(
-      const tanuki::String &in) override;
+  Piece<std::array<typename TToken::TReturnType, size>> consumeAt(
+      const tanuki::String &in, uint64_t offset) override;
+  int64_t recognizeAt(const tanuki::String &in, uint64_t offset) override;
+  bool first(CharSet &set) override;
 };
 
 /**
@@ -259,8 +437,9 @@ class BinaryToken : public Token<TReturn> {
   explicit BinaryToken(ref<TLeft> left, ref<TRight> right);
 
  protected:
-  ref<TLeft> left() { return m_left; }
-  ref<TRight> right() { return m_right; }
+  // As UnaryToken::token(), calls don't touch the counts
+  TLeft *left() { return m_left.operator->(); }
+  TRight *right() { return m_right.operator->(); }
 
  private:
   ref<TLeft> m_left;
@@ -275,7 +454,20 @@ class OrToken : public BinaryToken<TLeft, TRight, std::string> {
  public:
   explicit OrToken(ref<TLeft> left, ref<TRight> right);
   ref<std::string> match(const tanuki::String &in) override;
-  Piece<std::string> consume(const tanuki::String &in) override;
+  Piece<std::string> consumeAt(const tanuki::String &in,
+                               uint64_t offset) override;
+  int64_t recognizeAt(const tanuki::String &in, uint64_t offset) override;
+  bool first(CharSet &set) override;
+  ref<Pattern> pattern() override;
+
+ private:
+  TrieToken *trie();
+
+  // Chains of constants are looked up in a trie, built once on first use
+  // by the first thread needing it
+  ref<TrieToken> m_trie;
+  TrieToken *m_lookup;  // nullptr when the chain isn't made of constants
+  std::once_flag m_compiled;
 };
 
 /**
@@ -286,7 +478,10 @@ class AndToken : public BinaryToken<TLeft, TRight, std::string> {
  public:
   explicit AndToken(ref<TLeft> left, ref<TRight> right);
   ref<std::string> match(const tanuki::String &in) override;
-  Piece<std::string> consume(const tanuki::String &in) override;
+  Piece<std::string> consumeAt(const tanuki::String &in,
+                               uint64_t offset) override;
+  int64_t recognizeAt(const tanuki::String &in, uint64_t offset) override;
+  bool first(CharSet &set) override;
 };
 
 /**
@@ -297,7 +492,10 @@ class RangeToken : public Token<std::string> {
  public:
   explicit RangeToken(ref<TLeft> left, ref<TRight> right);
   ref<std::string> match(const tanuki::String &in) override;
-  Piece<std::string> consume(const tanuki::String &in) override;
+  Piece<std::string> consumeAt(const tanuki::String &in,
+                               uint64_t offset) override;
+  int64_t recognizeAt(const tanuki::String &in, uint64_t offset) override;
+  bool first(CharSet &set) override;
 
  private:
   ref<StartWithToken<TLeft>> m_left;
@@ -309,13 +507,103 @@ class WordToken : public Token<std::string> {
  public:
   explicit WordToken(ref<TToken> inner);
   ref<std::string> match(const tanuki::String &in) override;
-  Piece<std::string> consume(const tanuki::String &in) override;
+  Piece<std::string> consumeAt(const tanuki::String &in,
+                               uint64_t offset) override;
+  int64_t recognizeAt(const tanuki::String &in, uint64_t offset) override;
+  bool first(CharSet &set) override;
+  ref<Pattern> pattern() override;
 
  private:
   ref<PlusToken<TToken>> m_inner;
 };
 
 // ------ Method --------
+// Simple
+template <typename TInteger>
+BasicIntegerToken<TInteger>::BasicIntegerToken(bool sign)
+    : Token<TInteger>(),
+      m_sign(sign && std::numeric_limits<TInteger>::is_signed) {
+  static_assert(std::numeric_limits<TInteger>::is_integer &&
+                    (sizeof(TInteger) <= sizeof(uint64_t)),
+                "BasicIntegerToken reads integers of at most 64 bits");
+}
+
+template <typename TInteger>
+int64_t BasicIntegerToken<TInteger>::read(const tanuki::String &in,
+                                          uint64_t offset, TInteger &value) {
+  if (offset >= in.size()) {
+    return -1;
+  }
+
+  const char *data = in.data() + offset;
+  int64_t length = in.size() - offset;
+  bool negative = (m_sign && (data[0] == '-'));
+  uint64_t limit = std::numeric_limits<TInteger>::max();
+  uint64_t magnitude;
+
+  // The lowest value of a signed type is one past its highest one
+  if (negative) {
+    data++;
+    length--;
+    limit++;
+  }
+
+  int64_t digits = readDigits(data, length, limit, magnitude);
+
+  if (digits < 0) {
+    return -1;
+  }
+
+  if (negative) {
+    value = ((magnitude == 0) ? 0 : (-(TInteger)(magnitude - 1) - 1));
+  } else {
+    value = (TInteger)magnitude;
+  }
+
+  return (negative ? (digits + 1) : digits);
+}
+
+template <typename TInteger>
+ref<TInteger> BasicIntegerToken<TInteger>::match(const tanuki::String &in) {
+  TInteger value;
+
+  return ((read(in, 0, value) == (int64_t)in.size())
+              ? make_ref<TInteger>(value)
+              : ref<TInteger>());
+}
+
+template <typename TInteger>
+Piece<TInteger> BasicIntegerToken<TInteger>::consumeAt(
+    const tanuki::String &in, uint64_t offset) {
+  TInteger value;
+  int64_t length = read(in, offset, value);
+
+  if (length < 0) {
+    return Piece<TInteger>{0, ref<TInteger>()};
+  }
+
+  return Piece<TInteger>{(uint64_t)length, make_ref<TInteger>(value)};
+}
+
+template <typename TInteger>
+int64_t BasicIntegerToken<TInteger>::recognizeAt(const tanuki::String &in,
+                                                 uint64_t offset) {
+  TInteger value;
+
+  return read(in, offset, value);
+}
+
+template <typename TInteger>
+bool BasicIntegerToken<TInteger>::first(CharSet &set) {
+  set.add('0', '9');
+
+  if (m_sign) {
+    set.add('-');
+  }
+
+  return false;
+}
+
 // Unary
 template <typename TToken, typename TReturn>
 UnaryToken<TToken, TReturn>::UnaryToken(ref<TToken> token)
@@ -330,27 +618,60 @@ ref<std::string> NotToken<TToken>::match(const tanuki::String &in) {
   if (UnaryToken<TToken, std::string>::token()->match(in)) {
     return ref<std::string>();
   } else {
-    return ref<std::string>(new std::string(in.toStdString()));
+    return make_ref<std::string>(in.toStdString());
   }
 }
 
 template <typename TToken>
-Piece<std::string> NotToken<TToken>::consume(const tanuki::String &in) {
+Piece<std::string> NotToken<TToken>::consumeAt(const tanuki::String &in,
+                                               uint64_t offset) {
   Piece<typename TToken::TReturnType> result(
-      UnaryToken<TToken, std::string>::token()->consume(in));
+      UnaryToken<TToken, std::string>::token()->consumeAt(in, offset));
 
   if (result.result) {
     return Piece<std::string>{
-        result.length, ref<std::string>(new std::string(in.toStdString()))};
+        result.length,
+        make_ref<std::string>(in.substr(offset).toStdString())};
   } else {
     return Piece<std::string>{0, ref<std::string>()};
   }
 }
 
+template <typename TToken>
+int64_t NotToken<TToken>::recognizeAt(const tanuki::String &in,
+                                      uint64_t offset) {
+  return UnaryToken<TToken, std::string>::token()->recognizeAt(in, offset);
+}
+
+template <typename TToken>
+bool NotToken<TToken>::first(CharSet &set) {
+  return UnaryToken<TToken, std::string>::token()->first(set);
+}
+
 template <typename TToken>
 PlusToken<TToken>::PlusToken(ref<TToken> token)
     : UnaryToken<TToken, std::vector<ref<typename TToken::TReturnType>>>(
-          token) {}
+          token) {
+  scanner();
+}
+
+template <typename TToken>
+const CharScanner *PlusToken<TToken>::scanner() {
+  const Scanner &built = m_scanner.get(
+      []() { return Grammar::revision(); },
+      [this]() {
+        ref<Pattern> inner =
+            UnaryToken<TToken,
+                       std::vector<ref<typename TToken::TReturnType>>>::token()
+                ->pattern();
+        CharSet set;
+        bool single = ((bool)inner && inner->single(set));
+
+        return Scanner{CharScanner(set), single};
+      });
+
+  return (built.single ? &built.scanner : nullptr);
+}
 
 template <typename TToken>
 ref<std::vector<ref<typename TToken::TReturnType>>> PlusToken<TToken>::match(
@@ -360,17 +681,17 @@ ref<std::vector<ref<typename TToken::TReturnType>>> PlusToken<TToken>::match(
   }
 
   bool res = true;
-  unsigned int current = 0;
-  unsigned int length = in.size();
+  uint64_t current = 0;
+  uint64_t length = in.size();
 
   ref<std::vector<ref<typename TToken::TReturnType>>> result(
-      new std::vector<ref<typename TToken::TReturnType>>());
+      make_ref<std::vector<ref<typename TToken::TReturnType>>>());
 
   while (current < length) {
     Piece<typename TToken::TReturnType> currentRes =
         UnaryToken<TToken,
                    std::vector<ref<typename TToken::TReturnType>>>::token()
-            ->consume(in.substr(current));
+            ->consumeAt(in, current);
 
     if (currentRes.result) {
       current += currentRes.length;
@@ -390,29 +711,45 @@ ref<std::vector<ref<typename TToken::TReturnType>>> PlusToken<TToken>::match(
 
 template <typename TToken>
 Piece<std::vector<ref<typename TToken::TReturnType>>>
-PlusToken<TToken>::consume(const tanuki::String &in) {
-  if (in.empty()) {
+PlusToken<TToken>::consumeAt(const tanuki::String &in, uint64_t offset) {
+  uint64_t current = offset;
+  uint64_t length = in.size();
+
+  if (current >= length) {
     return Piece<std::vector<ref<typename TToken::TReturnType>>>{
         0, ref<std::vector<ref<typename TToken::TReturnType>>>()};
   }
 
-  uint32_t current = 0;
-  uint32_t length = in.size();
-
   ref<std::vector<ref<typename TToken::TReturnType>>> result(
-      new std::vector<ref<typename TToken::TReturnType>>());
+      make_ref<std::vector<ref<typename TToken::TReturnType>>>());
 
-  while (current < length) {
-    Piece<typename TToken::TReturnType> currentRes =
-        UnaryToken<TToken,
-                   std::vector<ref<typename TToken::TReturnType>>>::token()
-            ->consume(in.substr(current));
+  const CharScanner *scanner = this->scanner();
 
-    if (currentRes.result) {
-      current += currentRes.length;
-      result->push_back(currentRes.result);
-    } else {
-      break;
+  // The run is measured at once, and each result is made from its byte
+  if ((scanner != nullptr) && Single<typename TToken::TReturnType>::known) {
+    int64_t run = scanner->span(in.data() + current, length - current);
+
+    result->reserve(run);
+
+    for (int64_t i = 0; i < run; i++) {
+      result->push_back(
+          Single<typename TToken::TReturnType>::make(in[current + i]));
+    }
+
+    current += run;
+  } else {
+    while (current < length) {
+      Piece<typename TToken::TReturnType> currentRes =
+          UnaryToken<TToken,
+                     std::vector<ref<typename TToken::TReturnType>>>::token()
+              ->consumeAt(in, current);
+
+      if (currentRes.result) {
+        current += currentRes.length;
+        result->push_back(currentRes.result);
+      } else {
+        break;
+      }
     }
   }
 
@@ -420,11 +757,62 @@ PlusToken<TToken>::consume(const tanuki::String &in) {
     return Piece<std::vector<ref<typename TToken::TReturnType>>>{
         0, ref<std::vector<ref<typename TToken::TReturnType>>>()};
   } else {
-    return Piece<std::vector<ref<typename TToken::TReturnType>>>{current,
-                                                                 result};
+    return Piece<std::vector<ref<typename TToken::TReturnType>>>{
+        current - offset, result};
   }
 }
 
+template <typename TToken>
+int64_t PlusToken<TToken>::recognizeAt(const tanuki::String &in,
+                                       uint64_t offset) {
+  uint64_t current = offset;
+  uint64_t length = in.size();
+  bool matched = false;
+
+  if (scanner() != nullptr) {
+    int64_t run = ((current < length)
+                   ? scanner()->span(in.data() + current, length - current)
+                   : 0);
+
+    return ((run > 0) ? run : -1);
+  }
+
+  while (current < length) {
+    int64_t sub =
+        UnaryToken<TToken,
+                   std::vector<ref<typename TToken::TReturnType>>>::token()
+            ->recognizeAt(in, current);
+
+    if (sub < 0) {
+      break;
+    }
+
+    current += sub;
+    matched = true;
+  }
+
+  return (matched ? (int64_t)(current - offset) : -1);
+}
+
+template <typename TToken>
+bool PlusToken<TToken>::first(CharSet &set) {
+  return UnaryToken<TToken,
+                    std::vector<ref<typename TToken::TReturnType>>>::token()
+      ->first(set);
+}
+
+template <typename TToken>
+ref<Pattern> PlusToken<TToken>::pattern() {
+  ref<Pattern> inner =
+      UnaryToken<TToken,
+                 std::vector<ref<typename TToken::TReturnType>>>::token()
+          ->pattern();
+
+  return (inner ? make_ref<Pattern>(Pattern::Plus,
+                                    std::vector<ref<Pattern>>{inner})
+                : ref<Pattern>());
+}
+
 template <typename TToken>
 StarToken<TToken>::StarToken(ref<TToken> token)
     : UnaryToken<TToken,
@@ -440,8 +828,24 @@ StarToken<TToken>::match(const tanuki::String &in) {
 
 template <typename TToken>
 Piece<Optional<ref<std::vector<ref<typename TToken::TReturnType>>>>>
-StarToken<TToken>::consume(const tanuki::String &in) {
-  return m_inner->consume(in);
+StarToken<TToken>::consumeAt(const tanuki::String &in, uint64_t offset) {
+  return m_inner->consumeAt(in, offset);
+}
+
+template <typename TToken>
+int64_t StarToken<TToken>::recognizeAt(const tanuki::String &in,
+                                       uint64_t offset) {
+  return m_inner->recognizeAt(in, offset);
+}
+
+template <typename TToken>
+bool StarToken<TToken>::first(CharSet &set) {
+  return m_inner->first(set);
+}
+
+template <typename TToken>
+ref<Pattern> StarToken<TToken>::pattern() {
+  return m_inner->pattern();
 }
 
 template <typename TToken>
@@ -452,7 +856,7 @@ template <typename TToken>
 ref<Optional<ref<typename TToken::TReturnType>>> OptionalToken<TToken>::match(
     const tanuki::String &in) {
   ref<Optional<ref<typename TToken::TReturnType>>> result(
-      new Optional<ref<typename TToken::TReturnType>>());
+      make_ref<Optional<ref<typename TToken::TReturnType>>>());
   ref<typename TToken::TReturnType> subresult = this->token()->match(in);
 
   if (subresult) {
@@ -464,10 +868,11 @@ ref<Optional<ref<typename TToken::TReturnType>>> OptionalToken<TToken>::match(
 
 template <typename TToken>
 Piece<Optional<ref<typename TToken::TReturnType>>>
-OptionalToken<TToken>::consume(const tanuki::String &in) {
+OptionalToken<TToken>::consumeAt(const tanuki::String &in, uint64_t offset) {
   Piece<Optional<ref<typename TToken::TReturnType>>> result{
-      0, new Optional<ref<typename TToken::TReturnType>>()};
-  Piece<typename TToken::TReturnType> subresult = this->token()->consume(in);
+      0, make_ref<Optional<ref<typename TToken::TReturnType>>>()};
+  Piece<typename TToken::TReturnType> subresult =
+      this->token()->consumeAt(in, offset);
 
   if (subresult) {
     result.length = subresult.length;
@@ -477,6 +882,30 @@ OptionalToken<TToken>::consume(const tanuki::String &in) {
   return result;
 }
 
+template <typename TToken>
+int64_t OptionalToken<TToken>::recognizeAt(const tanuki::String &in,
+                                           uint64_t offset) {
+  int64_t sub = this->token()->recognizeAt(in, offset);
+
+  return ((sub < 0) ? 0 : sub);
+}
+
+template <typename TToken>
+bool OptionalToken<TToken>::first(CharSet &set) {
+  this->token()->first(set);
+
+  return true;
+}
+
+template <typename TToken>
+ref<Pattern> OptionalToken<TToken>::pattern() {
+  ref<Pattern> inner = this->token()->pattern();
+
+  return (inner ? make_ref<Pattern>(Pattern::Optional,
+                                    std::vector<ref<Pattern>>{inner})
+                : ref<Pattern>());
+}
+
 template <typename TToken>
 StartWithToken<TToken>::StartWithToken(ref<TToken> token)
     : UnaryToken<TToken, typename TToken::TReturnType>(token) {}
@@ -495,10 +924,11 @@ ref<typename TToken::TReturnType> StartWithToken<TToken>::match(
 }
 
 template <typename TToken>
-Piece<typename TToken::TReturnType> StartWithToken<TToken>::consume(
-    const tanuki::String &in) {
+Piece<typename TToken::TReturnType> StartWithToken<TToken>::consumeAt(
+    const tanuki::String &in, uint64_t offset) {
   Piece<typename TToken::TReturnType> result =
-      UnaryToken<TToken, typename TToken::TReturnType>::token()->consume(in);
+      UnaryToken<TToken, typename TToken::TReturnType>::token()->consumeAt(
+          in, offset);
 
   if (result.result) {
     return result;
@@ -508,9 +938,50 @@ Piece<typename TToken::TReturnType> StartWithToken<TToken>::consume(
   }
 }
 
+template <typename TToken>
+int64_t StartWithToken<TToken>::recognizeAt(const tanuki::String &in,
+                                            uint64_t offset) {
+  return UnaryToken<TToken, typename TToken::TReturnType>::token()->recognizeAt(
+      in, offset);
+}
+
+template <typename TToken>
+bool StartWithToken<TToken>::first(CharSet &set) {
+  return UnaryToken<TToken, typename TToken::TReturnType>::token()->first(set);
+}
+
 template <typename TToken>
 EndWithToken<TToken>::EndWithToken(ref<TToken> token)
-    : UnaryToken<TToken, typename TToken::TReturnType>(token) {}
+    : UnaryToken<TToken, typename TToken::TReturnType>(token),
+      m_regular((bool)token->pattern()) {
+  finder();
+}
+
+template <typename TToken>
+const Finder &EndWithToken<TToken>::finder() {
+  auto version = [this]() {
+    return (m_regular ? Grammar::revision() : Grammar::epoch());
+  };
+
+  return m_finder.get(version, [this]() {
+    auto token = UnaryToken<TToken, typename TToken::TReturnType>::token();
+    ref<Pattern> pattern = token->pattern();
+    std::string literal;
+    CharSet first;
+
+    if ((bool)pattern) {
+      pattern->prefix(literal);
+    }
+
+    if (!literal.empty()) {
+      return Finder(literal);
+    } else if (!token->first(first)) {
+      return Finder(first);
+    } else {
+      return Finder();
+    }
+  });
+}
 
 template <typename TToken>
 ref<typename TToken::TReturnType> EndWithToken<TToken>::match(
@@ -520,15 +991,15 @@ ref<typename TToken::TReturnType> EndWithToken<TToken>::match(
   }
 
   int exactSize =
-      UnaryToken<TToken, typename TToken::TReturnType>::token().exactSize();
-  int length = in.size();
+      UnaryToken<TToken, typename TToken::TReturnType>::token()->exactSize();
+  int64_t length = in.size();
 
   if (exactSize == -1) {
     ref<typename TToken::TReturnType> result;
 
-    int biggestSize =
-        UnaryToken<TToken, typename TToken::TReturnType>::token().biggestSize();
-    int minimum;
+    int biggestSize = UnaryToken<TToken, typename TToken::TReturnType>::token()
+                          ->biggestSize();
+    int64_t minimum;
 
     if (biggestSize == -1) {
       minimum = 0;
@@ -554,7 +1025,7 @@ ref<typename TToken::TReturnType> EndWithToken<TToken>::match(
 
     return result;
   } else {
-    int delta = (in.size() - exactSize);
+    int64_t delta = (in.size() - exactSize);
 
     if (delta < 0) {
       return ref<typename TToken::TReturnType>();
@@ -573,18 +1044,20 @@ ref<typename TToken::TReturnType> EndWithToken<TToken>::match(
 }
 
 template <typename TToken>
-Piece<typename TToken::TReturnType> EndWithToken<TToken>::consume(
-    const tanuki::String &in) {
-  int length = in.size();
+Piece<typename TToken::TReturnType> EndWithToken<TToken>::consumeAt(
+    const tanuki::String &in, uint64_t offset) {
+  int64_t length = in.size();
+  const Finder &next = finder();
   Piece<typename TToken::TReturnType> result;
 
-  for (int i = 0; i < length; i++) {
+  for (int64_t i = next.find(in.data(), length, offset); i < length;
+       i = next.find(in.data(), length, i + 1)) {
     result =
-        (UnaryToken<TToken, typename TToken::TReturnType>::token()->consume(
-            in.substr(i)));
+        (UnaryToken<TToken, typename TToken::TReturnType>::token()->consumeAt(
+            in, i));
 
     if (result.result) {
-      result.length += i;  // We need to keep size of consume
+      result.length += (i - offset);  // We need to keep size of consume
       break;
     }
   }
@@ -592,6 +1065,37 @@ Piece<typename TToken::TReturnType> EndWithToken<TToken>::consume(
   return result;
 }
 
+template <typename TToken>
+int64_t EndWithToken<TToken>::recognizeAt(const tanuki::String &in,
+                                          uint64_t offset) {
+  int64_t length = in.size();
+  const Finder &next = finder();
+
+  for (int64_t i = next.find(in.data(), length, offset); i < length;
+       i = next.find(in.data(), length, i + 1)) {
+    int64_t sub =
+        (UnaryToken<TToken, typename TToken::TReturnType>::token()->recognizeAt(
+            in, i));
+
+    if (sub >= 0) {
+      return (sub + (i - offset));
+    }
+  }
+
+  return -1;
+}
+
+template <typename TToken>
+bool EndWithToken<TToken>::first(CharSet &set) {
+  CharSet inner;
+
+  // The inner token is looked for further in the input
+  set.fill();
+
+  return UnaryToken<TToken, typename TToken::TReturnType>::token()->first(
+      inner);
+}
+
 template <typename TToken, std::size_t size>
 RepeatableToken<TToken, size>::RepeatableToken(ref<TToken> token)
     : UnaryToken<TToken, std::array<typename TToken::TReturnType, size>>(
@@ -603,17 +1107,17 @@ RepeatableToken<TToken, size>::match(const tanuki::String &in) {
   std::array<typename TToken::TReturnType, size> result;
 
   std::size_t index = 0;
-  tanuki::String current = in;
+  uint64_t current = 0;
 
   while (index < size) {
     Piece<typename TToken::TReturnType> buffer =
         UnaryToken<TToken,
                    std::array<typename TToken::TReturnType, size>>::token()
-            ->consume(current);
+            ->consumeAt(in, current);
 
     if (buffer.result) {
       result[index] = buffer.result;
-      current = current.substr(buffer.length);
+      current += buffer.length;
 
       index++;
     } else {
@@ -621,9 +1125,8 @@ RepeatableToken<TToken, size>::match(const tanuki::String &in) {
     }
   }
 
-  if (index == size && current.empty()) {
-    return ref<std::array<typename TToken::TReturnType, size>>(
-        new std::array<typename TToken::TReturnType, size>(result));
+  if (index == size && current >= in.size()) {
+    return make_ref<std::array<typename TToken::TReturnType, size>>(result);
   } else {
     return ref<std::array<typename TToken::TReturnType, size>>();
   }
@@ -631,22 +1134,21 @@ RepeatableToken<TToken, size>::match(const tanuki::String &in) {
 
 template <typename TToken, std::size_t size>
 Piece<std::array<typename TToken::TReturnType, size>>
-RepeatableToken<TToken, size>::consume(const tanuki::String &in) {
+RepeatableToken<TToken, size>::consumeAt(const tanuki::String &in,
+                                         uint64_t offset) {
   std::array<typename TToken::TReturnType, size> result;
 
   std::size_t index = 0;
-  uint32_t matchSize = 0;
-  tanuki::String current = in;
+  uint64_t matchSize = 0;
 
   while (index < size) {
     Piece<typename TToken::TReturnType> buffer =
         UnaryToken<TToken,
                    std::array<typename TToken::TReturnType, size>>::token()
-            ->consume(current);
+            ->consumeAt(in, offset + matchSize);
 
     if (buffer.result) {
       result[index] = buffer.result;
-      current = current.substr(buffer.length);
       matchSize += buffer.length;
 
       index++;
@@ -655,17 +1157,47 @@ RepeatableToken<TToken, size>::consume(const tanuki::String &in) {
     }
   }
 
-  if (index == size && current.empty()) {
+  if (index == size && (offset + matchSize) >= in.size()) {
     return Piece<std::array<typename TToken::TReturnType, size>>{
         matchSize,
-        ref<std::array<typename TToken::TReturnType, size>>(
-            new std::array<typename TToken::TReturnType, size>(result))};
+        make_ref<std::array<typename TToken::TReturnType, size>>(result)};
   } else {
     return Piece<std::array<typename TToken::TReturnType, size>>{
         0, ref<std::array<typename TToken::TReturnType, size>>()};
   }
 }
 
+template <typename TToken, std::size_t size>
+int64_t RepeatableToken<TToken, size>::recognizeAt(const tanuki::String &in,
+                                                   uint64_t offset) {
+  uint64_t matchSize = 0;
+
+  for (std::size_t index = 0; index < size; index++) {
+    int64_t sub =
+        UnaryToken<TToken,
+                   std::array<typename TToken::TReturnType, size>>::token()
+            ->recognizeAt(in, offset + matchSize);
+
+    if (sub < 0) {
+      return -1;
+    }
+
+    matchSize += sub;
+  }
+
+  return (((offset + matchSize) >= in.size()) ? (int)matchSize : -1);
+}
+
+template <typename TToken, std::size_t size>
+bool RepeatableToken<TToken, size>::first(CharSet &set) {
+  bool nullable =
+      UnaryToken<TToken,
+                 std::array<typename TToken::TReturnType, size>>::token()
+          ->first(set);
+
+  return (nullable || (size == 0));
+}
+
 // Binary
 template <typename TLeft, typename TRight, typename TReturn>
 BinaryToken<TLeft, TRight, TReturn>::BinaryToken(ref<TLeft> left,
@@ -674,21 +1206,42 @@ BinaryToken<TLeft, TRight, TReturn>::BinaryToken(ref<TLeft> left,
 
 template <typename TLeft, typename TRight>
 OrToken<TLeft, TRight>::OrToken(ref<TLeft> left, ref<TRight> right)
-    : BinaryToken<TLeft, TRight, std::string>(left, right) {}
+    : BinaryToken<TLeft, TRight, std::string>(left, right),
+      m_lookup(nullptr) {}
+
+template <typename TLeft, typename TRight>
+TrieToken *OrToken<TLeft, TRight>::trie() {
+  std::call_once(m_compiled, [this]() {
+    std::vector<std::string> words;
+
+    // Shorter chains are as fast compared one by one. The trie may be built
+    // during a parse, out of its arena.
+    if (TrieToken::literals(pattern(), words) && (words.size() >= 4)) {
+      m_trie = ref<TrieToken>(new TrieToken(words, false));
+      m_lookup = dereference(m_trie);
+    }
+  });
+
+  return m_lookup;
+}
 
 template <typename TLeft, typename TRight>
 ref<std::string> OrToken<TLeft, TRight>::match(const tanuki::String &in) {
+  if (trie() != nullptr) {
+    return trie()->match(in);
+  }
+
   ref<typename TLeft::TReturnType> leftResult =
       (BinaryToken<TLeft, TRight, std::string>::left()->match(in));
 
   if (leftResult) {
-    return ref<std::string>(new std::string(in.toStdString()));
+    return make_ref<std::string>(in.toStdString());
   } else {
     ref<typename TRight::TReturnType> rightResult =
         (BinaryToken<TLeft, TRight, std::string>::right()->match(in));
 
     if (rightResult) {
-      return ref<std::string>(new std::string(in.toStdString()));
+      return make_ref<std::string>(in.toStdString());
     } else {
       return ref<std::string>();
     }
@@ -696,29 +1249,75 @@ ref<std::string> OrToken<TLeft, TRight>::match(const tanuki::String &in) {
 }
 
 template <typename TLeft, typename TRight>
-Piece<std::string> OrToken<TLeft, TRight>::consume(const tanuki::String &in) {
+Piece<std::string> OrToken<TLeft, TRight>::consumeAt(const tanuki::String &in,
+                                                     uint64_t offset) {
+  if (trie() != nullptr) {
+    return trie()->consumeAt(in, offset);
+  }
+
   Piece<typename TLeft::TReturnType> leftResult =
-      (BinaryToken<TLeft, TRight, std::string>::left()->consume(in));
+      (BinaryToken<TLeft, TRight, std::string>::left()->consumeAt(in, offset));
 
   if (leftResult.result) {
     return Piece<std::string>{
-        leftResult.length, ref<std::string>(new std::string(
-                               in.substr(0, leftResult.length).toStdString()))};
+        leftResult.length,
+        make_ref<std::string>(in.data() + offset, leftResult.length)};
   } else {
     Piece<typename TRight::TReturnType> rightResult =
-        (BinaryToken<TLeft, TRight, std::string>::right()->consume(in));
+        (BinaryToken<TLeft, TRight, std::string>::right()->consumeAt(in,
+                                                                     offset));
 
     if (rightResult.result) {
       return Piece<std::string>{
           rightResult.length,
-          ref<std::string>(
-              new std::string(in.substr(0, rightResult.length).toStdString()))};
+          make_ref<std::string>(in.data() + offset, rightResult.length)};
     } else {
       return Piece<std::string>{0, ref<std::string>()};
     }
   }
 }
 
+template <typename TLeft, typename TRight>
+int64_t OrToken<TLeft, TRight>::recognizeAt(const tanuki::String &in,
+                                            uint64_t offset) {
+  if (trie() != nullptr) {
+    return trie()->recognizeAt(in, offset);
+  }
+
+  int64_t left =
+      BinaryToken<TLeft, TRight, std::string>::left()->recognizeAt(in, offset);
+
+  if (left >= 0) {
+    return left;
+  } else {
+    return BinaryToken<TLeft, TRight, std::string>::right()->recognizeAt(
+        in, offset);
+  }
+}
+
+template <typename TLeft, typename TRight>
+bool OrToken<TLeft, TRight>::first(CharSet &set) {
+  bool left = BinaryToken<TLeft, TRight, std::string>::left()->first(set);
+  bool right = BinaryToken<TLeft, TRight, std::string>::right()->first(set);
+
+  return (left || right);
+}
+
+template <typename TLeft, typename TRight>
+ref<Pattern> OrToken<TLeft, TRight>::pattern() {
+  ref<Pattern> left =
+      BinaryToken<TLeft, TRight, std::string>::left()->pattern();
+  ref<Pattern> right =
+      BinaryToken<TLeft, TRight, std::string>::right()->pattern();
+
+  if (!(bool)left || !(bool)right) {
+    return ref<Pattern>();
+  }
+
+  return make_ref<Pattern>(Pattern::Choice,
+                           std::vector<ref<Pattern>>{left, right});
+}
+
 template <typename TLeft, typename TRight>
 AndToken<TLeft, TRight>::AndToken(ref<TLeft> left, ref<TRight> right)
     : BinaryToken<TLeft, TRight, std::string>(left, right) {}
@@ -733,7 +1332,7 @@ ref<std::string> AndToken<TLeft, TRight>::match(const tanuki::String &in) {
         BinaryToken<TLeft, TRight, std::string>::right()->match(in);
 
     if (rightResult) {
-      return ref<std::string>(new std::string(in.toStdString()));
+      return make_ref<std::string>(in.toStdString());
     } else {
       return ref<std::string>();
     }
@@ -743,19 +1342,21 @@ ref<std::string> AndToken<TLeft, TRight>::match(const tanuki::String &in) {
 }
 
 template <typename TLeft, typename TRight>
-Piece<std::string> AndToken<TLeft, TRight>::consume(const tanuki::String &in) {
+Piece<std::string> AndToken<TLeft, TRight>::consumeAt(const tanuki::String &in,
+                                                      uint64_t offset) {
   Piece<typename TLeft::TReturnType> leftResult =
-      (BinaryToken<TLeft, TRight, std::string>::left()->consume(in));
+      (BinaryToken<TLeft, TRight, std::string>::left()->consumeAt(in, offset));
 
   if (leftResult.result) {
     Piece<typename TRight::TReturnType> rightResult =
-        (BinaryToken<TLeft, TRight, std::string>::right()->consume(in));
+        (BinaryToken<TLeft, TRight, std::string>::right()->consumeAt(in,
+                                                                     offset));
 
     if (rightResult.result) {
       if (leftResult.length == rightResult.length) {
         return Piece<std::string>{
             leftResult.length,
-            new std::string(in.substr(0, rightResult.length).toStdString())};
+            make_ref<std::string>(in.data() + offset, rightResult.length)};
       } else {
         return Piece<std::string>{0, ref<std::string>()};
       }
@@ -767,6 +1368,33 @@ Piece<std::string> AndToken<TLeft, TRight>::consume(const tanuki::String &in) {
   }
 }
 
+template <typename TLeft, typename TRight>
+int64_t AndToken<TLeft, TRight>::recognizeAt(const tanuki::String &in,
+                                             uint64_t offset) {
+  int64_t left =
+      BinaryToken<TLeft, TRight, std::string>::left()->recognizeAt(in, offset);
+
+  if (left < 0) {
+    return -1;
+  }
+
+  int64_t right =
+      BinaryToken<TLeft, TRight, std::string>::right()->recognizeAt(in, offset);
+
+  return ((left == right) ? left : -1);
+}
+
+template <typename TLeft, typename TRight>
+bool AndToken<TLeft, TRight>::first(CharSet &set) {
+  CharSet right;
+
+  // Both sides consume the same input, the left one is enough to start with
+  bool nullable = BinaryToken<TLeft, TRight, std::string>::left()->first(set);
+
+  return (BinaryToken<TLeft, TRight, std::string>::right()->first(right) &&
+          nullable);
+}
+
 template <typename TLeft, typename TRight>
 RangeToken<TLeft, TRight>::RangeToken(ref<TLeft> left, ref<TRight> right)
     : Token<std::string>(), m_left(startWith(left)), m_right(endWith(right)) {}
@@ -777,7 +1405,7 @@ ref<std::string> RangeToken<TLeft, TRight>::match(const tanuki::String &in) {
 
   if (m_left->match(in)) {
     if (m_right->match(in)) {
-      result = ref<std::string>(new std::string(in.toStdString()));
+      result = make_ref<std::string>(in.toStdString());
     }
   }
 
@@ -785,52 +1413,87 @@ ref<std::string> RangeToken<TLeft, TRight>::match(const tanuki::String &in) {
 }
 
 template <typename TLeft, typename TRight>
-Piece<std::string> RangeToken<TLeft, TRight>::consume(
-    const tanuki::String &in) {
+Piece<std::string> RangeToken<TLeft, TRight>::consumeAt(
+    const tanuki::String &in, uint64_t offset) {
   Piece<std::string> result;
 
-  if (m_left->consume(in).result) {
-    auto right = m_right->consume(in);
+  if (m_left->consumeAt(in, offset).result) {
+    auto right = m_right->consumeAt(in, offset);
 
     if (right.result) {
       result = Piece<std::string>{
-          right.length, ref<std::string>(new std::string(
-                            in.substr(0, right.length).toStdString()))};
+          right.length,
+          make_ref<std::string>(in.data() + offset, right.length)};
     }
   }
 
   return result;
 }
 
+template <typename TLeft, typename TRight>
+int64_t RangeToken<TLeft, TRight>::recognizeAt(const tanuki::String &in,
+                                               uint64_t offset) {
+  if (m_left->recognizeAt(in, offset) < 0) {
+    return -1;
+  }
+
+  return m_right->recognizeAt(in, offset);
+}
+
+template <typename TLeft, typename TRight>
+bool RangeToken<TLeft, TRight>::first(CharSet &set) {
+  CharSet left, right;
+
+  // Only the left token is checked at the start, the range ends with the right
+  if (m_left->first(left)) {
+    set.fill();
+  } else {
+    set.merge(left);
+  }
+
+  return m_right->first(right);
+}
+
 template <typename TToken>
 WordToken<TToken>::WordToken(ref<TToken> inner)
     : Token<std::string>(), m_inner(+inner) {}
 
 template <typename TToken>
 ref<std::string> WordToken<TToken>::match(const tanuki::String &in) {
-  ref<std::vector<ref<typename TToken::TReturnType>>> result(
-      m_inner->match(in));
-
-  if (result) {
-    return ref<std::string>(new std::string(in.toStdString()));
+  // Only the length matters, the inner results are never built
+  if (!in.empty() && (m_inner->recognizeAt(in, 0) == (int64_t)in.size())) {
+    return make_ref<std::string>(in.toStdString());
   } else {
     return ref<std::string>();
   }
 }
 
 template <typename TToken>
-Piece<std::string> WordToken<TToken>::consume(const tanuki::String &in) {
-  Piece<std::vector<ref<typename TToken::TReturnType>>> result(
-      m_inner->consume(in));
-
-  if (result.result) {
-    int length = result.length;
+Piece<std::string> WordToken<TToken>::consumeAt(const tanuki::String &in,
+                                                uint64_t offset) {
+  int64_t length = m_inner->recognizeAt(in, offset);
 
+  if (length >= 0) {
     return Piece<std::string>{
-        result.length,
-        ref<std::string>(new std::string(in.substr(0, length).toStdString()))};
+        (uint64_t)length, make_ref<std::string>(in.data() + offset, length)};
   } else {
     return Piece<std::string>{0, ref<std::string>()};
   }
 }
+
+template <typename TToken>
+int64_t WordToken<TToken>::recognizeAt(const tanuki::String &in,
+                                       uint64_t offset) {
+  return m_inner->recognizeAt(in, offset);
+}
+
+template <typename TToken>
+bool WordToken<TToken>::first(CharSet &set) {
+  return m_inner->first(set);
+}
+
+template <typename TToken>
+ref<Pattern> WordToken<TToken>::pattern() {
+  return m_inner->pattern();
+}
 }
@@ -1,31 +1,39 @@
 #pragma once
 
-#define use_tanuki              \
-  using tanuki::constant;       \
-  using tanuki::integer;        \
-  using tanuki::startWith;      \
-  using tanuki::endWith;        \
-  using tanuki::range;          \
-  using tanuki::anyOf;          \
-  using tanuki::consequent;     \
-  using tanuki::anyIn;          \
-  using tanuki::repeat;         \
-  using tanuki::word;           \
-  using tanuki::space;          \
-  using tanuki::tab;            \
-  using tanuki::blank;          \
-  using tanuki::lineTerminator; \
-  using tanuki::digit;          \
-  using tanuki::letter;         \
-  using tanuki::fragment;       \
-                                \
-  using tanuki::Fragment;       \
-                                \
-  using tanuki::ref;            \
-  using tanuki::dereference;    \
-  using tanuki::autoref;        \
-  using tanuki::master;         \
-                                \
+#define use_tanuki                   \
+  using tanuki::constant;            \
+  using tanuki::integer;             \
+  using tanuki::floating;            \
+  using tanuki::startWith;           \
+  using tanuki::endWith;             \
+  using tanuki::range;               \
+  using tanuki::anyOf;               \
+  using tanuki::consequent;          \
+  using tanuki::anyIn;               \
+  using tanuki::keywords;            \
+  using tanuki::dictionary;          \
+  using tanuki::repeat;              \
+  using tanuki::word;                \
+  using tanuki::compile;             \
+  using tanuki::space;               \
+  using tanuki::tab;                 \
+  using tanuki::blank;               \
+  using tanuki::lineTerminator;      \
+  using tanuki::digit;               \
+  using tanuki::letter;              \
+  using tanuki::fragment;            \
+                                     \
+  using tanuki::Fragment;            \
+  using tanuki::Policy;              \
+  using tanuki::Program;             \
+  namespace direct = tanuki::direct; \
+                                     \
+  using tanuki::ref;                 \
+  using tanuki::dereference;         \
+  using tanuki::autoref;             \
+  using tanuki::master;              \
+  using tanuki::make_ref;            \
+                                     \
   using tanuki::operator"" _ref;
 
 #include <iostream>
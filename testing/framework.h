@@ -17,7 +17,7 @@ std::vector<std::string> tanuki_tests_names_stack;
   if (!tanuki_tests_names_stack.empty()) {                                   \
     std::cout << "|";                                                        \
   }                                                                          \
-  for (int i = 0; i < tanuki_tests_names_stack.size(); i++) {                \
+  for (size_t i = 0; i < tanuki_tests_names_stack.size(); i++) {              \
     std::cout << "=";                                                        \
   }                                                                          \
   if (!tanuki_tests_names_stack.empty()) {                                   \
@@ -43,7 +43,7 @@ std::vector<std::string> tanuki_tests_names_stack;
   if (!tanuki_tests_names_stack.empty()) {                                   \
     std::cout << "|";                                                        \
   }                                                                          \
-  for (int i = 0; i < tanuki_tests_names_stack.size(); i++) {                \
+  for (size_t i = 0; i < tanuki_tests_names_stack.size(); i++) {              \
     std::cout << "=";                                                        \
   }                                                                          \
   if (!tanuki_tests_names_stack.empty()) {                                   \
@@ -0,0 +1,48 @@
+#include <fstream>
+#include <iostream>
+
+#include "grammars.h"
+
+// TanukiRecognizers, writes the recognizers of the grammars of grammars.h
+// into a header, see tanuki_generate
+int main(int argc, char **argv) {
+  use_tanuki;
+
+  if (argc != 2) {
+    std::cerr << "Usage: TanukiRecognizers <header>" << std::endl;
+
+    return 1;
+  }
+
+  ref<Fragment<int>> sum = fragment<int>();
+  ref<Fragment<int>> term = fragment<int>();
+  ref<Fragment<int>> memoSum = fragment<int>();
+  ref<Fragment<int>> memoTerm = fragment<int>();
+  ref<Fragment<int>> nested = fragment<int>();
+  ref<Fragment<int>> tag = fragment<int>();
+  master(sum);
+  master(memoSum);
+  master(nested);
+
+  sumGrammar(sum, term);
+  // As a Token, the integer has no pattern and is left to a native, which
+  // the tests count the calls of
+  sumGrammar(memoSum, memoTerm, ref<tanuki::Token<int>>(integer()));
+  memoSum->memoize = true;
+  memoTerm->memoize = true;
+  nestedGrammar(nested);
+  tagGrammar(tag);
+
+  std::ofstream out(argv[1]);
+
+  out << "#pragma once\n\n";
+  sum->program()->generateRecognizer(out, "SumRecognizer");
+  out << "\n";
+  memoSum->program()->generateRecognizer(out, "MemoSumRecognizer", true);
+  out << "\n";
+  nested->program()->generateRecognizer(out, "NestedRecognizer");
+  out << "\n";
+  tag->program()->generateRecognizer(out, "TagRecognizer", true);
+
+  return (out ? 0 : 1);
+}
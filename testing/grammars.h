@@ -0,0 +1,47 @@
+#pragma once
+
+#include "../tanuki/tanuki.h"
+
+// Grammars tested both as they are and through the recognizers
+// TanukiRecognizers writes for them into generated.h
+
+template <typename TNumber>
+inline void sumGrammar(tanuki::ref<tanuki::Fragment<int>> &sum,
+                       tanuki::ref<tanuki::Fragment<int>> &term,
+                       tanuki::ref<TNumber> number) {
+  use_tanuki;
+
+  term->handle([](ref<int> i) { return i; }, number);
+  term->handle([](ref<char>, ref<int> i, ref<char>) { return i; },
+               constant('('), sum, constant(')'));
+  sum->handle([](ref<int> i) { return i; }, term);
+  sum->handle(
+      [](ref<int> i, ref<char>, ref<int> j) -> ref<int> { return (i + j); },
+      term, constant('+'), sum);
+  sum->skip(blank());
+  term->skip(blank());
+}
+
+inline void sumGrammar(tanuki::ref<tanuki::Fragment<int>> &sum,
+                       tanuki::ref<tanuki::Fragment<int>> &term) {
+  sumGrammar(sum, term, tanuki::integer());
+}
+
+inline void nestedGrammar(tanuki::ref<tanuki::Fragment<int>> &nested) {
+  use_tanuki;
+
+  nested->handle([](ref<char>) { return make_ref<int>(0); }, constant('x'));
+  nested->handle(
+      [](ref<char>, ref<int> i, ref<char>) {
+        return make_ref<int>(*dereference(i) + 1);
+      },
+      constant('('), nested, constant(')'));
+}
+
+// The range has no pattern, so it is left to a native
+inline void tagGrammar(tanuki::ref<tanuki::Fragment<int>> &tag) {
+  use_tanuki;
+
+  tag->handle([](ref<char>, ref<std::string>) { return make_ref<int>(0); },
+              constant('#'), range(constant('<'), constant('>')));
+}
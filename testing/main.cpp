@@ -3,15 +3,37 @@
 #include "../tanuki/tanuki.h"
 
 #include "framework.h"
-
+#include "generated.h"
+#include "grammars.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <list>
+#include <memory>
+#include <sstream>
+#include <thread>
 #include <tuple>
+#include <type_traits>
+
+#include <sys/stat.h>
 
 void testRef();
+void testString();
 void testLexer();
 void testLexerConstant();
 void testLexerSimple();
 void testLexerUnary();
 void testLexerBinary();
+void testLexerOffset();
+void testLexerAutomaton();
+void testLexerKeywords();
+void testLexerDictionary();
+void testLexerRuns();
+void testLexerIntegers();
+void testLexerFloating();
+void testLexerSearch();
+void testLexerDirect();
 
 void testGrammar();
 void testGrammarSelect();
@@ -20,9 +42,23 @@ void testGrammarMultiple();
 void testGrammarFunny();
 void testGrammarWithOperator();
 void testGrammarLeftRecursive();
-
-int main(int argc, char* argv[]) {
+void testGrammarPackrat();
+void testGrammarSeedGrowing();
+void testGrammarFile();
+void testGrammarArena();
+void testGrammarRecognize();
+void testGrammarDeferred();
+void testGrammarFirst();
+void testGrammarFactoring();
+void testGrammarFirstMatch();
+void testGrammarSkip();
+void testGrammarCallbacks();
+void testGrammarProgram();
+void testGrammarGenerated();
+
+int main() {
   tanuki_run("Ref", testRef);
+  tanuki_run("String", testString);
   tanuki_run("Lexer", testLexer);
   tanuki_run("Grammar", testGrammar);
 
@@ -34,6 +70,74 @@ void testRef() {
 
   tanuki_result_expect(10, ref<int>(new int(5)) + ref<int>(new int(5)),
                        "Add int")
+  tanuki_result_expect(10, make_ref<int>(5) + make_ref<int>(5),
+                       "Add in place int")
+
+  ref<std::string> made = make_ref<std::string>("tanuki");
+  ref<std::string> shared = made;
+  bool thrown = false;
+
+  try {
+    made.release();
+  } catch (const NotReleasableError&) {
+    thrown = true;
+  }
+
+  tanuki_match_expect(true, thrown, "Release in place");
+  tanuki_match_expect(true, (shared->compare("tanuki") == 0),
+                      "Release in place keep other refs");
+
+  ref<std::string> heap(new std::string("tanuki"));
+  std::string* released = heap.release();
+  tanuki_match_expect(true, (heap.isNull() && (*released == "tanuki")),
+                      "Release");
+
+  delete released;
+
+  struct Base {
+    virtual ~Base() = default;
+  };
+  struct Derived : public Base {};
+
+  ref<Derived> derived = make_ref<Derived>();
+  ref<Base> base = derived;
+  tanuki_match_expect(true, (dereference(base) == dereference(derived)),
+                      "Convert share value");
+
+  ref<int> source = make_ref<int>(5);
+  ref<int> target(std::move(source));
+  tanuki_match_expect(true, source.isNull(), "Move steal");
+  tanuki_result_expect(5, target, "Move keep value");
+
+  source = make_ref<int>(6);
+  target = std::move(source);
+  tanuki_match_expect(true, source.isNull(), "Move assign steal");
+  tanuki_result_expect(6, target, "Move assign keep value");
+
+  tanuki_match_expect(true,
+                      (std::is_nothrow_move_constructible<ref<int>>::value &&
+                       std::is_nothrow_move_assignable<ref<int>>::value &&
+                       std::is_nothrow_move_constructible<
+                           tanuki::Piece<int>>::value),
+                      "Move nothrow");
+}
+
+void testString() {
+  tanuki::String slice;
+
+  {
+    tanuki::String whole("Hello world");
+    slice = whole.substr(6);
+
+    tanuki_match_expect(true, (whole.substr(0, 5) == "Hello"), "Slice begin");
+    tanuki_match_expect(true, (slice.data() == whole.data() + 6),
+                        "Slice share buffer");
+  }
+
+  tanuki_match_expect(true, (slice == "world"), "Slice outlive its parent");
+  tanuki_match_expect(true, (slice.substr(1, 3) == "or"), "Slice of slice");
+  tanuki_match_expect(false, (slice == "worl"), "Slice compare size");
+  tanuki_match_expect(true, slice.substr(5).empty(), "Slice empty");
 }
 
 void testLexer() {
@@ -41,6 +145,15 @@ void testLexer() {
   tanuki_run("Simple", testLexerSimple);
   tanuki_run("Unary", testLexerUnary);
   tanuki_run("Binary", testLexerBinary);
+  tanuki_run("Offset", testLexerOffset);
+  tanuki_run("Automaton", testLexerAutomaton);
+  tanuki_run("Keywords", testLexerKeywords);
+  tanuki_run("Dictionary", testLexerDictionary);
+  tanuki_run("Runs", testLexerRuns);
+  tanuki_run("Integers", testLexerIntegers);
+  tanuki_run("Floating", testLexerFloating);
+  tanuki_run("Search", testLexerSearch);
+  tanuki_run("Direct", testLexerDirect);
 }
 
 void testLexerConstant() {
@@ -245,6 +358,559 @@ void testLexerBinary() {
                       "And Constant + Regexp True");
 }
 
+void testLexerOffset() {
+  use_tanuki;
+
+  tanuki::String input("Hello world");
+
+  tanuki::Piece<std::string> piece = constant("world")->consumeAt(input, 6);
+  tanuki_match_expect(true, (piece.length == 5), "Offset length is relative");
+  tanuki_match_expect(true, (piece.result->compare("world") == 0),
+                      "Offset result");
+
+  piece = word(letter())->consumeAt(input, 1);
+  tanuki_match_expect(true, (piece.result->compare("ello") == 0),
+                      "Offset word");
+
+  piece = (constant("Hello") or constant("lo"))->consumeAt(input, 3);
+  tanuki_match_expect(true, (piece.length == 2), "Offset binary");
+  tanuki_match_expect(false, constant("Hello")->consumeAt(input, 6),
+                      "Offset miss");
+}
+
+void testLexerAutomaton() {
+  use_tanuki;
+
+  // Lengths recognized at each offset, by the tree and by its automaton
+  auto same = [](auto token, const std::string& input) {
+    tanuki::String in(input);
+    auto compiled = compile(token);
+
+    for (uint64_t offset = 0; offset <= in.size(); offset++) {
+      if (token->recognizeAt(in, offset) !=
+          compiled->recognizeAt(in, offset)) {
+        return false;
+      }
+    }
+
+    return true;
+  };
+
+  auto identifier = word(letter() or constant('_'));
+  auto number = (constant("0x") or ~constant('-')) or +digit();
+  auto blanks = *blank();
+  auto keyword = (constant("do") or constant("double")) or constant("d");
+
+  tanuki_match_expect(true, same(identifier, "tanuki_parser 42 _x"),
+                      "Automaton identifier");
+  tanuki_match_expect(true, same(number, "-12 0x 7"), "Automaton number");
+  tanuki_match_expect(true, same(blanks, "  \t a \t"), "Automaton blank");
+  tanuki_match_expect(true, same(keyword, "double do d"),
+                      "Automaton ordered choice");
+  tanuki_match_expect(true, same(+(constant("ab") or constant('a')), "abaab"),
+                      "Automaton repeated choice");
+
+  auto compiled = compile(keyword);
+  tanuki::Piece<std::string> piece = compiled->consumeAt("double", 0);
+  tanuki_match_expect(true, (piece.length == 2), "Automaton first choice");
+  tanuki_match_expect(true, (piece.result->compare("do") == 0),
+                      "Automaton result");
+  tanuki_match_expect(true, (bool)compile(compiled or digit())->match("7"),
+                      "Automaton composed");
+
+  tanuki::CharSet set;
+  tanuki_match_expect(false, compiled->first(set), "Automaton first");
+  tanuki_match_expect(true, (set.has('d') && !set.has('o')),
+                      "Automaton first set");
+
+  bool thrown = false;
+
+  try {
+    compile(!constant('a'));
+  } catch (NotRegularError&) {
+    thrown = true;
+  }
+
+  tanuki_match_expect(true, thrown, "Automaton not regular");
+
+  // A pattern couldn't reject the integers overflowing
+  thrown = false;
+
+  try {
+    compile(integer());
+  } catch (NotRegularError&) {
+    thrown = true;
+  }
+
+  tanuki_match_expect(true, thrown, "Automaton integer");
+}
+
+void testLexerKeywords() {
+  use_tanuki;
+
+  // An ordered chain of constants keeps its first match once in a trie
+  auto chain = (((constant("do") or constant("double")) or constant("d")) or
+                (constant("if") or constant('e'))) or constant("else");
+  auto automaton = compile(chain);
+  tanuki::String in("double do d if else elsewhere x");
+  bool same = true;
+
+  for (uint64_t offset = 0; offset <= in.size(); offset++) {
+    if (chain->recognizeAt(in, offset) != automaton->recognizeAt(in, offset)) {
+      same = false;
+    }
+  }
+
+  tanuki_match_expect(true, same, "Keywords ordered chain");
+  tanuki_match_expect(true, (bool)chain->match("double"),
+                      "Keywords chain match");
+  tanuki_match_expect(false, chain->match("dou"), "Keywords chain miss");
+
+  auto sql = keywords({"select", "sel", "set", "from", "fromage", "s"});
+  tanuki::Piece<std::string> piece = sql->consumeAt("selection", 0);
+  tanuki_match_expect(true, (piece.length == 6), "Keywords longest");
+  tanuki_match_expect(true, (piece.result->compare("select") == 0),
+                      "Keywords result");
+
+  int64_t length = sql->recognizeAt("fromag", 0);
+  tanuki_match_expect(true, (length == 4), "Keywords prefix");
+  length = sql->recognizeAt("xs", 1);
+  tanuki_match_expect(true, (length == 1), "Keywords offset");
+  length = sql->recognizeAt("where", 0);
+  tanuki_match_expect(true, (length == -1), "Keywords miss");
+  length = compile(sql)->recognizeAt("fromage", 0);
+  tanuki_match_expect(true, (length == 7), "Keywords compiled");
+
+  tanuki::CharSet set;
+  tanuki_match_expect(false, sql->first(set), "Keywords first");
+  tanuki_match_expect(true, (set.has('s') && set.has('f') && !set.has('e')),
+                      "Keywords first set");
+
+  // The trie is built once, by the first thread needing it
+  auto fresh = (((constant("do") or constant("double")) or constant("d")) or
+                (constant("if") or constant('e'))) or constant("else");
+  std::vector<int64_t> lengths(8, 0);
+  std::vector<std::thread> threads;
+
+  for (size_t i = 0; i < lengths.size(); i++) {
+    threads.emplace_back([&fresh, &lengths, &in, i]() {
+      lengths[i] = fresh->recognizeAt(in, 0);
+    });
+  }
+
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+
+  tanuki_match_expect(true,
+                      (std::count(lengths.begin(), lengths.end(), 2) ==
+                       (long)lengths.size()),
+                      "Keywords concurrent");
+}
+
+void testLexerDictionary() {
+  use_tanuki;
+
+  const char* words = "tanuki_dictionary.txt";
+  const char* saved = "tanuki_dictionary.dict";
+
+  {
+    std::ofstream file(words);
+    file << "tops\ntap\r\n\ntop\ntaps\ntap";
+  }
+
+  auto codes = dictionary(words);
+  tanuki_match_expect(true, (codes->states() == 5), "Dictionary minimized");
+
+  int64_t length = codes->recognizeAt("tapstop", 0);
+  tanuki_match_expect(true, (length == 4), "Dictionary longest");
+  length = codes->recognizeAt("tapstop", 4);
+  tanuki_match_expect(true, (length == 3), "Dictionary offset");
+  length = codes->recognizeAt("tip", 0);
+  tanuki_match_expect(true, (length == -1), "Dictionary miss");
+  tanuki_match_expect(true, (bool)codes->match("top"), "Dictionary match");
+  tanuki_match_expect(false, codes->match("to"), "Dictionary prefix");
+
+  codes->save(saved);
+  auto mapped = dictionary(saved);
+  tanuki_match_expect(true, (mapped->states() == 5), "Dictionary mapped");
+
+  tanuki::Piece<std::string> piece = mapped->consumeAt("taps", 0);
+  tanuki_match_expect(true, (piece.result->compare("taps") == 0),
+                      "Dictionary mapped result");
+
+  tanuki::CharSet set;
+  tanuki_match_expect(false, mapped->first(set), "Dictionary first");
+  tanuki_match_expect(true, (set.has('t') && !set.has('a')),
+                      "Dictionary first set");
+
+  {
+    std::ofstream file(saved, std::ios::binary | std::ios::app);
+    file << "x";
+  }
+
+  bool thrown = false;
+
+  try {
+    dictionary(saved);
+  } catch (const DictionaryError&) {
+    thrown = true;
+  }
+
+  tanuki_match_expect(true, thrown, "Dictionary truncated");
+
+  // Overwrite one word of a saved automaton, which must then be rejected
+  auto corrupted = [&codes, saved](std::streamoff position, uint32_t value) {
+    codes->save(saved);
+
+    {
+      std::fstream file(saved,
+                        std::ios::binary | std::ios::in | std::ios::out);
+      file.seekp(position);
+      file.write((const char*)&value, sizeof(value));
+    }
+
+    try {
+      dictionary(saved);
+    } catch (const DictionaryError&) {
+      return true;
+    }
+
+    return false;
+  };
+
+  uint32_t states = codes->states();
+
+  tanuki_match_expect(true, corrupted(16, 1u << 30),
+                      "Dictionary corrupted first arc");
+  tanuki_match_expect(true, corrupted(20, 0xfffffffe),
+                      "Dictionary corrupted arc count");
+  tanuki_match_expect(true, corrupted(16 + states * 8, states),
+                      "Dictionary corrupted target");
+
+  std::remove(words);
+  std::remove(saved);
+}
+
+void testLexerRuns() {
+  use_tanuki;
+
+  // Runs measured by the scanner, against the char token tried byte by byte
+  auto same = [](auto token, auto chars, const std::string& input) {
+    tanuki::String in(input);
+
+    for (uint64_t offset = 0; offset <= in.size(); offset++) {
+      int length = 0;
+
+      while (chars->recognizeAt(in, offset + length) == 1) {
+        length++;
+      }
+
+      if (token->recognizeAt(in, offset) != ((length > 0) ? length : -1)) {
+        return false;
+      }
+    }
+
+    return true;
+  };
+
+  std::string text(
+      "tanuki_parser_identifiers_longer_than_a_vector 12345678901234567890123"
+      "45678901234567890 \xc3\xa9t\xc3\xa9 x");
+  auto identifier = (letter() or constant('_'));
+  auto scattered = anyOf('a', 'c', 'e', 'g', 'i', 'k', 'r', 's', 't', 'u');
+
+  tanuki_match_expect(true, same(word(identifier), identifier, text),
+                      "Runs ranges");
+  tanuki_match_expect(true, same(word(digit()), digit(), text),
+                      "Runs digits");
+  tanuki_match_expect(true, same(word(scattered), scattered, text),
+                      "Runs scattered");
+
+  auto accents = anyOf('\xc3', '\xa9');
+  tanuki_match_expect(true, same(+accents, accents, text), "Runs high bytes");
+  tanuki_match_expect(true, (bool)word(accents)->match("\xc3\xa9"),
+                      "Runs high bytes match");
+
+  tanuki::Piece<std::string> piece = word(digit())->consumeAt(text, 47);
+  tanuki_match_expect(true, (piece.length == 40), "Runs consume");
+  tanuki_match_expect(true, (piece.result->size() == 40), "Runs result");
+
+  // Plus reads runs of a class without calling the inner token
+  auto plus = +scattered;
+  auto run = plus->consumeAt("tuk x", 0);
+  tanuki_match_expect(true, ((run.length == 3) && (run.result->size() == 3) &&
+                             (*dereference(run.result->back()) == 'k')),
+                      "Runs plus consume");
+
+  // A class changed in place is scanned again
+  auto changing = anyOf('a');
+  auto letters = word(changing);
+  tanuki_match_expect(false, letters->match("ab"), "Runs before validate");
+  changing->validate('b');
+  tanuki_match_expect(true, (bool)letters->match("ab"),
+                      "Runs after validate");
+}
+
+void testLexerIntegers() {
+  use_tanuki;
+
+  tanuki_result_expect(42, integer()->match("42"), "Integers int");
+  tanuki_result_expect(2147483647, integer()->match("2147483647"),
+                       "Integers int highest");
+  tanuki_match_expect(false, integer()->match("2147483648"),
+                      "Integers int overflow");
+  tanuki_match_expect(false, integer()->match("-1"), "Integers unsigned");
+
+  auto wide = integer<int64_t>(true);
+  ref<int64_t> value = wide->match("-9223372036854775808");
+  tanuki_match_expect(
+      true, ((bool)value && (*dereference(value) == INT64_MIN)),
+      "Integers int64 lowest");
+  value = wide->match("9223372036854775807");
+  tanuki_match_expect(
+      true, ((bool)value && (*dereference(value) == INT64_MAX)),
+      "Integers int64 highest");
+  tanuki_match_expect(false, wide->match("9223372036854775808"),
+                      "Integers int64 overflow");
+  tanuki_match_expect(false, wide->match("-"), "Integers sign alone");
+
+  auto natural = integer<uint64_t>(true);
+  ref<uint64_t> big = natural->match("18446744073709551615");
+  tanuki_match_expect(
+      true, ((bool)big && (*dereference(big) == UINT64_MAX)),
+      "Integers uint64 highest");
+  tanuki_match_expect(false, natural->match("18446744073709551616"),
+                      "Integers uint64 overflow");
+  tanuki_match_expect(false, natural->match("-1"), "Integers uint64 sign");
+
+  big = natural->match("000000000000000000000000012345678901");
+  tanuki_match_expect(
+      true, ((bool)big && (*dereference(big) == 12345678901ULL)),
+      "Integers leading zeros");
+
+  tanuki::Piece<int64_t> piece = wide->consumeAt("x=-1234567890123;", 2);
+  tanuki_match_expect(true, (piece.length == 14), "Integers consume");
+  tanuki_match_expect(true, (*dereference(piece.result) == -1234567890123LL),
+                      "Integers consume value");
+  tanuki_match_expect(true, (wide->recognizeAt("12345678x", 0) == 8),
+                      "Integers block");
+}
+
+void testLexerFloating() {
+  use_tanuki;
+
+  auto number = floating(true);
+
+  // Values which go through each conversion, against the C library
+  const char* inputs[] = {"0",
+                          "3.25",
+                          "-0.1",
+                          ".5",
+                          "7.",
+                          "1e22",
+                          "1.7976931348623157e308",
+                          "4.9e-324",
+                          "2.2250738585072011e-308",
+                          "9007199254740993",
+                          "123456789012345678901234567890e-20",
+                          "0.000000000000000000000000000001234",
+                          "1e400",
+                          "1e-400"};
+  bool same = true;
+
+  for (const char* input : inputs) {
+    ref<double> value = number->match(input);
+
+    if (!(bool)value || (*dereference(value) != strtod(input, nullptr))) {
+      same = false;
+    }
+  }
+
+  tanuki_match_expect(true, same, "Floating values");
+
+  tanuki::Piece<double> piece = number->consumeAt("x=-12.5e-1;", 2);
+  tanuki_match_expect(true, (piece.length == 8), "Floating consume");
+  tanuki_match_expect(true, (*dereference(piece.result) == -1.25),
+                      "Floating consume value");
+
+  int64_t length = number->recognizeAt("2e+", 0);
+  tanuki_match_expect(true, (length == 1), "Floating partial exponent");
+  length = number->recognizeAt("-.e5", 0);
+  tanuki_match_expect(true, (length == -1), "Floating no digit");
+  tanuki_match_expect(false, floating()->match("-1"), "Floating unsigned");
+
+  auto compiled = compile(number);
+  same = true;
+
+  for (const char* input : {"12.5e3x", "1.e", ".5E-2", "-3", "-.", "7e+"}) {
+    tanuki::String in(input);
+
+    if (compiled->recognizeAt(in, 0) != number->recognizeAt(in, 0)) {
+      same = false;
+    }
+  }
+
+  tanuki_match_expect(true, same, "Floating pattern");
+}
+
+void testLexerSearch() {
+  use_tanuki;
+
+  // Lengths found by the search, against the inner token tried everywhere
+  auto same = [](auto inner, const std::string& input) {
+    tanuki::String in(input);
+    auto search = endWith(inner);
+
+    for (uint64_t offset = 0; offset <= in.size(); offset++) {
+      int expected = -1;
+
+      for (uint64_t i = offset; i < in.size(); i++) {
+        int64_t length = inner->recognizeAt(in, i);
+
+        if (length >= 0) {
+          expected = (length + (i - offset));
+          break;
+        }
+      }
+
+      if (search->recognizeAt(in, offset) != expected) {
+        return false;
+      }
+    }
+
+    return true;
+  };
+
+  std::string text("say \"hello\" */ then /* and **/ or ***/ end; 42");
+
+  tanuki_match_expect(true, same(constant('"'), text), "Search byte");
+  tanuki_match_expect(true, same(constant("*/"), text), "Search literal");
+  tanuki_match_expect(true, same(constant("***/"), text),
+                      "Search repeated literal");
+  tanuki_match_expect(true, same(constant("*/x"), text), "Search missing");
+  tanuki_match_expect(true, same(constant("**/ or ***/"), text),
+                      "Search long literal");
+  tanuki_match_expect(true, same(word(digit()), text), "Search set");
+  tanuki_match_expect(true, same(constant(';') or digit(), text),
+                      "Search choice");
+
+  tanuki::Piece<std::string> piece =
+      range(constant("/*"), constant("*/"))->consumeAt(text, 20);
+  tanuki_match_expect(true, (piece.length == 10), "Search range");
+  tanuki_match_expect(true, (piece.result->compare("/* and **/") == 0),
+                      "Search range result");
+
+  // The finder is built by the first thread needing it
+  auto comment = range(constant("/*"), constant("*/"));
+  std::vector<int64_t> lengths(8, 0);
+  std::vector<std::thread> threads;
+
+  for (size_t i = 0; i < lengths.size(); i++) {
+    threads.emplace_back([&comment, &lengths, &text, i]() {
+      lengths[i] = comment->recognizeAt(text, 20);
+    });
+  }
+
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+
+  tanuki_match_expect(true,
+                      (std::count(lengths.begin(), lengths.end(), 10) ==
+                       (long)lengths.size()),
+                      "Search concurrent");
+
+  // The finder of a regular token doesn't depend on the grammars
+  class PatternedToken : public tanuki::ConstantToken {
+   public:
+    PatternedToken(const std::string& constant, int* built)
+        : tanuki::ConstantToken(constant), m_built(built) {}
+
+    ref<tanuki::Pattern> pattern() override {
+      (*m_built)++;
+      return tanuki::ConstantToken::pattern();
+    }
+
+   private:
+    int* m_built;
+  };
+
+  int built = 0;
+  auto end = endWith(make_ref<PatternedToken>("*/", &built));
+  int before = built;
+
+  ref<Fragment<int>> unrelated = fragment<int>();
+  unrelated->handle([](ref<int> i) { return i; }, integer());
+
+  tanuki_match_expect(true, (end->recognizeAt(text, 20) == 10),
+                      "Search after grammar modified");
+  tanuki_match_expect(true, (built == before), "Search finder built once");
+}
+
+void testLexerDirect() {
+  use_tanuki;
+
+  // Lengths of the expression, against the token it mirrors at each offset
+  auto same = [](auto expression, auto token, const std::string& input) {
+    tanuki::String in(input);
+
+    for (uint64_t offset = 0; offset <= in.size(); offset++) {
+      if (expression.recognizeAt(in, offset) !=
+          token->recognizeAt(in, offset)) {
+        return false;
+      }
+    }
+
+    return true;
+  };
+
+  std::string text("let x1 = 42 + y;\tif (x1) return 0x2a;");
+
+  tanuki_match_expect(true, same(direct::constant("x1"), constant("x1"), text),
+                      "Direct constant");
+  tanuki_match_expect(true, same(+direct::digit(), +digit(), text),
+                      "Direct plus");
+  tanuki_match_expect(
+      true, same(direct::letter() || direct::digit(), letter() or digit(),
+                 text),
+      "Direct choice");
+  tanuki_match_expect(
+      true, same(*direct::blank(), *blank(), text), "Direct star");
+  tanuki_match_expect(true,
+                      same(~direct::constant("0x"), ~constant("0x"), text),
+                      "Direct optional");
+  tanuki_match_expect(
+      true, same(+direct::letter() && direct::constant("if"),
+                 +letter() and constant("if"), text),
+      "Direct and");
+
+  auto identifier = direct::token(+direct::letter() || direct::constant('_'));
+  tanuki::Piece<std::string> piece = identifier->consumeAt(text, 4);
+  tanuki_match_expect(true, (piece.length == 1), "Direct token");
+  tanuki_match_expect(true, (piece.result->compare("x") == 0),
+                      "Direct token result");
+
+  tanuki::CharSet first;
+  tanuki_match_expect(false, identifier->first(first), "Direct first");
+  tanuki_match_expect(true, (first.has('a') && first.has('_') &&
+                             !first.has('1')),
+                      "Direct first set");
+  tanuki_match_expect(true, compile(identifier)->matches("tanuki"),
+                      "Direct compile");
+
+  ref<Fragment<int>> count = fragment<int>();
+  count->handle(
+      [](ref<std::string> word) -> ref<int> {
+        return make_ref<int>(word->size());
+      },
+      direct::token(+(direct::letter() || direct::digit())));
+  count->skip(direct::token(+direct::blank()));
+  count->skipAtEnd = true;
+
+  tanuki_result_expect(6, count->match("  tanuki "), "Direct fragment");
+}
+
 void testGrammar() {
   tanuki_run("Select", testGrammarSelect);
   tanuki_run("Simple", testGrammarSimple);
@@ -252,6 +918,19 @@ void testGrammar() {
   tanuki_run("Funny", testGrammarFunny);
   tanuki_run("Grammer with operator", testGrammarWithOperator);
   tanuki_run("Grammar with left recursive", testGrammarLeftRecursive);
+  tanuki_run("Packrat", testGrammarPackrat);
+  tanuki_run("Seed growing", testGrammarSeedGrowing);
+  tanuki_run("File", testGrammarFile);
+  tanuki_run("Arena", testGrammarArena);
+  tanuki_run("Recognize", testGrammarRecognize);
+  tanuki_run("Deferred", testGrammarDeferred);
+  tanuki_run("First", testGrammarFirst);
+  tanuki_run("Factoring", testGrammarFactoring);
+  tanuki_run("First match", testGrammarFirstMatch);
+  tanuki_run("Skip", testGrammarSkip);
+  tanuki_run("Callbacks", testGrammarCallbacks);
+  tanuki_run("Program", testGrammarProgram);
+  tanuki_run("Generated", testGrammarGenerated);
 }
 
 void testGrammarSelect() {
@@ -269,6 +948,23 @@ void testGrammarSelect() {
 
   tanuki_result_expect("Hello", fragment1->match("Hello"), "Hello");
   tanuki_result_expect("(Hello)", fragment1->match("(Hello)"), "(Hello)");
+
+  // Results are forwarded as is, even when they can't be copied
+  struct Holder {
+    std::unique_ptr<int> value;
+  };
+
+  ref<Fragment<Holder>> inner = fragment<Holder>();
+  inner->handle(
+      [](ref<char>) {
+        return make_ref<Holder>(Holder{std::unique_ptr<int>(new int(7))});
+      },
+      constant('x'));
+
+  ref<Fragment<Holder>> selected = Fragment<Holder>::select(inner);
+  ref<Holder> held = selected->match("x");
+  tanuki_match_expect(true, (!held.isNull() && (*held->value == 7)),
+                      "Select move only");
 }
 
 void testGrammarSimple() {
@@ -339,7 +1035,7 @@ void testGrammarMultiple() {
       [](ref<std::string>, ref<char>, ref<std::string> word) { return word; },
       constant("hey"), space(), word(letter()));
   mainFragment->handle(
-      [](ref<int> i, ref<char>, ref<std::string> word) { return word; }, sub,
+      [](ref<int>, ref<char>, ref<std::string> word) { return word; }, sub,
       space(), word(letter()));
   mainFragment->handle([](ref<std::string> word) { return word; },
                        word(letter()));
@@ -389,7 +1085,10 @@ void testGrammarFunny() {
       }
     }
 
-    tanuki::Piece<OperatorReturnType> consume(const tanuki::String& in) {
+    tanuki::Piece<OperatorReturnType> consumeAt(const tanuki::String& input,
+                                                uint64_t offset) {
+      tanuki::String in = input.substr(offset);
+
       if (in.empty()) {
         return tanuki::Piece<OperatorReturnType>{0, ref<OperatorReturnType>()};
       } else {
@@ -502,3 +1201,976 @@ void testGrammarLeftRecursive() {
 
   tanuki_match_expect(true, dual->match(in), "Dual : 1500");
 }
+
+void testGrammarPackrat() {
+  use_tanuki;
+
+  int calls = 0;
+
+  ref<Fragment<int>> number = fragment<int>();
+  ref<Fragment<int>> mainFragment = fragment<int>();
+  master(mainFragment);
+
+  number->memoize = true;
+  number->handle(
+      [&calls](ref<int> i) -> ref<int> {
+        calls++;
+        return i;
+      },
+      integer());
+
+  mainFragment->handle(
+      [](ref<int> i, ref<char>, ref<int> j) -> ref<int> { return (i + j); },
+      number, constant('+'), number);
+  mainFragment->handle(
+      [](ref<int> i, ref<char>, ref<int> j) -> ref<int> { return (i - j); },
+      number, constant('-'), number);
+  mainFragment->handle(
+      [](ref<char>, ref<int> in, ref<char>) -> ref<int> { return in; },
+      constant('('), mainFragment, constant(')'));
+
+  ref<int> result = mainFragment->match("5+5");
+  tanuki_result_expect(10, result, "Memoized add");
+  tanuki_match_expect(true, (calls == 2), "Memoized add reuse number");
+
+  result = mainFragment->match("5-5");
+  tanuki_result_expect(0, result, "Memoized less");
+  tanuki_match_expect(true, (calls == 4), "Memo released after parse");
+
+  mainFragment->memoize = true;
+
+  tanuki_result_expect(10, mainFragment->match("((((5+5))))"),
+                       "Memoized lot of parenthesis");
+  tanuki_match_expect(false, mainFragment->match("((5+5)"),
+                      "Memoized unbalanced parenthesis");
+}
+
+void testGrammarSeedGrowing() {
+  use_tanuki;
+
+  ref<Fragment<int>> type = fragment<int>();
+  ref<Fragment<int>> dual = fragment<int>();
+  master(type);
+  master(dual);
+
+  type->memoize = true;
+  dual->memoize = true;
+
+  type->handle([](auto) -> ref<int> { return 0_ref; }, constant("int"));
+  type->handle([](ref<int> in, auto) -> ref<int> { return in + 1; }, type,
+               constant('%'));
+  type->handle([](ref<int> in, auto) -> ref<int> { return in + 10; }, type,
+               constant('!'));
+
+  dual->handle([](auto) -> ref<int> { return 1_ref; }, constant('i'));
+  dual->handle([](ref<int> x, ref<int> y) -> ref<int> { return x + y; }, dual,
+               dual);
+
+  tanuki_result_expect(0, type->match("int"), "Seed without recursive");
+  tanuki_result_expect(1, type->match("int%"), "Seed with one recursive");
+  tanuki_result_expect(22, type->match("int%!!%"), "Seed melt");
+  tanuki_match_expect(false, type->match("int%?"), "Seed false");
+
+  // Each thread grows its seeds in the memo of its own session
+  std::vector<int> grown(8, 0);
+  std::vector<std::thread> threads;
+
+  for (size_t i = 0; i < grown.size(); i++) {
+    threads.emplace_back([&type, &grown, i]() {
+      ref<int> result = type->match("int%!!%");
+      grown[i] = (result.isNull() ? -1 : *dereference(result));
+    });
+  }
+
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+
+  tanuki_match_expect(
+      true,
+      (std::count(grown.begin(), grown.end(), 22) == (long)grown.size()),
+      "Seed concurrent");
+
+  tanuki_result_expect(4, dual->match("iiii"), "Seed dual : Quadra");
+
+  std::string in;
+  for (int i = 0; i < 1500; i++) {
+    in += 'i';
+  }
+
+  tanuki_result_expect(1500, dual->match(in), "Seed dual : 1500");
+
+  // Indirect : list -> element ',' integer | integer, element -> list
+  ref<Fragment<int>> list = fragment<int>();
+  ref<Fragment<int>> element = fragment<int>();
+  master(list);
+
+  list->memoize = true;
+
+  list->handle([](ref<int> i) { return i; }, integer());
+  list->handle(
+      [](ref<int> l, ref<char>, ref<int> i) -> ref<int> { return l + i; },
+      element, constant(','), integer());
+  element->handle([](ref<int> l) { return l; }, list);
+
+  tanuki_result_expect(5, list->match("5"), "Indirect single");
+  tanuki_result_expect(6, list->match("1,2,3"), "Indirect sum");
+  tanuki_match_expect(false, list->match("1,2,"), "Indirect false");
+}
+
+void testGrammarFile() {
+  use_tanuki;
+
+  // Removes its files and itself, even when an assertion throws
+  class TemporaryDirectory {
+   public:
+    TemporaryDirectory() {
+      const char* root = std::getenv("TMPDIR");
+
+      m_path = std::string((root == nullptr) ? "/tmp" : root) + "/tanukiXXXXXX";
+
+      if (mkdtemp(&m_path[0]) == nullptr) {
+        m_path = ".";
+      }
+    }
+
+    ~TemporaryDirectory() {
+      for (const std::string& file : m_files) {
+        std::remove(file.c_str());
+      }
+
+      if (m_path != ".") {
+        std::remove(m_path.c_str());
+      }
+    }
+
+    const char* file(const std::string& name) {
+      m_files.push_back(m_path + "/" + name);
+
+      return m_files.back().c_str();
+    }
+
+   private:
+    std::string m_path;
+    std::list<std::string> m_files;
+  };
+
+  TemporaryDirectory directory;
+  const char* path = directory.file("tanuki_grammar_file.txt");
+
+  {
+    std::ofstream file(path);
+    file << "12+30";
+  }
+
+  ref<Fragment<int>> sum = fragment<int>();
+  master(sum);
+
+  sum->handle(
+      [](ref<int> i, ref<char>, ref<int> j) -> ref<int> { return (i + j); },
+      integer(), constant('+'), integer());
+
+  ref<int> result = sum->matchFile(path);
+  tanuki_result_expect(42, result, "Match mapped file");
+
+  tanuki::Piece<int> piece = sum->consumeFile(path);
+  tanuki_match_expect(true, (piece.length == 5), "Consume mapped file");
+
+  std::remove(path);
+
+  bool thrown = false;
+
+  try {
+    sum->matchFile(path);
+  } catch (const FileError&) {
+    thrown = true;
+  }
+
+  tanuki_match_expect(true, thrown, "Missing file");
+
+  // Offsets are 64 bits, the sum is read past 4 GB of a sparse file. Where
+  // holes would be written out, the test is skipped
+  const char* probe = directory.file("tanuki_sparse_probe.txt");
+  struct stat status;
+
+  {
+    std::ofstream file(probe);
+    file.seekp(1 << 20);
+    file << "x";
+  }
+
+  if ((stat(probe, &status) != 0) ||
+      (((int64_t)status.st_blocks * 512) >= (1 << 20))) {
+    std::cout << "Large mapped file skipped, no sparse files" << std::endl;
+
+    return;
+  }
+
+  {
+    std::ofstream file(path);
+    file.seekp(((int64_t)5 << 30));
+    file << "12+30";
+  }
+
+  tanuki::String big = tanuki::String::map(path);
+  piece = sum->consumeAt(big, big.size() - 5);
+
+  tanuki_match_expect(true, (big.size() == (((int64_t)5 << 30) + 5)),
+                      "Large mapped file");
+  tanuki_result_expect(42, piece.result, "Consume large mapped file");
+}
+
+void testGrammarArena() {
+  use_tanuki;
+
+  bool pooled = false;
+
+  ref<Fragment<int>> sum = fragment<int>();
+  ref<Fragment<std::string>> name =
+      Fragment<std::string>::select(word(letter()));
+  master(sum);
+
+  sum->arena = true;
+  sum->handle(
+      [&pooled](ref<int> i, ref<char>, ref<int> j) -> ref<int> {
+        pooled = (tanuki::Arena::current() != nullptr);
+        return make_ref<int>(*dereference(i) + *dereference(j));
+      },
+      integer(), constant('+'), integer());
+
+  ref<int> result = sum->match("12+30");
+  tanuki_result_expect(42, result, "Arena result");
+  tanuki_match_expect(true, pooled, "Arena used during the parse");
+  tanuki_match_expect(true, (tanuki::Arena::current() == nullptr),
+                      "Arena closed after the parse");
+
+  ref<int> other = sum->match("1+1");
+  tanuki_result_expect(42, result, "Arena result outlive the next parse");
+  tanuki_result_expect(2, other, "Arena next parse");
+
+  ref<int> crossing = sum->match("20+22");
+  int dropped = 0;
+  std::thread consumer([&crossing, &dropped]() {
+    ref<int> owned = crossing;
+    crossing = ref<int>();
+    dropped = *dereference(owned);
+  });
+  consumer.join();
+
+  ref<int> after = sum->match("2+3");
+  tanuki_match_expect(true, (dropped == 42),
+                      "Arena result released on another thread");
+  tanuki_result_expect(5, after, "Arena parse after a release elsewhere");
+
+  name->arena = true;
+  ref<std::string> selected = name->match("tanuki");
+  tanuki_match_expect(true, (selected->compare("tanuki") == 0),
+                      "Arena value forwarded by select");
+}
+
+void testGrammarRecognize() {
+  use_tanuki;
+
+  int calls = 0;
+
+  ref<Fragment<int>> type = fragment<int>();
+  ref<Fragment<int>> list = fragment<int>();
+  ref<Fragment<int>> element = fragment<int>();
+  master(type);
+  master(list);
+
+  auto count = [&calls](auto...) -> ref<int> {
+    calls++;
+    return 0_ref;
+  };
+
+  type->skip(space());
+  type->handle(count, constant("int"));
+  type->handle(count, type, constant('%'));
+  type->handle(count, type, word(constant('!')));
+
+  list->memoize = true;
+  list->handle(count, integer());
+  list->handle(count, element, constant(','), integer());
+  element->handle(count, list);
+
+  tanuki_match_expect(true, type->matches("int"), "Recognize simple");
+  tanuki_match_expect(true, type->matches("int% %!!"),
+                      "Recognize left recursive");
+  tanuki_match_expect(false, type->matches("int%?"), "Recognize false");
+  tanuki_match_expect(true, list->matches("1,22,333"),
+                      "Recognize indirect seed");
+  tanuki_match_expect(false, list->matches("1,2,"), "Recognize indirect false");
+  tanuki_match_expect(true, (calls == 0), "Recognize without callback");
+
+  tanuki_match_expect(true, (type->recognizeAt("int%!?", 0) == 5),
+                      "Recognize length");
+  tanuki_match_expect(true, word(letter())->matches("tanuki"),
+                      "Recognize token");
+}
+
+void testGrammarDeferred() {
+  use_tanuki;
+
+  int calls = 0;
+
+  ref<Fragment<int>> sum = fragment<int>();
+  ref<Fragment<int>> type = fragment<int>();
+  ref<Fragment<int>> list = fragment<int>();
+  ref<Fragment<int>> element = fragment<int>();
+  master(type);
+  master(list);
+
+  sum->deferred = true;
+  sum->handle(
+      [&calls](ref<int> i, ref<char>, ref<int> j) -> ref<int> {
+        calls++;
+        return i + j;
+      },
+      integer(), constant('+'), integer());
+  sum->handle(
+      [&calls](ref<int> i, ref<char>, ref<int> j, ref<char>,
+               ref<int> k) -> ref<int> {
+        calls++;
+        return i + j + k;
+      },
+      integer(), constant('+'), integer(), constant('+'), integer());
+
+  ref<int> result = sum->match("1+2+3");
+  tanuki_result_expect(6, result, "Deferred longest");
+  tanuki_match_expect(true, (calls == 1), "Deferred discarded not called");
+
+  type->deferred = true;
+  type->handle(
+      [&calls](auto) -> ref<int> {
+        calls++;
+        return 0_ref;
+      },
+      constant("int"));
+  type->handle(
+      [&calls](ref<int> in, auto) -> ref<int> {
+        calls++;
+        return in + 1;
+      },
+      type, constant('%'));
+  type->handle(
+      [&calls](ref<int> in, auto) -> ref<int> {
+        calls++;
+        return in + 10;
+      },
+      type, constant('!'));
+
+  calls = 0;
+  result = type->match("int%!%");
+  tanuki_result_expect(12, result, "Deferred left recursive");
+  tanuki_match_expect(true, (calls == 4), "Deferred left recursive chain");
+
+  type->memoize = true;
+
+  calls = 0;
+  result = type->match("int!%!");
+  tanuki_result_expect(21, result, "Deferred seed growing");
+  tanuki_match_expect(true, (calls == 4), "Deferred seed growing stages");
+
+  list->memoize = true;
+  list->deferred = true;
+  list->handle([](ref<int> i) { return i; }, integer());
+  list->handle(
+      [](ref<int> l, ref<char>, ref<int> i) -> ref<int> { return l + i; },
+      element, constant(','), integer());
+  element->handle([](ref<int> l) { return l; }, list);
+
+  tanuki_result_expect(6, list->match("1,2,3"), "Deferred indirect");
+  tanuki_match_expect(false, list->match("1,2,"), "Deferred indirect false");
+}
+
+void testGrammarFirst() {
+  use_tanuki;
+
+  class TriedToken : public tanuki::ConstantToken {
+   public:
+    TriedToken(const std::string& constant, int* tries)
+        : tanuki::ConstantToken(constant), m_tries(tries) {}
+
+    tanuki::Piece<std::string> consumeAt(const tanuki::String& in,
+                                         uint64_t offset) override {
+      (*m_tries)++;
+      return tanuki::ConstantToken::consumeAt(in, offset);
+    }
+
+    int64_t recognizeAt(const tanuki::String& in, uint64_t offset) override {
+      (*m_tries)++;
+      return tanuki::ConstantToken::recognizeAt(in, offset);
+    }
+
+   private:
+    int* m_tries;
+  };
+
+  tanuki::CharSet set;
+  tanuki_match_expect(false, constant("int")->first(set), "First constant");
+  tanuki_match_expect(true, (set.has('i') && !set.has('n')),
+                      "First constant set");
+
+  set = tanuki::CharSet();
+  tanuki_match_expect(true, (~constant('-') || integer())->first(set),
+                      "First nullable");
+  tanuki_match_expect(true, (set.has('-') && set.has('7') && !set.has('a')),
+                      "First nullable set");
+
+  int tries = 0;
+
+  ref<Fragment<int>> keyword = fragment<int>();
+  ref<Fragment<int>> list = fragment<int>();
+  ref<Fragment<int>> element = fragment<int>();
+  master(list);
+
+  int index = 0;
+
+  for (std::string name : {"if", "else", "while", "for", "return"}) {
+    keyword->handle([index](auto) { return make_ref<int>(index); },
+                    make_ref<TriedToken>(name, &tries));
+    index++;
+  }
+
+  ref<int> result = keyword->match("while");
+  tanuki_result_expect(2, result, "First dispatch");
+  tanuki_match_expect(true, (tries == 1), "First dispatch tries");
+
+  tries = 0;
+  tanuki_match_expect(false, keyword->matches("do"), "First reject");
+  tanuki_match_expect(true, (tries == 0), "First reject tries");
+
+  keyword->handle([](auto) -> ref<int> { return 5_ref; },
+                  make_ref<TriedToken>("do", &tries));
+  keyword->skip(space());
+
+  result = keyword->match("  do");
+  tanuki_result_expect(5, result, "First grammar modified");
+
+  list->memoize = true;
+  list->handle([](ref<int> i) { return i; }, integer());
+  list->handle(
+      [](ref<int> l, ref<char>, ref<int> i) -> ref<int> { return l + i; },
+      element, constant(','), integer());
+  element->handle([](ref<int> l) { return l; }, list);
+
+  set = tanuki::CharSet();
+  tanuki_match_expect(false, element->first(set), "First indirect");
+  tanuki_match_expect(true, (set.has('1') && !set.has(',')),
+                      "First indirect set");
+  tanuki_result_expect(6, list->match("1,2,3"), "First indirect match");
+
+  ref<Fragment<int>> statement = fragment<int>();
+  statement->handle([](ref<int> k) { return k; }, keyword);
+
+  tanuki_result_expect(5, statement->match("do"), "First reached");
+
+  keyword->handle([](auto) -> ref<int> { return 6_ref; }, constant("loop"));
+  tanuki_result_expect(6, statement->match("loop"),
+                       "First reached grammar modified");
+
+  // Dispatch tables and sets are built by the first thread needing them
+  ref<Fragment<int>> items = fragment<int>();
+  ref<Fragment<int>> item = fragment<int>();
+  ref<Fragment<int>> letters = fragment<int>();
+  master(items);
+
+  items->handle([](ref<int> w) { return w; }, item);
+  items->handle([](ref<int> w, ref<int> l) -> ref<int> { return w + l; },
+                item, items);
+  item->skip(space());
+  item->handle([](ref<int> l) { return l; }, letters);
+  letters->handle([](auto) -> ref<int> { return 1_ref; }, constant("a"));
+  letters->handle([](auto) -> ref<int> { return 2_ref; }, constant("bb"));
+
+  std::vector<int> parsed(8, 0);
+  std::vector<std::thread> threads;
+
+  for (size_t i = 0; i < parsed.size(); i++) {
+    threads.emplace_back([&items, &parsed, i]() {
+      ref<int> sum = items->match("a bb a bb a");
+      parsed[i] = (sum.isNull() ? 0 : *dereference(sum));
+    });
+  }
+
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+
+  tanuki_match_expect(true,
+                      (std::count(parsed.begin(), parsed.end(), 7) ==
+                       (long)parsed.size()),
+                      "First concurrent");
+
+  // Tables superseded between parses are freed
+  struct Counted {
+    explicit Counted(int* live) : live(live) { (*live)++; }
+    Counted(Counted&& other) : live(other.live) { (*live)++; }
+    ~Counted() { (*live)--; }
+
+    int* live;
+  };
+
+  int live = 0;
+
+  {
+    tanuki::Lazy<Counted> table;
+
+    for (unsigned int version = 0; version < 10; version++) {
+      table.get([version]() { return version; },
+                [&live]() { return Counted(&live); });
+    }
+
+    tanuki_match_expect(true, (live == 1), "First superseded freed");
+  }
+
+  tanuki_match_expect(true, (live == 0), "First table freed");
+}
+
+void testGrammarFactoring() {
+  use_tanuki;
+
+  class TriedToken : public tanuki::IntegerToken {
+   public:
+    explicit TriedToken(int* tries) : tanuki::IntegerToken(), m_tries(tries) {}
+
+    tanuki::Piece<int> consumeAt(const tanuki::String& in,
+                                 uint64_t offset) override {
+      (*m_tries)++;
+      return tanuki::IntegerToken::consumeAt(in, offset);
+    }
+
+    int64_t recognizeAt(const tanuki::String& in, uint64_t offset) override {
+      (*m_tries)++;
+      return tanuki::IntegerToken::recognizeAt(in, offset);
+    }
+
+   private:
+    int* m_tries;
+  };
+
+  int tries = 0;
+  int calls = 0;
+
+  ref<TriedToken> number = make_ref<TriedToken>(&tries);
+  ref<Fragment<int>> operation = fragment<int>();
+
+  operation->handle(
+      [](ref<int> i, ref<char>, ref<int> j) -> ref<int> { return (i + j); },
+      number, constant('+'), integer());
+  operation->handle(
+      [](ref<int> i, ref<char>, ref<int> j) -> ref<int> { return (i - j); },
+      number, constant('-'), integer());
+  operation->handle(
+      [](ref<int> i, ref<char>, ref<int> j) -> ref<int> { return (i * j); },
+      number, constant('*'), integer());
+  operation->handle([](ref<int> i) { return i; }, number);
+
+  ref<int> result = operation->match("6*7");
+  tanuki_result_expect(42, result, "Factoring match");
+  // Once, and again for the short branch which also matches
+  tanuki_match_expect(true, (tries == 2), "Factoring leader once per match");
+
+  result = operation->match("42");
+  tanuki_result_expect(42, result, "Factoring short branch");
+
+  tries = 0;
+  tanuki_match_expect(true, operation->matches("6-7"), "Factoring recognize");
+  tanuki_match_expect(true, (tries == 1), "Factoring recognize leader once");
+
+  operation->skip(space());
+  result = operation->match("6 + 7");
+  tanuki_result_expect(13, result, "Factoring skip");
+
+  operation->deferred = true;
+  operation->handle(
+      [&calls](ref<int> i, ref<char>) -> ref<int> {
+        calls++;
+        return i;
+      },
+      integer(), constant('!'));
+
+  result = operation->match("6 - 7");
+  tanuki_result_expect(-1, result, "Factoring deferred");
+
+  ref<Fragment<int>> chain = fragment<int>();
+  master(chain);
+
+  auto a = constant('a');
+
+  chain->handle([](ref<char>) { return 1_ref; }, a);
+  chain->handle([](ref<char>, ref<char>) { return 2_ref; }, a, constant('b'));
+  chain->handle([](ref<int> in, ref<char>, ref<char>) { return in + 10; },
+                chain, constant('b'), constant('c'));
+
+  result = chain->match("abc");
+  tanuki_result_expect(11, result, "Factoring every seed");
+  tanuki_match_expect(true, chain->matches("abc"),
+                      "Factoring recognize every seed");
+  tanuki_match_expect(true, (calls == 0), "Factoring deferred not called");
+
+  // A branch changing the leader result doesn't change the one of the others
+  ref<Fragment<std::vector<int>>> lead = fragment<std::vector<int>>();
+  ref<Fragment<std::vector<int>>> series = fragment<std::vector<int>>();
+
+  lead->handle([](ref<char>) { return make_ref<std::vector<int>>(); },
+               constant('x'));
+  series->handle(
+      [](ref<std::vector<int>> values, ref<char>) {
+        values->push_back(1);
+        return values;
+      },
+      lead, constant('a'));
+  series->handle(
+      [](ref<std::vector<int>> values, ref<char>, ref<char>) {
+        values->push_back(2);
+        return values;
+      },
+      lead, constant('a'), constant('b'));
+
+  ref<std::vector<int>> values = series->match("xab");
+  tanuki_match_expect(true, (!values.isNull() && (values->size() == 1) &&
+                             (values->front() == 2)),
+                      "Factoring own leader result");
+}
+
+void testGrammarFirstMatch() {
+  use_tanuki;
+
+  int calls = 0;
+
+  ref<Fragment<int>> ordered = fragment<int>(Policy::FirstMatch);
+
+  ordered->handle(
+      [&calls](ref<int> i) -> ref<int> {
+        calls++;
+        return i;
+      },
+      integer());
+  ordered->handle(
+      [&calls](ref<int> i, ref<char>, ref<int> j) -> ref<int> {
+        calls++;
+        return (i + j);
+      },
+      integer(), constant('+'), integer());
+
+  tanuki::Piece<int> piece = ordered->consume("1+2");
+  tanuki_match_expect(true, (piece.length == 1), "First match ordered");
+  tanuki_match_expect(true, (calls == 1), "First match stops");
+  tanuki_match_expect(false, ordered->match("1+2"), "First match no longest");
+  tanuki_match_expect(false, ordered->matches("1+2"),
+                      "First match recognize");
+
+  ordered->policy = Policy::Longest;
+
+  ref<int> result = ordered->match("1+2");
+  tanuki_result_expect(3, result, "First match longest");
+
+  ref<Fragment<int>> minus = fragment<int>(Policy::FirstMatch);
+  master(minus);
+
+  minus->handle([](ref<int> i) { return i; }, integer());
+  minus->handle(
+      [](ref<int> i, ref<char>, ref<int> j) -> ref<int> { return (i - j); },
+      minus, constant('-'), integer());
+
+  result = minus->match("10-2-3");
+  tanuki_result_expect(5, result, "First match left recursive");
+  tanuki_match_expect(true, minus->matches("10-2-3"),
+                      "First match left recursive recognize");
+
+  minus->memoize = true;
+
+  result = minus->match("10-2-3");
+  tanuki_result_expect(5, result, "First match seed growing");
+  tanuki_match_expect(true, minus->matches("10-2-3"),
+                      "First match seed growing recognize");
+
+  minus->deferred = true;
+
+  result = minus->match("10-2-3");
+  tanuki_result_expect(5, result, "First match deferred seed growing");
+
+  minus->memoize = false;
+
+  result = minus->match("10-2-3");
+  tanuki_result_expect(5, result, "First match deferred");
+}
+
+void testGrammarSkip() {
+  use_tanuki;
+
+  ref<Fragment<int>> sum = fragment<int>();
+
+  sum->handle([](ref<int> i) { return i; }, integer());
+  sum->handle(
+      [](ref<int> i, ref<char>, ref<int> j) -> ref<int> { return (i + j); },
+      integer(), constant('+'), integer());
+  sum->skip(blank(), lineTerminator());
+
+  tanuki_result_expect(3, sum->match("1 \t+\r\n 2"), "Skip runs");
+  tanuki_match_expect(false, sum->match("1 + 2 "), "Skip runs not at end");
+  tanuki_match_expect(true, sum->matches("1\n+\n2"), "Skip runs recognize");
+
+  sum->skipAtEnd = true;
+
+  tanuki_result_expect(3, sum->match("1 + 2 \n"), "Skip runs at end");
+
+  sum->skip(range(constant("/*"), constant("*/")));
+
+  tanuki_result_expect(3, sum->match("1 /* one */+/**/ 2 /* end */"),
+                       "Skip comments");
+  tanuki_match_expect(false, sum->match("1 / 2"), "Skip comments only");
+  tanuki_match_expect(true, sum->matches(" 1/* + */ + 2"),
+                      "Skip comments recognize");
+}
+
+void testGrammarCallbacks() {
+  use_tanuki;
+
+  struct Negate {
+    ref<int> operator()(ref<char>, ref<int> i) const {
+      return make_ref<int>(-*dereference(i));
+    }
+  };
+
+  std::unique_ptr<int> scale(new int(10));
+  std::function<ref<int>(ref<int>)> same = [](ref<int> i) { return i; };
+
+  ref<Fragment<int>> number = fragment<int>();
+  master(number);
+
+  number->handle(same, integer());
+  number->handle(Negate(), constant('-'), integer());
+  number->handle(
+      [scale = std::move(scale)](ref<char>, ref<int> i) -> ref<int> {
+        return make_ref<int>(*dereference(i) * *scale);
+      },
+      constant('x'), integer());
+  number->handle(
+      [](std::tuple<ref<char>, ref<int>, ref<char>> group) -> ref<int> {
+        return std::get<1>(group);
+      },
+      constant('('), number, constant(')'));
+
+  tanuki_result_expect(5, number->match("5"), "Callback function");
+  tanuki_result_expect(-5, number->match("-5"), "Callback functor");
+  tanuki_result_expect(50, number->match("x5"), "Callback move only");
+  tanuki_result_expect(-50, number->match("((-50))"), "Callback tuple");
+
+  bool thrown = false;
+
+  try {
+    number->handle(std::function<ref<int>(ref<char>)>(), constant('!'));
+  } catch (const NoExecuteDefinition&) {
+    thrown = true;
+  }
+
+  tanuki_match_expect(true, thrown, "Callback empty");
+}
+
+void testGrammarProgram() {
+  use_tanuki;
+
+  ref<Fragment<int>> sum = fragment<int>();
+  ref<Fragment<int>> term = fragment<int>();
+  master(sum);
+
+  sumGrammar(sum, term);
+
+  ref<Program> program = sum->program();
+  bool same = true;
+
+  for (const char* input : {"1", "1+2", "(1 + 2)+ 3", "((4))", "1+", "(1",
+                            " 1 +(2+ (3))", "+1", ""}) {
+    same = (same &&
+            (sum->recognizeAt(input, 0) == program->recognizeAt(input, 0)));
+  }
+
+  tanuki_match_expect(true, same, "Program recognize");
+  tanuki_match_expect(true, (program->recognizeAt("99999999999", 0) == -1),
+                      "Program integer overflow");
+
+  ref<Fragment<int>> bounded = fragment<int>();
+
+  bounded->handle([](ref<int8_t>) { return make_ref<int>(0); },
+                  integer<int8_t>(true));
+  program = bounded->program();
+
+  tanuki_match_expect(true,
+                      (program->matches("-128") && program->matches("127") &&
+                       !program->matches("-129") && !program->matches("128") &&
+                       !program->matches("-")),
+                      "Program integer bounds");
+
+  ref<Fragment<int>> ordered = fragment<int>(Policy::FirstMatch);
+
+  ordered->handle([](ref<std::string>) { return make_ref<int>(1); },
+                  constant("a"));
+  ordered->handle([](ref<std::string>) { return make_ref<int>(2); },
+                  constant("ab"));
+
+  tanuki_match_expect(true, (ordered->program()->recognizeAt("ab", 0) == 1),
+                      "Program first match");
+
+  ordered->policy = Policy::Longest;
+
+  tanuki_match_expect(true, (ordered->program()->recognizeAt("ab", 0) == 2),
+                      "Program longest");
+
+  // Left recursion, ranges and comments aren't lowered but called as they are
+  ref<Fragment<int>> minus = fragment<int>(Policy::FirstMatch);
+  ref<Fragment<int>> statement = fragment<int>();
+  master(minus);
+
+  minus->handle([](ref<int> i) { return i; }, integer());
+  minus->handle(
+      [](ref<int> i, ref<char>, ref<int> j) -> ref<int> { return (i - j); },
+      minus, constant('-'), integer());
+  statement->handle(
+      [](ref<std::string>, ref<int> i) { return i; },
+      range(constant('<'), constant('>')), minus);
+  statement->skip(range(constant("/*"), constant("*/")));
+
+  program = statement->program();
+
+  tanuki_match_expect(true, program->matches("<a>10-2-3"),
+                      "Program left recursive");
+  tanuki_match_expect(true, program->matches("/* 1 */<b>/**/1-2"),
+                      "Program not lowered");
+  tanuki_match_expect(false, program->matches("<c>-1"),
+                      "Program not lowered mismatch");
+
+  // Recognizing nesting is only bounded by memory, matching still recurses
+  ref<Fragment<int>> nested = fragment<int>();
+  master(nested);
+
+  nestedGrammar(nested);
+
+  std::string deep = std::string(100000, '(') + "x" + std::string(100000, ')');
+
+  tanuki_match_expect(true, nested->program()->matches(deep),
+                      "Program deeply nested");
+  tanuki_match_expect(false, nested->program()->matches(deep + ")"),
+                      "Program deeply nested mismatch");
+
+  // Each level tries both rules of sum on the same term, which is only
+  // recognized once per offset when memoized. The integer, without a
+  // pattern, is called as a native, so the calls tell how often terms are
+  // recognized
+  class CountedToken : public tanuki::IntegerToken {
+   public:
+    explicit CountedToken(int* calls) : m_calls(calls) {}
+
+    int64_t recognizeAt(const tanuki::String& in, uint64_t offset) override {
+      (*m_calls)++;
+      return tanuki::IntegerToken::recognizeAt(in, offset);
+    }
+
+   private:
+    int* m_calls;
+  };
+
+  int calls = 0;
+  ref<Fragment<int>> memoSum = fragment<int>();
+  ref<Fragment<int>> memoTerm = fragment<int>();
+  master(memoSum);
+
+  sumGrammar(memoSum, memoTerm, make_ref<CountedToken>(&calls));
+  memoSum->memoize = true;
+  memoTerm->memoize = true;
+  program = memoSum->program();
+
+  std::string parenthesized =
+      std::string(40, '(') + "1 + 2" + std::string(40, ')') + " + 3";
+
+  tanuki_match_expect(true, program->matches(parenthesized),
+                      "Program memoized");
+  tanuki_match_expect(true, (calls <= (int)parenthesized.size()),
+                      "Program memoized once per offset");
+}
+
+// Calls to the natives of MemoSumRecognizer, the integers of its grammar
+int memoSumNatives = 0;
+
+int64_t MemoSumRecognizer::native(int, const std::string& in,
+                                  uint64_t offset) {
+  static auto number = tanuki::integer();
+
+  memoSumNatives++;
+
+  return number->recognizeAt(in, offset);
+}
+
+int64_t TagRecognizer::native(int, const std::string& in, uint64_t offset) {
+  use_tanuki;
+
+  static auto tag = range(constant('<'), constant('>'));
+
+  return tag->recognizeAt(in, offset);
+}
+
+void testGrammarGenerated() {
+  use_tanuki;
+
+  ref<Fragment<int>> sum = fragment<int>();
+  ref<Fragment<int>> term = fragment<int>();
+  master(sum);
+
+  sumGrammar(sum, term);
+
+  bool same = true;
+
+  for (const char* input : {"1", "1+2", "(1 + 2)+ 3", "((4))", "1+", "(1",
+                            " 1 +(2+ (3))", "+1", ""}) {
+    same = (same && (sum->recognizeAt(input, 0) ==
+                     SumRecognizer::recognizeAt(input, 0)));
+  }
+
+  tanuki_match_expect(true, same, "Generated recognize");
+  tanuki_match_expect(false, SumRecognizer::matches("99999999999"),
+                      "Generated integer overflow");
+  tanuki_match_expect(true, SumRecognizer::matches("12 + (3 + 4)"),
+                      "Generated matches");
+  tanuki_match_expect(false, SumRecognizer::matches("12 + (3 + 4"),
+                      "Generated mismatch");
+
+  std::string deep = std::string(100000, '(') + "x" + std::string(100000, ')');
+
+  tanuki_match_expect(true, NestedRecognizer::matches(deep),
+                      "Generated deeply nested");
+  tanuki_match_expect(false, NestedRecognizer::matches(deep + ")"),
+                      "Generated deeply nested mismatch");
+
+  std::string parenthesized =
+      std::string(40, '(') + "1 + 2" + std::string(40, ')') + " + 3";
+
+  tanuki_match_expect(true, MemoSumRecognizer::matches(parenthesized),
+                      "Generated memoized");
+  tanuki_match_expect(true, (memoSumNatives <= (int)parenthesized.size()),
+                      "Generated memoized once per offset");
+
+  tanuki_match_expect(true, TagRecognizer::matches("#<a>"),
+                      "Generated natives");
+  tanuki_match_expect(false, TagRecognizer::matches("#<a"),
+                      "Generated natives mismatch");
+
+  // Without natives, the token which has no pattern is named
+  std::string diagnostic;
+  ref<Fragment<int>> tag = fragment<int>();
+
+  tagGrammar(tag);
+
+  try {
+    std::ostringstream out;
+
+    tag->program()->generateRecognizer(out, "TagRecognizer");
+  } catch (const NotLoweredError& error) {
+    diagnostic = error.what();
+  }
+
+  tanuki_match_expect(true,
+                      (diagnostic.find("RangeToken") != std::string::npos),
+                      "Generated natives named");
+}